@@ -15,6 +15,8 @@ project "bx"
         "../twine"
     }
 
+    links { "m" }
+
     filter "action:gmake2"
         buildoptions {
             "-Wpedantic",
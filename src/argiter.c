@@ -11,6 +11,10 @@ ArgIter iter_create(int argc, const char **argv) {
 }
 
 const char *iter_peek(ArgIter *iter) {
+    if (iter->value) {
+        return iter->value;
+    }
+
     if (iter->length == 0) {
         return NULL;
     }
@@ -18,7 +22,13 @@ const char *iter_peek(ArgIter *iter) {
     return iter->args[0];
 }
 
+// The value of a `--name=value` flag comes first, as if it were the next
+// argument.
 const char *iter_next(ArgIter *iter) {
+    if (iter->value) {
+        return iter_value(iter);
+    }
+
     if (iter->length == 0) {
         return NULL;
     }
@@ -32,6 +42,14 @@ void iter_back(ArgIter *iter) {
     iter->args--;
 }
 
+// Takes the value given with the current flag as `--name=value`, or NULL if
+// there wasn't one. For flags whose value is optional.
+const char *iter_value(ArgIter *iter) {
+    const char *value = iter->value;
+    iter->value = NULL;
+    return value;
+}
+
 bool iter_match(ArgIter *iter, const char *arg) {
     if (iter->length == 0) {
         return false;
@@ -59,7 +77,9 @@ bool iter_check_flags(ArgIter *iter, const char *const *flags) {
         }
         return false;
     } else if (is_long(arg)) {
-        return strcmp(&arg[2], flags[1]) == 0;
+        // Also matches `--name=value`. See `process_options`.
+        size_t len = strlen(flags[1]);
+        return strncmp(&arg[2], flags[1], len) == 0 && (arg[2 + len] == '\0' || arg[2 + len] == '=');
     } else {
         return false;
     }
@@ -6,12 +6,14 @@
 typedef struct ArgIter {
 	int length;
 	const char **args;
+	const char *value;      // Given with the flag being handled as `--name=value`.
 } ArgIter;
 
 ArgIter iter_create(int argc, const char **argv);
 const char *iter_peek(ArgIter *iter);
 const char *iter_next(ArgIter *iter);
 void iter_back(ArgIter *iter);
+const char *iter_value(ArgIter *iter);
 bool iter_match(ArgIter *iter, const char *arg);
 bool iter_check_flags(ArgIter *iter, const char *const *flags);
 
@@ -0,0 +1,2021 @@
+#include "builder.h"
+#include "cache.h"
+#include "http.h"
+#include "jobs.h"
+#include "modules.h"
+#include "proc.h"
+#include "strmap.h"
+#include "timetrace.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct SourceFile {
+    char *path;
+    bool is_cpp;
+} SourceFile;
+
+typedef struct SourceTree {
+    SourceFile *files;
+    size_t length;
+    size_t capacity;
+} SourceTree;
+
+typedef struct TransUnit {
+    const SourceFile *src;
+    char *obj;
+    char *dep;
+    char *dwo;              // Written by -gsplit-dwarf compiles.
+    const char *pch;        // Precompiled header stub to include, or NULL.
+    const char *pch_source; // What `pch` includes, for preprocessing without the .gch.
+    StrList module_args;    // Flags for finding and producing BMIs. Empty without modules.
+    bool dirty;
+} TransUnit;
+
+static const char *c_exts[] = { ".c" };
+static const char *cpp_exts[] = { ".cpp", ".cxx", ".cc", ".cppm", ".ixx", ".mpp", ".cxxm" };
+
+static bool dialect_is_cpp(Dialect dialect) {
+    return dialect >= CPP11;
+}
+
+static bool dialect_has_modules(Dialect dialect) {
+    return dialect >= CPP20;
+}
+
+const char *c_compiler(void) {
+    const char *cc = getenv("CC");
+    return cc && *cc ? cc : "cc";
+}
+
+static const char *cpp_compiler(void) {
+    const char *cxx = getenv("CXX");
+    return cxx && *cxx ? cxx : "c++";
+}
+
+static bool compiler_is_clang(const char *compiler);
+
+static void add_lto_flags(BuildConfig *config, const ProjConf *proj) {
+    if (proj->lto <= LTO_OFF) {
+        return;
+    }
+
+    // GCC has no ThinLTO, but its default LTO is partitioned and runs the
+    // partitions in parallel, which comes closest.
+    const char *flag = "-flto=auto";
+    if (compiler_is_clang(project_compiler(proj))) {
+        config->thin_lto = proj->lto == LTO_THIN;
+        flag = config->thin_lto ? "-flto=thin" : "-flto";
+    }
+
+    strlist_push(&config->cflags, flag);
+    strlist_push(&config->ldflags, flag);
+    // The optimizations run again when linking, at the level given there.
+    strlist_push(&config->ldflags, "-O3");
+}
+
+// Profiles every project has besides debug and release. A profile of the
+// same name in conf.ini replaces one.
+typedef struct BuiltinProfile {
+    const char *name;
+    const char *inherits;
+    const char *cflags[3];
+    const char *ldflags[2];
+} BuiltinProfile;
+
+static const BuiltinProfile builtin_profiles[] = {
+    { "relwithdebinfo", "release", { "-g" }, {0} },
+    { "native", "release", { "-march=native" }, {0} },
+    // Frame pointers let profilers walk the stack cheaply.
+    { "profile", "release", { "-g", "-fno-omit-frame-pointer" }, {0} },
+    { "asan", "debug", { "-fsanitize=address,undefined", "-fno-omit-frame-pointer" }, { "-fsanitize=address,undefined" } },
+};
+
+// `chain` holds the profiles that inherit from `name`, outermost first.
+static bool add_profile_flags(BuildConfig *config, const ProjConf *proj, const char *name, StrList *chain) {
+    for (size_t i = 0; i < chain->length; i++) {
+        if (strcmp(chain->items[i], name) != 0) {
+            continue;
+        }
+
+        StrBuf cycle = {0};
+        for (size_t j = i; j < chain->length; j++) {
+            strbuf_appendf(&cycle, "%s -> ", chain->items[j]);
+        }
+        logprint(LOG_ERROR, "Profile '%s' inherits from itself: %s%s.", name, cycle.bytes, name);
+        strbuf_free(&cycle);
+        return false;
+    }
+    strlist_push(chain, name);
+
+    const Profile *profile = find_profile(proj, name);
+    if (profile) {
+        if (profile->inherits && !add_profile_flags(config, proj, profile->inherits, chain)) {
+            return false;
+        }
+        strlist_extend(&config->cflags, &profile->cflags);
+        strlist_extend(&config->ldflags, &profile->ldflags);
+        return true;
+    }
+
+    for (size_t i = 0; i < sizeof(builtin_profiles) / sizeof(builtin_profiles[0]); i++) {
+        const BuiltinProfile *builtin = &builtin_profiles[i];
+        if (strcmp(builtin->name, name) != 0) {
+            continue;
+        }
+
+        if (!add_profile_flags(config, proj, builtin->inherits, chain)) {
+            return false;
+        }
+        for (size_t j = 0; j < sizeof(builtin->cflags) / sizeof(builtin->cflags[0]) && builtin->cflags[j]; j++) {
+            strlist_push(&config->cflags, builtin->cflags[j]);
+        }
+        for (size_t j = 0; j < sizeof(builtin->ldflags) / sizeof(builtin->ldflags[0]) && builtin->ldflags[j]; j++) {
+            strlist_push(&config->ldflags, builtin->ldflags[j]);
+        }
+        return true;
+    }
+
+    if (strcmp(name, "debug") == 0) {
+        strlist_push(&config->cflags, "-DDEBUG");
+        strlist_push(&config->cflags, "-g");
+        strlist_push(&config->cflags, "-Og");
+#ifndef __APPLE__
+        // Keeps most debug info out of the objects, so links have less
+        // to copy.
+        strlist_push(&config->cflags, "-gsplit-dwarf");
+        config->split_dwarf = true;
+#endif
+    } else if (strcmp(name, "release") == 0) {
+        strlist_push(&config->cflags, "-DNDEBUG");
+        strlist_push(&config->cflags, "-O3");
+        add_lto_flags(config, proj);
+    } else {
+        logprint(LOG_ERROR, "'%s' is not a valid build configuration. Define it in a [profile %s] section of conf.ini.", name, name);
+        return false;
+    }
+
+    return true;
+}
+
+bool build_config_init(BuildConfig *config, const ProjConf *proj, const char *name) {
+    *config = (BuildConfig){ .name = name };
+
+    // Mirrors the flags of the premake file generated by `bx new`.
+    strlist_push(&config->cflags, "-Wpedantic");
+    strlist_push(&config->cflags, "-Wall");
+    strlist_push(&config->cflags, "-Wextra");
+    strlist_push(&config->cflags, "-Werror");
+    strlist_pushf(&config->cflags, "-I%s", proj->src_dir);
+
+    StrList chain = {0};
+    bool ok = add_profile_flags(config, proj, name, &chain);
+    strlist_free(&chain);
+    if (!ok) {
+        build_config_free(config);
+    }
+
+    return ok;
+}
+
+void build_config_free(BuildConfig *config) {
+    strlist_free(&config->cflags);
+    strlist_free(&config->ldflags);
+}
+
+static bool has_ext(const char *name, const char **exts, size_t exts_len) {
+    for (size_t i = 0; i < exts_len; i++) {
+        if (ends_with(name, exts[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void source_tree_push(SourceTree *tree, const char *path, bool is_cpp) {
+    if (tree->length == tree->capacity) {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 64;
+        tree->files = realloc(tree->files, tree->capacity * sizeof(*tree->files));
+    }
+
+    tree->files[tree->length++] = (SourceFile){
+        .path = strdup(path),
+        .is_cpp = is_cpp,
+    };
+}
+
+static void source_tree_free(SourceTree *tree) {
+    for (size_t i = 0; i < tree->length; i++) {
+        free(tree->files[i].path);
+    }
+    free(tree->files);
+    *tree = (SourceTree){0};
+}
+
+// Directory listings and parsed dependency files are kept between builds
+// and reused while the file they came from has the same mtime. Entries whose
+// mtime is too recent aren't trusted, since a change within the same clock
+// tick wouldn't be noticed.
+#define RACY_NS (2000000000ll)
+
+typedef struct DirListing {
+    int64_t mtime;
+    StrList names;          // Subdirectories end with '/'.
+} DirListing;
+
+typedef struct DepList {
+    int64_t mtime;
+    StrList paths;
+    size_t leading;         // Parsed includes only: how many of `paths` the source starts by including.
+} DepList;
+
+typedef struct FileStat {
+    int64_t mtime;
+    bool exists;
+} FileStat;
+
+// Whether a remote cache answered, and when it was asked. The answer is
+// trusted for a while so consecutive builds don't each wait on the network.
+#define REMOTE_PROBE_NS (60ll * 1000000000)
+
+typedef struct RemoteProbe {
+    bool reachable;
+    int64_t when;
+} RemoteProbe;
+
+struct BuildState {
+    StrMap dirs;            // Directory -> DirListing.
+    StrMap deps;            // Dependency file -> DepList.
+    StrMap includes;        // Source -> DepList of the <...> headers it includes.
+    StrMap stats;           // Path -> FileStat. Only valid during one build.
+    StrMap compiler_ids;    // Compiler and its stamp -> compiler_identity.
+    StrMap remotes;         // Remote cache URL -> RemoteProbe.
+};
+
+BuildState *build_state_new(void) {
+    return calloc(1, sizeof(BuildState));
+}
+
+static void build_state_forget_stats(BuildState *state) {
+    for (size_t i = 0; i < state->stats.capacity; i++) {
+        free(state->stats.entries[i].value);
+    }
+    strmap_free(&state->stats);
+}
+
+void build_state_free(BuildState *state) {
+    if (!state) {
+        return;
+    }
+
+    for (size_t i = 0; i < state->dirs.capacity; i++) {
+        DirListing *listing = state->dirs.entries[i].value;
+        if (listing) {
+            strlist_free(&listing->names);
+            free(listing);
+        }
+    }
+    for (size_t i = 0; i < state->deps.capacity; i++) {
+        DepList *deps = state->deps.entries[i].value;
+        if (deps) {
+            strlist_free(&deps->paths);
+            free(deps);
+        }
+    }
+    for (size_t i = 0; i < state->includes.capacity; i++) {
+        DepList *includes = state->includes.entries[i].value;
+        if (includes) {
+            strlist_free(&includes->paths);
+            free(includes);
+        }
+    }
+    for (size_t i = 0; i < state->compiler_ids.capacity; i++) {
+        free(state->compiler_ids.entries[i].value);
+    }
+    for (size_t i = 0; i < state->remotes.capacity; i++) {
+        free(state->remotes.entries[i].value);
+    }
+    strmap_free(&state->dirs);
+    strmap_free(&state->deps);
+    strmap_free(&state->includes);
+    strmap_free(&state->compiler_ids);
+    strmap_free(&state->remotes);
+    build_state_forget_stats(state);
+    free(state);
+}
+
+static int64_t now_wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// mtime to remember a file by, or INT64_MIN if it changed too recently to
+// be trusted next time.
+static int64_t trusted_mtime(int64_t mtime) {
+    return now_wall_ns() - mtime > RACY_NS ? mtime : INT64_MIN;
+}
+
+// Headers are shared by many translation units, so each one is only
+// stat-ed once per build.
+static bool cached_mtime(BuildState *state, const char *path, int64_t *mtime) {
+    FileStat *s = strmap_get(&state->stats, path);
+    if (!s) {
+        s = malloc(sizeof(*s));
+        s->exists = file_mtime(path, &s->mtime);
+        strmap_put(&state->stats, path, s);
+    }
+
+    *mtime = s->mtime;
+    return s->exists;
+}
+
+static const DirListing *list_dir(BuildState *state, const char *dir) {
+    int64_t mtime;
+    if (!file_mtime(dir, &mtime)) {
+        return NULL;
+    }
+
+    DirListing *listing = strmap_get(&state->dirs, dir);
+    if (listing && listing->mtime == mtime) {
+        return listing;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return NULL;
+    }
+
+    if (!listing) {
+        listing = calloc(1, sizeof(*listing));
+        strmap_put(&state->dirs, dir, listing);
+    }
+    strlist_free(&listing->names);
+    listing->mtime = trusted_mtime(mtime);
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+            struct stat s;
+            is_dir = stat(path, &s) == 0 && S_ISDIR(s.st_mode);
+        }
+
+        if (is_dir) {
+            strlist_pushf(&listing->names, "%s/", entry->d_name);
+        } else {
+            strlist_push(&listing->names, entry->d_name);
+        }
+    }
+
+    closedir(d);
+    return listing;
+}
+
+static bool scan_sources(BuildState *state, const char *dir, SourceTree *tree) {
+    const DirListing *listing = list_dir(state, dir);
+    if (!listing) {
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to open source directory '%s': %s.", dir, err);
+        return false;
+    }
+
+    for (size_t i = 0; i < listing->names.length; i++) {
+        const char *name = listing->names.items[i];
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+        if (ends_with(name, "/")) {
+            path[strlen(path) - 1] = '\0';
+            if (!scan_sources(state, path, tree)) {
+                return false;
+            }
+        } else if (has_ext(name, c_exts, sizeof(c_exts) / sizeof(c_exts[0]))) {
+            source_tree_push(tree, path, false);
+        } else if (has_ext(name, cpp_exts, sizeof(cpp_exts) / sizeof(cpp_exts[0]))) {
+            source_tree_push(tree, path, true);
+        }
+    }
+
+    return true;
+}
+
+static int compare_sources(const void *a, const void *b) {
+    return strcmp(((const SourceFile *)a)->path, ((const SourceFile *)b)->path);
+}
+
+static bool unity_excluded(const ProjConf *proj, const char *path) {
+    size_t src_len = strlen(proj->src_dir);
+    const char *rel = path;
+    if (strncmp(path, proj->src_dir, src_len) == 0 && path[src_len] == '/') {
+        rel = path + src_len + 1;
+    }
+
+    for (size_t i = 0; i < proj->unity_exclude.length; i++) {
+        const char *pattern = proj->unity_exclude.items[i];
+        if (fnmatch(pattern, rel, 0) == 0 || fnmatch(pattern, path, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct UnityBatch {
+    StrList paths;
+    uint64_t size;
+} UnityBatch;
+
+// Writes `batch` out as one source that includes each of its files and adds
+// it to `unity`. A batch of one is compiled as it is.
+static bool flush_unity_batch(UnityBatch *batch, bool is_cpp, size_t *index, SourceTree *unity) {
+    bool result = true;
+    StrBuf contents = {0};
+
+    if (batch->paths.length == 0) {
+        RETURN(true);
+    }
+
+    if (batch->paths.length == 1) {
+        source_tree_push(unity, batch->paths.items[0], is_cpp);
+        RETURN(true);
+    }
+
+    // Included relative to UNITY_DIR, which is two levels below the project.
+    strbuf_append(&contents, "// Generated by `bx build --unity`. Do not edit.\n");
+    for (size_t i = 0; i < batch->paths.length; i++) {
+        const char *path = batch->paths.items[i];
+        strbuf_appendf(&contents, "#include \"%s%s\"\n", path[0] == '/' ? "" : "../../", path);
+    }
+
+    char unity_path[PATH_MAX];
+    snprintf(unity_path, sizeof(unity_path), UNITY_DIR"/unity-%03zu%s", (*index)++, is_cpp ? ".cpp" : ".c");
+
+    // Unchanged batches keep their mtime so they aren't recompiled.
+    if (!write_file_if_changed(unity_path, contents.bytes, contents.length)) {
+        RETURN(false);
+    }
+    source_tree_push(unity, unity_path, is_cpp);
+
+CLEAN_UP_AND_RETURN:
+    strlist_free(&batch->paths);
+    *batch = (UnityBatch){0};
+    strbuf_free(&contents);
+    return result;
+}
+
+// Groups the files of `tree` into unity sources so headers they share are
+// parsed once per batch rather than once per file. C and C++ files are
+// batched separately, and files matching `unity_exclude` are left alone.
+static bool make_unity_tree(const ProjConf *proj, const BuildOptions *opts, const SourceTree *tree, SourceTree *unity) {
+    if (!make_dirs(UNITY_DIR)) {
+        return false;
+    }
+
+    UnityBatch batches[2] = {0};
+    size_t index = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < tree->length && ok; i++) {
+        const SourceFile *src = &tree->files[i];
+        bool module_unit = src->is_cpp && dialect_has_modules(proj->dialect) && module_scan_needed(src->path);
+        if (module_unit || unity_excluded(proj, src->path)) {
+            source_tree_push(unity, src->path, src->is_cpp);
+            continue;
+        }
+
+        struct stat s;
+        UnityBatch *batch = &batches[src->is_cpp];
+        strlist_push(&batch->paths, src->path);
+        batch->size += stat(src->path, &s) == 0 ? (uint64_t)s.st_size : 0;
+
+        bool full = opts->unity_size
+            ? batch->size >= opts->unity_size
+            : batch->paths.length >= opts->unity_files;
+        if (full) {
+            ok = flush_unity_batch(batch, src->is_cpp, &index, unity);
+        }
+    }
+
+    ok = ok && flush_unity_batch(&batches[0], false, &index, unity);
+    ok = ok && flush_unity_batch(&batches[1], true, &index, unity);
+    strlist_free(&batches[0].paths);
+    strlist_free(&batches[1].paths);
+
+    if (unity->length > 0) {
+        qsort(unity->files, unity->length, sizeof(*unity->files), compare_sources);
+    }
+    return ok;
+}
+
+// Parses the prerequisites out of the make-style dependency file at
+// `dep_path`.
+static bool parse_deps(const char *dep_path, StrList *paths) {
+    char *contents = read_file(dep_path, NULL);
+    if (!contents) {
+        return false;
+    }
+
+    // Skip the target.
+    char *c = strchr(contents, ':');
+    if (!c) {
+        free(contents);
+        return false;
+    }
+    c++;
+
+    char path[PATH_MAX];
+    while (*c != '\0') {
+        if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') {
+            c++;
+            continue;
+        }
+
+        if (c[0] == '\\' && (c[1] == '\n' || c[1] == '\r')) {
+            c += 2;
+            continue;
+        }
+
+        size_t len = 0;
+        while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') {
+            if (c[0] == '\\' && c[1] == ' ') {
+                c++;
+            } else if (c[0] == '\\' && (c[1] == '\n' || c[1] == '\r')) {
+                break;
+            }
+            if (len + 1 < sizeof(path)) {
+                path[len++] = *c;
+            }
+            c++;
+        }
+        path[len] = '\0';
+
+        if (len > 0) {
+            strlist_push(paths, path);
+        }
+    }
+
+    free(contents);
+    return true;
+}
+
+static const DepList *load_deps(BuildState *state, const char *dep_path) {
+    int64_t mtime;
+    if (!file_mtime(dep_path, &mtime)) {
+        return NULL;
+    }
+
+    DepList *deps = strmap_get(&state->deps, dep_path);
+    if (deps && deps->mtime == mtime) {
+        return deps;
+    }
+
+    if (!deps) {
+        deps = calloc(1, sizeof(*deps));
+        strmap_put(&state->deps, dep_path, deps);
+    }
+    strlist_free(&deps->paths);
+    deps->mtime = INT64_MIN;
+
+    if (!parse_deps(dep_path, &deps->paths)) {
+        return NULL;
+    }
+    deps->mtime = trusted_mtime(mtime);
+
+    return deps;
+}
+
+// Returns true if the make-style dependency file at `dep_path` is missing or
+// lists any file modified after `mtime`.
+static bool deps_newer_than(BuildState *state, const char *dep_path, int64_t mtime) {
+    const DepList *deps = load_deps(state, dep_path);
+    if (!deps) {
+        return true;
+    }
+
+    for (size_t i = 0; i < deps->paths.length; i++) {
+        int64_t dep_mtime;
+        if (!cached_mtime(state, deps->paths.items[i], &dep_mtime) || dep_mtime > mtime) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Headers included by at least half of a language's sources go into the
+// automatic precompiled header, as long as there are enough sources to make
+// building it worthwhile.
+#define PCH_MIN_SOURCES (4)
+#define PCH_DIR BUILDX_DIR"/pch"
+
+static const char *skip_blanks(const char *c) {
+    while (*c == ' ' || *c == '\t') c++;
+    return c;
+}
+
+// Returns true if `line` holds nothing but blanks and comments. `in_comment`
+// carries a /* comment over from one line to the next.
+static bool is_blank_line(const char *line, bool *in_comment) {
+    const char *c = line;
+    const char *end = strchr(c, '\n');
+    if (!end) end = c + strlen(c);
+
+    while (c < end) {
+        if (*in_comment) {
+            if (c[0] == '*' && c[1] == '/') {
+                *in_comment = false;
+                c += 2;
+            } else {
+                c++;
+            }
+        } else if (*c == ' ' || *c == '\t' || *c == '\r') {
+            c++;
+        } else if (c[0] == '/' && c[1] == '/') {
+            return true;
+        } else if (c[0] == '/' && c[1] == '*') {
+            *in_comment = true;
+            c += 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses the <...> includes out of the source at `path`. Includes inside
+// conditional blocks are skipped since they may not apply to every build.
+// `leading` is set to how many of them are in the block of includes the
+// source starts with, before any other directive or code.
+static bool parse_includes(const char *path, StrList *headers, size_t *leading) {
+    char *contents = read_file(path, NULL);
+    if (!contents) {
+        return false;
+    }
+
+    *leading = 0;
+    bool in_leading = true;
+    bool in_comment = false;
+    int depth = 0;
+    for (char *line = contents; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        const char *c = skip_blanks(line);
+        if (in_leading && !is_blank_line(line, &in_comment)) {
+            in_leading = *c == '#' && starts_with(skip_blanks(c + 1), "include");
+        }
+        if (*c != '#') {
+            continue;
+        }
+        c = skip_blanks(c + 1);
+
+        if (starts_with(c, "if")) {
+            depth++;
+        } else if (starts_with(c, "endif")) {
+            depth--;
+        } else if (depth == 0 && starts_with(c, "include")) {
+            c = skip_blanks(c + strlen("include"));
+            const char *end = *c == '<' ? strpbrk(c, ">\n") : NULL;
+            if (!end || *end != '>') {
+                continue;
+            }
+
+            char header[PATH_MAX];
+            snprintf(header, sizeof(header), "%.*s", (int)(end - c - 1), c + 1);
+
+            bool seen = false;
+            for (size_t i = 0; i < headers->length && !seen; i++) {
+                seen = strcmp(headers->items[i], header) == 0;
+            }
+            if (!seen) {
+                strlist_push(headers, header);
+            }
+            if (in_leading) {
+                *leading = headers->length;
+            }
+        }
+    }
+
+    free(contents);
+    return true;
+}
+
+static const DepList *load_includes(BuildState *state, const char *path) {
+    int64_t mtime;
+    if (!file_mtime(path, &mtime)) {
+        return NULL;
+    }
+
+    DepList *includes = strmap_get(&state->includes, path);
+    if (includes && includes->mtime == mtime) {
+        return includes;
+    }
+
+    if (!includes) {
+        includes = calloc(1, sizeof(*includes));
+        strmap_put(&state->includes, path, includes);
+    }
+    strlist_free(&includes->paths);
+    includes->mtime = INT64_MIN;
+
+    if (!parse_includes(path, &includes->paths, &includes->leading)) {
+        return NULL;
+    }
+    includes->mtime = trusted_mtime(mtime);
+
+    return includes;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Finds the <...> headers that at least half of the sources of one language
+// start by including.
+static void find_common_headers(BuildState *state, const SourceTree *tree, bool is_cpp, StrList *headers) {
+    StrMap counts = {0};
+    size_t sources = 0;
+
+    for (size_t i = 0; i < tree->length; i++) {
+        if (tree->files[i].is_cpp != is_cpp) {
+            continue;
+        }
+        sources++;
+
+        const DepList *includes = load_includes(state, tree->files[i].path);
+        for (size_t j = 0; includes && j < includes->leading; j++) {
+            const char *header = includes->paths.items[j];
+            uintptr_t count = (uintptr_t)strmap_get(&counts, header);
+            strmap_put(&counts, header, (void *)(count + 1));
+        }
+    }
+
+    for (size_t i = 0; i < counts.capacity && sources >= PCH_MIN_SOURCES; i++) {
+        const StrMapEntry *entry = &counts.entries[i];
+        if (entry->key && (uintptr_t)entry->value * 2 >= sources) {
+            strlist_push(headers, entry->key);
+        }
+    }
+
+    if (headers->length > 0) {
+        qsort(headers->items, headers->length, sizeof(*headers->items), compare_strings);
+    }
+    strmap_free(&counts);
+}
+
+static void join_args(StrBuf *buf, char *const *argv) {
+    for (char *const *arg = argv; *arg; arg++) {
+        if (arg != argv) strbuf_append(buf, " ");
+        strbuf_append(buf, *arg);
+    }
+}
+
+// Returns true if `stamp_path` does not already contain `contents`.
+static bool stamp_changed(const char *stamp_path, const StrBuf *contents) {
+    size_t length;
+    char *old = read_file(stamp_path, &length);
+    if (!old) {
+        return true;
+    }
+
+    bool changed = length != contents->length || memcmp(old, contents->bytes, length) != 0;
+    free(old);
+    return changed;
+}
+
+static void compiler_args(StrList *argv, const ProjConf *proj, const BuildConfig *config, bool is_cpp) {
+    strlist_push(argv, is_cpp ? cpp_compiler() : c_compiler());
+    if (is_cpp == dialect_is_cpp(proj->dialect)) {
+        strlist_pushf(argv, "-std=%s", dialect_names[proj->dialect]);
+    }
+    strlist_extend(argv, &config->cflags);
+}
+
+static void preprocess_args(StrList *argv, const ProjConf *proj, const BuildConfig *config, const TransUnit *tu) {
+    compiler_args(argv, proj, config, tu->src->is_cpp);
+    if (tu->pch_source) {
+        strlist_push(argv, "-include");
+        strlist_push(argv, tu->pch_source);
+    }
+    strlist_push(argv, "-MMD");
+    strlist_push(argv, "-MF");
+    strlist_push(argv, tu->dep);
+    strlist_push(argv, "-MT");
+    strlist_push(argv, tu->obj);
+    strlist_push(argv, "-E");
+    strlist_push(argv, tu->src->path);
+}
+
+static void compile_args(StrList *argv, const ProjConf *proj, const BuildConfig *config, const TransUnit *tu) {
+    compiler_args(argv, proj, config, tu->src->is_cpp);
+    if (tu->pch) {
+        strlist_push(argv, "-include");
+        strlist_push(argv, tu->pch);
+    }
+    strlist_extend(argv, &tu->module_args);
+    strlist_push(argv, "-MMD");
+    strlist_push(argv, "-MF");
+    strlist_push(argv, tu->dep);
+    strlist_push(argv, "-c");
+    strlist_push(argv, tu->src->path);
+    strlist_push(argv, "-o");
+    strlist_push(argv, tu->obj);
+}
+
+static bool write_compile_commands(const ProjConf *proj, const BuildConfig *config, TransUnit *tus, size_t tus_len) {
+    int64_t start = monotonic_ns();
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to get CWD: %s.", err);
+        return false;
+    }
+
+    StrBuf json = {0};
+    strbuf_append(&json, "[\n");
+    for (size_t i = 0; i < tus_len; i++) {
+        StrList argv = {0};
+        compile_args(&argv, proj, config, &tus[i]);
+
+        StrBuf command = {0};
+        join_args(&command, argv.items);
+
+        strbuf_append(&json, "  {\n    \"directory\": ");
+        strbuf_append_json(&json, cwd);
+        strbuf_append(&json, ",\n    \"file\": ");
+        strbuf_append_json(&json, tus[i].src->path);
+        strbuf_append(&json, ",\n    \"command\": ");
+        strbuf_append_json(&json, command.bytes);
+        strbuf_append(&json, i + 1 < tus_len ? "\n  },\n" : "\n  }\n");
+
+        strbuf_free(&command);
+        strlist_free(&argv);
+    }
+    strbuf_append(&json, "]\n");
+
+    bool ok = write_file_if_changed("compile_commands.json", json.bytes, json.length);
+    strbuf_free(&json);
+
+    trace_add("Export compile_commands.json", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+    return ok;
+}
+
+typedef struct Duration {
+    int64_t ns;
+    char *path;
+} Duration;
+
+// Reads the compile times recorded by the previous build. Entries are stored
+// in the same (sorted) order as the source tree.
+static Duration *read_durations(const char *path, size_t *length, int64_t *link_ns) {
+    *length = 0;
+    *link_ns = 0;
+
+    char *contents = read_file(path, NULL);
+    if (!contents) {
+        return NULL;
+    }
+
+    size_t capacity = 0;
+    Duration *durations = NULL;
+
+    char *save = NULL;
+    for (char *line = strtok_r(contents, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char *space = strchr(line, ' ');
+        if (!space) continue;
+        *space = '\0';
+
+        int64_t ns = strtoll(line, NULL, 10);
+        if (strcmp(space + 1, ":link") == 0) {
+            *link_ns = ns;
+            continue;
+        }
+
+        if (*length == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            durations = realloc(durations, capacity * sizeof(*durations));
+        }
+        durations[(*length)++] = (Duration){ .ns = ns, .path = strdup(space + 1) };
+    }
+
+    free(contents);
+    return durations;
+}
+
+static void free_durations(Duration *durations, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        free(durations[i].path);
+    }
+    free(durations);
+}
+
+// State shared by every configuration in one `build_project` call.
+typedef struct BuildEnv {
+    const BuildOptions *opts;
+    BuildState *state;
+    bool use_cache;
+    char cache_dir[PATH_MAX];
+    CacheSettings cache;
+    bool has_remote;        // `remote` is set. Whether it is used is up to `env_remote`.
+    bool remote_checked;
+    bool use_remote;
+    HttpUrl remote;
+    bool time_trace;
+    bool modules;           // C++ sources may use modules.
+    bool modules_clang;     // Otherwise GCC's module flags are used.
+    char pch_source[2][PATH_MAX];   // Header to precompile, indexed by is_cpp. Empty if none.
+    StrList pch_headers[2];         // What an automatic `pch_source` includes. Empty for a chosen one.
+    const char *compiler_ids[2];    // Indexed by is_cpp. Looked up by `env_compiler_id`.
+} BuildEnv;
+
+typedef struct Pch {
+    char stub[PATH_MAX];    // Includes the shared header. Its .gch sits next to it.
+    char gch[PATH_MAX];
+    char dep[PATH_MAX];
+    int64_t mtime;
+    bool dirty;
+    size_t job;
+} Pch;
+
+typedef struct ConfigBuild {
+    const BuildConfig *config;
+
+    char obj_dir[PATH_MAX];
+    char exe_path[PATH_MAX];
+    char durations_path[PATH_MAX];
+    char stamp_path[PATH_MAX];
+    char link_stamp_path[PATH_MAX];
+
+    TransUnit *tus;
+    size_t *tu_jobs;
+    CacheCompile *cache_jobs;
+    StrBuf stamp;
+    StrBuf link_stamp;
+
+    Duration *durations;
+    size_t durations_len;
+    int64_t link_ns;
+
+    Pch pch[2];             // Indexed by is_cpp.
+
+    ModuleDeps *modules;    // Per translation unit. NULL without modules.
+    StrMap providers;       // Module -> index + 1 of the unit providing it.
+    char bmi_dir[PATH_MAX];
+    char module_map[PATH_MAX];
+
+    bool flags_changed;
+    bool relink;
+    size_t link_job;
+} ConfigBuild;
+
+static void config_build_free(ConfigBuild *cb, const SourceTree *tree) {
+    if (cb->tus) {
+        for (size_t i = 0; i < tree->length; i++) {
+            free(cb->tus[i].obj);
+            free(cb->tus[i].dep);
+            free(cb->tus[i].dwo);
+            strlist_free(&cb->tus[i].module_args);
+        }
+    }
+    if (cb->modules) {
+        for (size_t i = 0; i < tree->length; i++) {
+            module_deps_free(&cb->modules[i]);
+        }
+    }
+    free(cb->modules);
+    strmap_free(&cb->providers);
+    if (cb->cache_jobs) {
+        for (size_t i = 0; i < tree->length; i++) {
+            strlist_free(&cb->cache_jobs[i].compile_argv);
+            strlist_free(&cb->cache_jobs[i].preprocess_argv);
+        }
+    }
+    free(cb->tus);
+    free(cb->tu_jobs);
+    free(cb->cache_jobs);
+    free_durations(cb->durations, cb->durations_len);
+    strbuf_free(&cb->stamp);
+    strbuf_free(&cb->link_stamp);
+}
+
+static const char *scan_deps_tool(void) {
+    const char *tool = getenv("CLANG_SCAN_DEPS");
+    return tool && *tool ? tool : "clang-scan-deps";
+}
+
+// Index of the unit providing `module` plus one, or 0 if none does.
+static size_t module_provider(const StrMap *providers, const char *module) {
+    return (size_t)(uintptr_t)strmap_get(providers, module);
+}
+
+// Reports a cycle of imports reachable from unit `i`. `state` is 0 for
+// units not visited yet, 1 while their imports are being followed and 2
+// once they're known to be fine.
+static bool find_import_cycle(const ConfigBuild *cb, const StrMap *providers, size_t i, char *state) {
+    if (state[i] == 2) return false;
+    if (state[i] == 1) {
+        logprint(LOG_ERROR, "Modules import each other in a cycle that includes '%s'.", cb->tus[i].src->path);
+        return true;
+    }
+
+    state[i] = 1;
+    const StrList *requires = &cb->modules[i].requires;
+    for (size_t r = 0; r < requires->length; r++) {
+        if (find_import_cycle(cb, providers, module_provider(providers, requires->items[r]) - 1, state)) {
+            return true;
+        }
+    }
+    state[i] = 2;
+    return false;
+}
+
+// Scans the C++ sources that may use modules (P1689) and works out which
+// unit provides each module. Units whose imports were rebuilt become dirty,
+// and each unit gets the flags it needs to produce and find BMIs. BMIs live
+// with the objects, so unchanged interfaces aren't recompiled next time.
+static bool plan_modules(ConfigBuild *cb, const BuildEnv *env, const ProjConf *proj, const SourceTree *tree, size_t *dirty_count) {
+    const BuildConfig *config = cb->config;
+    TransUnit *tus = cb->tus;
+    size_t tus_len = tree->length;
+
+    bool result = true;
+    JobGraph scans = {0};
+    ModuleScan *scan_ctxs = calloc(tus_len ? tus_len : 1, sizeof(*scan_ctxs));
+    bool *scanned = calloc(tus_len ? tus_len : 1, sizeof(*scanned));
+    char *cycle_state = calloc(tus_len ? tus_len : 1, sizeof(*cycle_state));
+    StrMap *providers = &cb->providers;
+    StrBuf map = {0};
+
+    cb->modules = calloc(tus_len ? tus_len : 1, sizeof(*cb->modules));
+    snprintf(cb->bmi_dir, sizeof(cb->bmi_dir), "%s/bmi", cb->obj_dir);
+    snprintf(cb->module_map, sizeof(cb->module_map), "%s/modules.map", cb->obj_dir);
+    if (!make_dirs(cb->bmi_dir)) {
+        RETURN(false);
+    }
+
+    // Units that haven't changed import the same modules as last time.
+    int64_t phase_start = monotonic_ns();
+    for (size_t i = 0; i < tus_len; i++) {
+        TransUnit *tu = &tus[i];
+        if (!tu->src->is_cpp || !module_scan_needed(tu->src->path)) {
+            continue;
+        }
+        scanned[i] = true;
+
+        char ddi[PATH_MAX];
+        snprintf(ddi, sizeof(ddi), "%s/%s.ddi", cb->obj_dir, tu->src->path);
+
+        int64_t ddi_mtime;
+        if (!tu->dirty && file_mtime(ddi, &ddi_mtime)) {
+            continue;
+        }
+        if (!make_parent_dirs(ddi)) {
+            RETURN(false);
+        }
+
+        StrList argv = {0};
+        if (env->modules_clang) {
+            strlist_push(&argv, scan_deps_tool());
+            strlist_push(&argv, "-format=p1689");
+            strlist_push(&argv, "--");
+            compiler_args(&argv, proj, config, true);
+            strlist_push(&argv, "-c");
+            strlist_push(&argv, tu->src->path);
+            strlist_push(&argv, "-o");
+            strlist_push(&argv, tu->obj);
+
+            scan_ctxs[i].argv = argv;
+            scan_ctxs[i].ddi_path = strdup(ddi);
+            jobs_add_func(&scans, module_scan_to_file, &scan_ctxs[i], NULL, 1);
+        } else {
+            compiler_args(&argv, proj, config, true);
+            strlist_push(&argv, "-fmodules-ts");
+            strlist_push(&argv, "-E");
+            strlist_push(&argv, "-x");
+            strlist_push(&argv, "c++");
+            strlist_push(&argv, tu->src->path);
+            strlist_push(&argv, "-MT");
+            strlist_push(&argv, ddi);
+            strlist_push(&argv, "-MD");
+            strlist_pushf(&argv, "-MF%s.d", ddi);
+            strlist_push(&argv, "-fdeps-format=p1689r5");
+            strlist_pushf(&argv, "-fdeps-file=%s", ddi);
+            strlist_pushf(&argv, "-fdeps-target=%s", tu->obj);
+            strlist_push(&argv, "-o");
+            strlist_push(&argv, "/dev/null");
+            jobs_add(&scans, argv, NULL, 1);
+        }
+    }
+
+    if (scans.length > 0 && !jobs_run(&scans, env->opts->max_jobs)) {
+        logprint(LOG_ERROR, "Failed to scan sources for module dependencies. This needs %s.",
+            env->modules_clang ? "clang-scan-deps (set $CLANG_SCAN_DEPS to use another)" : "GCC 14 or newer");
+        RETURN(false);
+    }
+    trace_add("Scan modules", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+
+    for (size_t i = 0; i < tus_len; i++) {
+        if (!scanned[i]) {
+            continue;
+        }
+
+        char ddi[PATH_MAX];
+        snprintf(ddi, sizeof(ddi), "%s/%s.ddi", cb->obj_dir, tus[i].src->path);
+        if (!module_deps_read(ddi, &cb->modules[i])) {
+            logprint(LOG_ERROR, "Failed to read module dependencies of '%s'.", tus[i].src->path);
+            RETURN(false);
+        }
+
+        const char *provides = cb->modules[i].provides;
+        if (!provides) {
+            continue;
+        }
+
+        size_t other = module_provider(providers, provides);
+        if (other) {
+            logprint(LOG_ERROR, "Module '%s' is provided by both '%s' and '%s'.", provides, tus[other - 1].src->path, tus[i].src->path);
+            RETURN(false);
+        }
+        strmap_put(providers, provides, (void *)(uintptr_t)(i + 1));
+    }
+
+    for (size_t i = 0; i < tus_len; i++) {
+        const StrList *requires = &cb->modules[i].requires;
+        for (size_t r = 0; r < requires->length; r++) {
+            if (!module_provider(providers, requires->items[r])) {
+                logprint(LOG_ERROR, "'%s' imports module '%s', which no source in '%s' provides.", tus[i].src->path, requires->items[r], proj->src_dir);
+                RETURN(false);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < tus_len; i++) {
+        if (find_import_cycle(cb, providers, i, cycle_state)) {
+            RETURN(false);
+        }
+    }
+
+    const char *bmi_ext = env->modules_clang ? ".pcm" : ".gcm";
+    for (size_t i = 0; i < tus_len; i++) {
+        TransUnit *tu = &tus[i];
+        const ModuleDeps *deps = &cb->modules[i];
+        if (!deps->provides && deps->requires.length == 0) {
+            continue;
+        }
+
+        // A forced include would come before the module declaration.
+        tu->pch = NULL;
+        tu->pch_source = NULL;
+
+        char bmi[PATH_MAX] = "";
+        if (deps->provides) {
+            char name[PATH_MAX];
+            module_bmi_name(deps->provides, bmi_ext, name, sizeof(name));
+            snprintf(bmi, sizeof(bmi), "%s/%s", cb->bmi_dir, name);
+            strbuf_appendf(&map, "%s %s\n", deps->provides, bmi);
+        }
+
+        if (env->modules_clang) {
+            strlist_pushf(&tu->module_args, "-fprebuilt-module-path=%s", cb->bmi_dir);
+            if (deps->provides) {
+                strlist_pushf(&tu->module_args, "-fmodule-output=%s", bmi);
+                strlist_push(&tu->module_args, "-x");
+                strlist_push(&tu->module_args, "c++-module");
+            }
+        } else {
+            strlist_push(&tu->module_args, "-fmodules-ts");
+            strlist_pushf(&tu->module_args, "-fmodule-mapper=%s", cb->module_map);
+            strlist_push(&tu->module_args, "-x");
+            strlist_push(&tu->module_args, "c++");
+        }
+
+        int64_t bmi_mtime;
+        if (deps->provides && !tu->dirty && !file_mtime(bmi, &bmi_mtime)) {
+            tu->dirty = true;
+            (*dirty_count)++;
+        }
+    }
+
+    if (!env->modules_clang && !write_file_if_changed(cb->module_map, map.bytes ? map.bytes : "", map.length)) {
+        RETURN(false);
+    }
+
+    // Importers of a rebuilt interface are rebuilt too, as are ones older
+    // than a BMI they use (say, because the last build stopped half way).
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = 0; i < tus_len; i++) {
+            TransUnit *tu = &tus[i];
+            const StrList *requires = &cb->modules[i].requires;
+            int64_t obj_mtime = 0;
+            if (tu->dirty || requires->length == 0 || !file_mtime(tu->obj, &obj_mtime)) {
+                continue;
+            }
+
+            for (size_t r = 0; r < requires->length && !tu->dirty; r++) {
+                const TransUnit *provider = &tus[module_provider(providers, requires->items[r]) - 1];
+
+                char name[PATH_MAX], bmi[PATH_MAX];
+                module_bmi_name(requires->items[r], bmi_ext, name, sizeof(name));
+                snprintf(bmi, sizeof(bmi), "%s/%s", cb->bmi_dir, name);
+
+                int64_t bmi_mtime;
+                tu->dirty = provider->dirty || !file_mtime(bmi, &bmi_mtime) || bmi_mtime > obj_mtime;
+            }
+
+            if (tu->dirty) {
+                (*dirty_count)++;
+                changed = true;
+            }
+        }
+    }
+
+CLEAN_UP_AND_RETURN:
+    for (size_t i = 0; i < tus_len; i++) {
+        strlist_free(&scan_ctxs[i].argv);
+        free(scan_ctxs[i].ddi_path);
+    }
+    free(scan_ctxs);
+    free(scanned);
+    free(cycle_state);
+    jobs_free(&scans);
+    strbuf_free(&map);
+    return result;
+}
+
+// Identifying a compiler runs it, so it is only done once a unit has to go
+// through the cache, and remembered until the compiler is replaced.
+static const char *env_compiler_id(BuildEnv *env, bool is_cpp) {
+    if (env->compiler_ids[is_cpp]) {
+        return env->compiler_ids[is_cpp];
+    }
+
+    const char *compiler = is_cpp ? cpp_compiler() : c_compiler();
+    char stamp[COMPILER_STAMP_MAX];
+    compiler_stamp(compiler, stamp, sizeof(stamp));
+
+    char key[COMPILER_STAMP_MAX + 256];
+    snprintf(key, sizeof(key), "%s\n%s", compiler, stamp);
+    char *id = strmap_get(&env->state->compiler_ids, key);
+    if (!id) {
+        StrBuf identity = {0};
+        compiler_identity(compiler, &identity);
+        id = identity.bytes;
+        strmap_put(&env->state->compiler_ids, key, id);
+    }
+
+    env->compiler_ids[is_cpp] = id;
+    return id;
+}
+
+// The remote cache, if there is one and it answers. Only asked once a unit
+// has to go through the cache, since an unreachable remote costs a
+// connection timeout.
+static const HttpUrl *env_remote(BuildEnv *env) {
+    if (!env->has_remote) {
+        return NULL;
+    }
+
+    if (!env->remote_checked) {
+        env->remote_checked = true;
+
+        int64_t now = monotonic_ns();
+        RemoteProbe *probe = strmap_get(&env->state->remotes, env->cache.remote);
+        if (!probe) {
+            probe = malloc(sizeof(*probe));
+            probe->when = INT64_MIN;
+            strmap_put(&env->state->remotes, env->cache.remote, probe);
+        }
+
+        if (probe->when == INT64_MIN || now - probe->when > REMOTE_PROBE_NS) {
+            probe->reachable = cache_remote_reachable(&env->remote);
+            probe->when = now;
+            if (!probe->reachable) {
+                logprint(LOG_WARN, "Couldn't reach the remote cache at '%s'. Building with the local cache only.", env->cache.remote);
+            }
+        }
+        env->use_remote = probe->reachable;
+    }
+
+    return env->use_remote ? &env->remote : NULL;
+}
+
+// A chosen precompiled header goes into every source. An automatic one only
+// goes into sources that start by including all of its headers anyway, so
+// nothing they #define first or declare themselves meets it unexpectedly.
+static bool pch_applies(const BuildEnv *env, const SourceFile *src) {
+    const StrList *headers = &env->pch_headers[src->is_cpp];
+    if (headers->length == 0) {
+        return true;
+    }
+
+    const DepList *includes = load_includes(env->state, src->path);
+    for (size_t i = 0; i < headers->length; i++) {
+        bool found = false;
+        for (size_t j = 0; includes && j < includes->leading && !found; j++) {
+            found = strcmp(includes->paths.items[j], headers->items[i]) == 0;
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Works out what is out of date in `cb->config` and adds the jobs needed to
+// bring it up to date to `graph`. `label_prefix` distinguishes the jobs of
+// different configurations when several are built at once.
+static bool plan_config(ConfigBuild *cb, BuildEnv *env, const ProjConf *proj, const SourceTree *tree, JobGraph *graph, const char *label_prefix) {
+    const BuildConfig *config = cb->config;
+
+    printf("==== Building %s (%s) ====\n", proj->exe_name, config->name);
+
+    snprintf(cb->obj_dir, sizeof(cb->obj_dir), OBJ_DIR"/%s", config->name);
+    snprintf(cb->exe_path, sizeof(cb->exe_path), "%s/%s/%s", proj->out_dir, config->name, proj->exe_name);
+    snprintf(cb->durations_path, sizeof(cb->durations_path), "%s/durations", cb->obj_dir);
+    snprintf(cb->stamp_path, sizeof(cb->stamp_path), "%s/compile.stamp", cb->obj_dir);
+    snprintf(cb->link_stamp_path, sizeof(cb->link_stamp_path), "%s/link.stamp", cb->obj_dir);
+
+    cb->tus = calloc(tree->length ? tree->length : 1, sizeof(*cb->tus));
+    cb->tu_jobs = calloc(tree->length ? tree->length : 1, sizeof(*cb->tu_jobs));
+    if (env->use_cache) {
+        cb->cache_jobs = calloc(tree->length ? tree->length : 1, sizeof(*cb->cache_jobs));
+    }
+    cb->durations = read_durations(cb->durations_path, &cb->durations_len, &cb->link_ns);
+
+    TransUnit *tus = cb->tus;
+
+    for (int lang = 0; lang < 2; lang++) {
+        Pch *pch = &cb->pch[lang];
+        if (env->pch_source[lang][0]) {
+            snprintf(pch->stub, sizeof(pch->stub), "%s/pch%s", cb->obj_dir, lang ? ".hpp" : ".h");
+            snprintf(pch->gch, sizeof(pch->gch), "%s/pch%s.gch", cb->obj_dir, lang ? ".hpp" : ".h");
+            snprintf(pch->dep, sizeof(pch->dep), "%s/pch%s.d", cb->obj_dir, lang ? ".hpp" : ".h");
+        }
+    }
+
+    bool any_cpp = false;
+    for (size_t i = 0; i < tree->length; i++) {
+        TransUnit *tu = &tus[i];
+        tu->src = &tree->files[i];
+        asprintf(&tu->obj, "%s/%s.o", cb->obj_dir, tu->src->path);
+        asprintf(&tu->dep, "%s/%s.d", cb->obj_dir, tu->src->path);
+        asprintf(&tu->dwo, "%s/%s.dwo", cb->obj_dir, tu->src->path);
+        if (cb->pch[tu->src->is_cpp].stub[0] && pch_applies(env, tu->src)) {
+            tu->pch = cb->pch[tu->src->is_cpp].stub;
+            tu->pch_source = env->pch_source[tu->src->is_cpp];
+        }
+        any_cpp |= tu->src->is_cpp;
+    }
+
+    // Any change to the compilers, flags or precompiled headers invalidates
+    // every object.
+    strbuf_appendf(&cb->stamp, "%s\n%s\n%s\n", c_compiler(), cpp_compiler(), dialect_names[proj->dialect]);
+    join_args(&cb->stamp, config->cflags.items);
+    strbuf_appendf(&cb->stamp, "\n%s\n%s\n", env->pch_source[0], env->pch_source[1]);
+    cb->flags_changed = stamp_changed(cb->stamp_path, &cb->stamp);
+
+    for (int lang = 0; lang < 2; lang++) {
+        Pch *pch = &cb->pch[lang];
+        pch->dirty = pch->stub[0] &&
+                     (cb->flags_changed ||
+                      !file_mtime(pch->gch, &pch->mtime) ||
+                      deps_newer_than(env->state, pch->dep, pch->mtime));
+    }
+
+    int64_t newest_obj = 0;
+    size_t dirty_count = 0;
+    for (size_t i = 0; i < tree->length; i++) {
+        TransUnit *tu = &tus[i];
+
+        int64_t obj_mtime;
+        const Pch *pch = &cb->pch[tu->src->is_cpp];
+        tu->dirty = env->time_trace ||
+                    cb->flags_changed ||
+                    !file_mtime(tu->obj, &obj_mtime) ||
+                    deps_newer_than(env->state, tu->dep, obj_mtime) ||
+                    (tu->pch && (pch->dirty || pch->mtime > obj_mtime));
+
+        if (tu->dirty) {
+            dirty_count++;
+        } else if (obj_mtime > newest_obj) {
+            newest_obj = obj_mtime;
+        }
+    }
+
+    if (env->modules && !plan_modules(cb, env, proj, tree, &dirty_count)) {
+        return false;
+    }
+
+    StrList link_argv = {0};
+    strlist_push(&link_argv, any_cpp ? cpp_compiler() : c_compiler());
+    strlist_push(&link_argv, "-o");
+    strlist_push(&link_argv, cb->exe_path);
+    for (size_t i = 0; i < tree->length; i++) {
+        strlist_push(&link_argv, tus[i].obj);
+    }
+    strlist_extend(&link_argv, &config->ldflags);
+
+    Linker linker = env->opts->linker ? env->opts->linker : proj->linker;
+    if (linker > LINKER_DEFAULT) {
+        strlist_pushf(&link_argv, "-fuse-ld=%s", linker_name(linker));
+        // The default GNU ld can't build an index, but the others can,
+        // which saves debuggers reading every unit's debug info at startup.
+        if (config->split_dwarf) {
+            strlist_push(&link_argv, "-Wl,--gdb-index");
+        }
+    }
+
+    // Modules whose bitcode didn't change reuse their optimized code from
+    // the last link.
+    if (config->thin_lto) {
+        char cache_dir[PATH_MAX];
+        snprintf(cache_dir, sizeof(cache_dir), LTO_CACHE_DIR"/%s", config->name);
+#ifdef __APPLE__
+        strlist_pushf(&link_argv, "-Wl,-cache_path_lto,%s", cache_dir);
+#else
+        if (linker == LINKER_LLD) {
+            strlist_pushf(&link_argv, "-Wl,--thinlto-cache-dir=%s", cache_dir);
+        } else {
+            strlist_pushf(&link_argv, "-Wl,-plugin-opt,cache-dir=%s", cache_dir);
+        }
+#endif
+    }
+
+    join_args(&cb->link_stamp, link_argv.items);
+    strbuf_append(&cb->link_stamp, "\n");
+
+    int64_t exe_mtime;
+    cb->relink = dirty_count > 0 ||
+                 stamp_changed(cb->link_stamp_path, &cb->link_stamp) ||
+                 !file_mtime(cb->exe_path, &exe_mtime) ||
+                 exe_mtime < newest_obj;
+
+    if (!cb->relink) {
+        strlist_free(&link_argv);
+        return true;
+    }
+
+    if (tree->length == 0) {
+        logprint(LOG_ERROR, "No source files found in '%s'.", proj->src_dir);
+        strlist_free(&link_argv);
+        return false;
+    }
+
+    if (!make_dirs(cb->obj_dir) || !make_parent_dirs(cb->exe_path)) {
+        strlist_free(&link_argv);
+        return false;
+    }
+
+    // Translation units that were slow last time are started first. Units we
+    // have no timing for are assumed to be average.
+    int64_t known_total = 0;
+    for (size_t i = 0; i < cb->durations_len; i++) {
+        known_total += cb->durations[i].ns;
+    }
+    int64_t average_ns = cb->durations_len ? known_total / (int64_t)cb->durations_len : 1;
+
+    // Precompiled headers are built before anything that includes them.
+    for (int lang = 0; lang < 2; lang++) {
+        Pch *pch = &cb->pch[lang];
+        if (!pch->dirty) {
+            continue;
+        }
+
+        StrBuf stub = {0};
+        strbuf_appendf(&stub, "#include \"../../pch/%s\"\n", strrchr(env->pch_source[lang], '/') + 1);
+        bool written = write_file_if_changed(pch->stub, stub.bytes, stub.length);
+        strbuf_free(&stub);
+        if (!written) {
+            strlist_free(&link_argv);
+            return false;
+        }
+
+        StrList argv = {0};
+        compiler_args(&argv, proj, config, lang);
+        strlist_push(&argv, "-x");
+        strlist_push(&argv, lang ? "c++-header" : "c-header");
+        strlist_push(&argv, "-MMD");
+        strlist_push(&argv, "-MF");
+        strlist_push(&argv, pch->dep);
+        strlist_push(&argv, "-c");
+        strlist_push(&argv, pch->stub);
+        strlist_push(&argv, "-o");
+        strlist_push(&argv, pch->gch);
+
+        char *label;
+        asprintf(&label, "%sPrecompiling %s", label_prefix, strrchr(pch->stub, '/') + 1);
+        pch->job = jobs_add(graph, argv, label, average_ns);
+    }
+
+    size_t d = 0;
+    for (size_t i = 0; i < tree->length; i++) {
+        TransUnit *tu = &tus[i];
+        if (!tu->dirty) {
+            continue;
+        }
+
+        if (!make_parent_dirs(tu->obj)) {
+            strlist_free(&link_argv);
+            return false;
+        }
+
+        int64_t cost = average_ns;
+        while (d < cb->durations_len && strcmp(cb->durations[d].path, tu->src->path) < 0) d++;
+        if (d < cb->durations_len && strcmp(cb->durations[d].path, tu->src->path) == 0) {
+            cost = cb->durations[d].ns;
+        }
+
+        const char *name = strrchr(tu->src->path, '/');
+
+        char *label;
+        asprintf(&label, "%s%s", label_prefix, name ? name + 1 : tu->src->path);
+
+        // Preprocessing doesn't capture what a unit imports, so units using
+        // modules can't be looked up in the cache.
+        if (env->use_cache && tu->module_args.length == 0) {
+            CacheCompile *cc = &cb->cache_jobs[i];
+            compile_args(&cc->compile_argv, proj, config, tu);
+            preprocess_args(&cc->preprocess_argv, proj, config, tu);
+            cc->obj = tu->obj;
+            if (config->split_dwarf) {
+                cc->dwo = tu->dwo;
+            }
+            cc->compiler_id = env_compiler_id(env, tu->src->is_cpp);
+            cc->cache_dir = env->cache_dir;
+            cc->compress = env->cache.compress;
+            cc->remote = env_remote(env);
+            cc->remote_upload = env->cache.remote_upload;
+            for (size_t j = 0; j < config->cflags.length; j++) {
+                cc->hash_cwd |= starts_with(config->cflags.items[j], "-g");
+            }
+            cb->tu_jobs[i] = jobs_add_func(graph, cache_compile, cc, label, cost);
+        } else {
+            StrList argv = {0};
+            compile_args(&argv, proj, config, tu);
+            if (env->time_trace) {
+                strlist_push(&argv, "-ftime-trace");
+            }
+            cb->tu_jobs[i] = jobs_add(graph, argv, label, cost);
+        }
+
+        if (tu->pch && cb->pch[tu->src->is_cpp].dirty) {
+            jobs_add_dep(graph, cb->tu_jobs[i], cb->pch[tu->src->is_cpp].job);
+        }
+    }
+
+    // Interfaces are compiled before the units that import them.
+    for (size_t i = 0; i < tree->length && cb->modules; i++) {
+        const StrList *requires = &cb->modules[i].requires;
+        for (size_t r = 0; r < requires->length && tus[i].dirty; r++) {
+            size_t provider = module_provider(&cb->providers, requires->items[r]) - 1;
+            if (tus[provider].dirty) {
+                jobs_add_dep(graph, cb->tu_jobs[i], cb->tu_jobs[provider]);
+            }
+        }
+    }
+
+    char *link_label;
+    asprintf(&link_label, "%sLinking %s", label_prefix, proj->exe_name);
+    cb->link_job = jobs_add(graph, link_argv, link_label, cb->link_ns);
+
+    for (size_t i = 0; i < tree->length; i++) {
+        if (tus[i].dirty) {
+            jobs_add_dep(graph, cb->link_job, cb->tu_jobs[i]);
+        }
+    }
+
+    return true;
+}
+
+// Records the outcome of the jobs `plan_config` added once they have run.
+static bool finish_config(ConfigBuild *cb, const ProjConf *proj, const SourceTree *tree, const JobGraph *graph, bool export_commands) {
+    TransUnit *tus = cb->tus;
+
+    if (!cb->relink) {
+        return !export_commands || write_compile_commands(proj, cb->config, tus, tree->length);
+    }
+
+    // Record timings for the next build, keeping old ones for units that
+    // weren't rebuilt.
+    {
+        StrBuf out = {0};
+        const Job *link = &graph->jobs[cb->link_job];
+        strbuf_appendf(&out, "%lld :link\n", (long long)(link->done ? link->duration_ns : cb->link_ns));
+
+        size_t d = 0;
+        for (size_t i = 0; i < tree->length; i++) {
+            TransUnit *tu = &tus[i];
+            while (d < cb->durations_len && strcmp(cb->durations[d].path, tu->src->path) < 0) d++;
+
+            int64_t ns = 0;
+            if (tu->dirty && graph->jobs[cb->tu_jobs[i]].done) {
+                ns = graph->jobs[cb->tu_jobs[i]].duration_ns;
+            } else if (d < cb->durations_len && strcmp(cb->durations[d].path, tu->src->path) == 0) {
+                ns = cb->durations[d].ns;
+            }
+
+            if (ns > 0) {
+                strbuf_appendf(&out, "%lld %s\n", (long long)ns, tu->src->path);
+            }
+        }
+
+        write_file_if_changed(cb->durations_path, out.bytes, out.length);
+        strbuf_free(&out);
+    }
+
+    bool ok = true;
+    for (int lang = 0; lang < 2; lang++) {
+        if (cb->pch[lang].dirty && graph->jobs[cb->pch[lang].job].failed) {
+            logprint(LOG_ERROR, "Failed to precompile '%s'.", cb->pch[lang].stub);
+            ok = false;
+        }
+    }
+    for (size_t i = 0; i < tree->length; i++) {
+        if (tus[i].dirty && graph->jobs[cb->tu_jobs[i]].failed) {
+            logprint(LOG_ERROR, "Failed to compile '%s'.", tus[i].src->path);
+            ok = false;
+        }
+    }
+
+    const Job *link = &graph->jobs[cb->link_job];
+    if (link->failed) {
+        logprint(LOG_ERROR, "Failed to link '%s'.", cb->exe_path);
+    }
+
+    if (!link->done) {
+        return false;
+    }
+
+    if (ok && cb->flags_changed && !write_file_if_changed(cb->stamp_path, cb->stamp.bytes, cb->stamp.length)) {
+        return false;
+    }
+
+    if (!write_file_if_changed(cb->link_stamp_path, cb->link_stamp.bytes, cb->link_stamp.length)) {
+        return false;
+    }
+
+    return !export_commands || write_compile_commands(proj, cb->config, tus, tree->length);
+}
+
+typedef struct JobStat {
+    const char *config;
+    const char *kind;
+    const char *path;
+    const Job *job;
+} JobStat;
+
+static int compare_job_stats(const void *a, const void *b) {
+    int64_t x = ((const JobStat *)a)->job->duration_ns;
+    int64_t y = ((const JobStat *)b)->job->duration_ns;
+    return (x < y) - (x > y);
+}
+
+#define STATS_TOP_N (10)
+
+// Prints the slowest jobs of the build and writes every job's numbers to
+// STATS_PATH.
+static void report_stats(const ConfigBuild *builds, size_t builds_len, const SourceTree *tree, const JobGraph *graph) {
+    JobStat *stats = malloc((graph->length + 1) * sizeof(*stats));
+    size_t stats_len = 0;
+
+    for (size_t i = 0; i < builds_len; i++) {
+        const ConfigBuild *cb = &builds[i];
+        if (!cb->relink) {
+            continue;
+        }
+
+        for (size_t j = 0; j < tree->length; j++) {
+            const Job *job = &graph->jobs[cb->tu_jobs[j]];
+            if (cb->tus[j].dirty && (job->done || job->failed)) {
+                stats[stats_len++] = (JobStat){ cb->config->name, "compile", cb->tus[j].src->path, job };
+            }
+        }
+
+        const Job *link = &graph->jobs[cb->link_job];
+        if (link->done || link->failed) {
+            stats[stats_len++] = (JobStat){ cb->config->name, "link", cb->exe_path, link };
+        }
+    }
+
+    if (stats_len == 0) {
+        printf("No compiles or links to report.\n");
+        free(stats);
+        return;
+    }
+
+    qsort(stats, stats_len, sizeof(*stats), compare_job_stats);
+
+    int64_t total_cpu = 0;
+    int64_t first_start = INT64_MAX, last_end = 0;
+    for (size_t i = 0; i < stats_len; i++) {
+        const Job *job = stats[i].job;
+        total_cpu += job->cpu_ns;
+        if (job->start_ns < first_start) first_start = job->start_ns;
+        if (job->start_ns + job->duration_ns > last_end) last_end = job->start_ns + job->duration_ns;
+    }
+    int64_t wall = last_end - first_start;
+
+    size_t top = stats_len < STATS_TOP_N ? stats_len : STATS_TOP_N;
+    printf("==== Slowest %zu of %zu jobs ====\n", top, stats_len);
+    printf("%10s %10s %12s  %s\n", "Wall", "CPU", "Peak RSS", "Job");
+    for (size_t i = 0; i < top; i++) {
+        char wall_s[32], cpu_s[32], rss_s[32];
+        format_duration(stats[i].job->duration_ns, wall_s, sizeof(wall_s));
+        format_duration(stats[i].job->cpu_ns, cpu_s, sizeof(cpu_s));
+        format_size(stats[i].job->peak_rss, rss_s, sizeof(rss_s));
+        printf("%10s %10s %12s  [%s] %s %s\n", wall_s, cpu_s, rss_s, stats[i].config, stats[i].kind, stats[i].path);
+    }
+
+    char wall_s[32], cpu_s[32];
+    format_duration(wall, wall_s, sizeof(wall_s));
+    format_duration(total_cpu, cpu_s, sizeof(cpu_s));
+    printf("%s CPU in %s (%.1fx parallelism).\n", cpu_s, wall_s, wall > 0 ? (double)total_cpu / (double)wall : 0.0);
+
+    StrBuf json = {0};
+    strbuf_appendf(&json, "{\n  \"wall_ns\": %lld,\n  \"cpu_ns\": %lld,\n  \"jobs\": [\n", (long long)wall, (long long)total_cpu);
+    for (size_t i = 0; i < stats_len; i++) {
+        const Job *job = stats[i].job;
+        strbuf_append(&json, "    {\"config\": ");
+        strbuf_append_json(&json, stats[i].config);
+        strbuf_append(&json, ", \"kind\": ");
+        strbuf_append_json(&json, stats[i].kind);
+        strbuf_append(&json, ", \"path\": ");
+        strbuf_append_json(&json, stats[i].path);
+        strbuf_appendf(&json, ", \"wall_ns\": %lld, \"cpu_ns\": %lld, \"peak_rss\": %llu, \"failed\": %s}%s\n",
+            (long long)job->duration_ns,
+            (long long)job->cpu_ns,
+            (unsigned long long)job->peak_rss,
+            job->failed ? "true" : "false",
+            i + 1 < stats_len ? "," : "");
+    }
+    strbuf_append(&json, "  ]\n}\n");
+
+    if (write_file_atomic(STATS_PATH, json.bytes, json.length)) {
+        printf("Wrote every job's numbers to '%s'.\n", STATS_PATH);
+    } else {
+        logprint(LOG_WARN, "Failed to write '%s'.", STATS_PATH);
+    }
+
+    strbuf_free(&json);
+    free(stats);
+}
+
+// Writes the header to precompile for each language into PCH_DIR. It's the
+// header named by the `pch` setting, or by default the standard headers most
+// C++ sources start by including. C headers are cheap enough to parse that precompiling
+// them rarely pays off, so C sources only get one when it's asked for.
+static bool write_pch_sources(BuildEnv *env, const ProjConf *proj, const SourceTree *tree) {
+    const char *setting = proj->pch ? proj->pch : "auto";
+    if (strcmp(setting, "off") == 0) {
+        return true;
+    }
+
+    bool automatic = strcmp(setting, "auto") == 0;
+    if (!automatic && access(setting, F_OK) != 0) {
+        logprint(LOG_ERROR, "Precompiled header '%s' doesn't exist.", setting);
+        return false;
+    }
+
+    bool result = true;
+    for (int lang = 0; lang < 2 && result; lang++) {
+        bool has_sources = false;
+        for (size_t i = 0; i < tree->length && !has_sources; i++) {
+            has_sources = tree->files[i].is_cpp == (bool)lang;
+        }
+
+        StrBuf contents = {0};
+        if (automatic && lang) {
+            StrList *headers = &env->pch_headers[lang];
+            find_common_headers(env->state, tree, true, headers);
+            for (size_t i = 0; i < headers->length; i++) {
+                strbuf_appendf(&contents, "#include <%s>\n", headers->items[i]);
+            }
+        } else if (!automatic && has_sources && (bool)lang == dialect_is_cpp(proj->dialect)) {
+            // Included relative to PCH_DIR, which is two levels below the project.
+            strbuf_appendf(&contents, "#include \"%s%s\"\n", setting[0] == '/' ? "" : "../../", setting);
+        }
+
+        if (contents.length > 0) {
+            snprintf(env->pch_source[lang], sizeof(env->pch_source[lang]), PCH_DIR"/pch%s", lang ? ".hpp" : ".h");
+            result = make_dirs(PCH_DIR) &&
+                     write_file_if_changed(env->pch_source[lang], contents.bytes, contents.length);
+        }
+        strbuf_free(&contents);
+    }
+
+    return result;
+}
+
+static void collect_output(void *ctx, const void *data, size_t len) {
+    strbuf_append_len((StrBuf *)ctx, data, len);
+}
+
+// Compiler stamp -> "clang" or "other". Finding out means running the
+// compiler, and every configuration, the daemon and `bx watch` ask again.
+static StrMap compiler_kinds;
+
+static bool compiler_is_clang(const char *compiler) {
+    char stamp[COMPILER_STAMP_MAX];
+    compiler_stamp(compiler, stamp, sizeof(stamp));
+    const char *kind = strmap_get(&compiler_kinds, stamp);
+    if (kind) {
+        return strcmp(kind, "clang") == 0;
+    }
+
+    StrBuf version = {0};
+    char *argv[] = { (char *)compiler, "--version", NULL };
+    int exit_code;
+    bool clang = proc_run_piped(argv, collect_output, &version, &exit_code) &&
+                 exit_code == 0 &&
+                 version.bytes && strstr(version.bytes, "clang") != NULL;
+    strbuf_free(&version);
+
+    strmap_put(&compiler_kinds, stamp, clang ? "clang" : "other");
+    return clang;
+}
+
+const char *project_compiler(const ProjConf *proj) {
+    return dialect_is_cpp(proj->dialect) ? cpp_compiler() : c_compiler();
+}
+
+bool project_uses_clang(const ProjConf *proj) {
+    return compiler_is_clang(project_compiler(proj));
+}
+
+// Merges the -ftime-trace output of every translation unit compiled for
+// `cb`.
+static void report_time_trace(const ConfigBuild *cb, const SourceTree *tree, const JobGraph *graph) {
+    StrList traces = {0};
+    for (size_t i = 0; i < tree->length; i++) {
+        if (cb->tus[i].dirty && graph->jobs[cb->tu_jobs[i]].done) {
+            const char *obj = cb->tus[i].obj;
+            strlist_pushf(&traces, "%.*s.json", (int)(strlen(obj) - strlen(".o")), obj);
+        }
+    }
+
+    char out_path[PATH_MAX];
+    snprintf(out_path, sizeof(out_path), BUILDX_DIR"/time-trace-%s.json", cb->config->name);
+
+    printf("==== %s ====\n", cb->config->name);
+    time_trace_report(traces.items, traces.length, out_path);
+    strlist_free(&traces);
+}
+
+bool build_project(const ProjConf *proj, const BuildConfig *configs, size_t configs_len, const BuildOptions *opts) {
+    bool result = true;
+
+    BuildEnv env = {
+        .opts = opts,
+        .state = opts->state ? opts->state : build_state_new(),
+    };
+    build_state_forget_stats(env.state);
+
+    // Every unit is recompiled so the report covers the whole project. The
+    // flag doesn't change the object code, so it isn't part of the stamp.
+    if (opts->time_trace) {
+        env.time_trace = project_uses_clang(proj);
+        if (!env.time_trace) {
+            logprint(LOG_WARN, "`--time-trace` needs clang but '%s' isn't. Building without it.", project_compiler(proj));
+        }
+    }
+
+    if (dialect_has_modules(proj->dialect)) {
+        env.modules = true;
+        env.modules_clang = compiler_is_clang(cpp_compiler());
+    }
+
+    if (opts->use_cache && !env.time_trace) {
+        env.use_cache = cache_dir(env.cache_dir, sizeof(env.cache_dir));
+        if (!env.use_cache) {
+            logprint(LOG_WARN, "Couldn't determine cache directory. Building without the cache.");
+        }
+        cache_settings(proj, &env.cache);
+
+        if (env.use_cache && env.cache.remote) {
+            env.has_remote = http_parse_url(env.cache.remote, &env.remote);
+            if (!env.has_remote) {
+                logprint(LOG_WARN, "'%s' is not a valid remote cache URL. Expected http://host[:port][/path].", env.cache.remote);
+            }
+        }
+    }
+
+    SourceTree tree = {0};
+    JobGraph graph = {0};
+    ConfigBuild *builds = calloc(configs_len ? configs_len : 1, sizeof(*builds));
+
+    int64_t phase_start = monotonic_ns();
+    if (!scan_sources(env.state, proj->src_dir, &tree)) {
+        RETURN(false);
+    }
+    qsort(tree.files, tree.length, sizeof(*tree.files), compare_sources);
+    trace_add("Scan sources", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+
+    // Headers are picked from the real sources, before any are batched.
+    phase_start = monotonic_ns();
+    if (!write_pch_sources(&env, proj, &tree)) {
+        RETURN(false);
+    }
+    trace_add("Pick precompiled headers", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+
+    bool unity = opts->unity_files > 0 || opts->unity_size > 0;
+    if (unity) {
+        SourceTree batched = {0};
+        phase_start = monotonic_ns();
+        if (!make_unity_tree(proj, opts, &tree, &batched)) {
+            source_tree_free(&batched);
+            RETURN(false);
+        }
+        source_tree_free(&tree);
+        tree = batched;
+        trace_add("Write unity sources", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+    }
+
+    // Every configuration goes into the same graph so they share one job
+    // budget and each link starts as soon as its own objects are done.
+    for (size_t i = 0; i < configs_len; i++) {
+        builds[i].config = &configs[i];
+
+        char label_prefix[64] = "";
+        if (configs_len > 1) {
+            snprintf(label_prefix, sizeof(label_prefix), "[%s] ", configs[i].name);
+        }
+
+        phase_start = monotonic_ns();
+        if (!plan_config(&builds[i], &env, proj, &tree, &graph, label_prefix)) {
+            RETURN(false);
+        }
+        if (trace_enabled()) {
+            char name[64];
+            snprintf(name, sizeof(name), "Plan %s", configs[i].name);
+            trace_add(name, "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+        }
+    }
+
+    if (graph.length > 0) {
+        phase_start = monotonic_ns();
+        jobs_run(&graph, opts->max_jobs);
+        trace_add("Run jobs", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+        trace_jobs(&graph, "job");
+
+        if (env.use_cache) {
+            phase_start = monotonic_ns();
+            if (!cache_trim_if_needed(env.cache_dir, env.cache.max_size)) {
+                logprint(LOG_WARN, "Failed to trim the cache at '%s'.", env.cache_dir);
+            }
+            trace_add("Trim cache", "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+        }
+    }
+
+    for (size_t i = 0; i < configs_len; i++) {
+        phase_start = monotonic_ns();
+        // Unity sources are no use to editors, so compile_commands.json is
+        // left as the last regular build wrote it.
+        if (!finish_config(&builds[i], proj, &tree, &graph, i == 0 && !unity)) {
+            result = false;
+        }
+        if (trace_enabled()) {
+            char name[64];
+            snprintf(name, sizeof(name), "Finish %s", configs[i].name);
+            trace_add(name, "phase", TRACE_MAIN_LANE, phase_start, monotonic_ns());
+        }
+    }
+
+    if (opts->stats) {
+        report_stats(builds, configs_len, &tree, &graph);
+    }
+
+    for (size_t i = 0; i < configs_len && env.time_trace; i++) {
+        if (builds[i].relink) {
+            report_time_trace(&builds[i], &tree, &graph);
+        }
+    }
+
+CLEAN_UP_AND_RETURN:
+    for (size_t i = 0; i < configs_len; i++) {
+        config_build_free(&builds[i], &tree);
+    }
+    free(builds);
+    jobs_free(&graph);
+    source_tree_free(&tree);
+    strlist_free(&env.pch_headers[0]);
+    strlist_free(&env.pch_headers[1]);
+    if (!opts->state) build_state_free(env.state);
+    return result;
+}
@@ -0,0 +1,59 @@
+#ifndef _BUILDER_H_
+#define _BUILDER_H_
+
+#include "conf.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OBJ_DIR BUILDX_DIR"/obj"
+
+typedef struct BuildConfig {
+	const char *name;
+	StrList cflags;
+	StrList ldflags;
+	bool split_dwarf;       // Debug info goes in a .dwo next to each object.
+	bool thin_lto;          // Links keep a ThinLTO cache in LTO_CACHE_DIR.
+} BuildConfig;
+
+#define LTO_CACHE_DIR BUILDX_DIR"/lto"
+
+bool build_config_init(BuildConfig *config, const ProjConf *proj, const char *name);
+void build_config_free(BuildConfig *config);
+
+// What a build learned about the source tree (directory listings, header
+// dependencies, file stats). Passing the same state to consecutive builds
+// lets them skip rediscovering what hasn't changed.
+typedef struct BuildState BuildState;
+
+BuildState *build_state_new(void);
+void build_state_free(BuildState *state);
+
+typedef struct BuildOptions {
+	int max_jobs;       // Maximum number of compiler processes at a time.
+	bool use_cache;     // Reuse objects from the shared object cache.
+	BuildState *state;  // Kept between builds. May be NULL.
+	bool stats;         // Report time and memory used by each compile and link.
+	bool time_trace;    // Recompile everything with clang's -ftime-trace and aggregate the results.
+	size_t unity_files; // Compile sources in batches of this many. Zero for no batching.
+	uint64_t unity_size;// Batch sources until they add up to this many bytes instead.
+	Linker linker;      // Overrides the project's `linker` setting unless unset.
+} BuildOptions;
+
+#define UNITY_DEFAULT_FILES (8)
+#define UNITY_DIR BUILDX_DIR"/unity"
+
+#define STATS_PATH BUILDX_DIR"/stats.json"
+
+// The C compiler, from $CC.
+const char *c_compiler(void);
+
+// The compiler used for the project's language, from $CC or $CXX.
+const char *project_compiler(const ProjConf *proj);
+bool project_uses_clang(const ProjConf *proj);
+
+// Builds every configuration in `configs`.
+bool build_project(const ProjConf *proj, const BuildConfig *configs, size_t configs_len, const BuildOptions *opts);
+
+#endif // _BUILDER_H_
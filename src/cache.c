@@ -0,0 +1,670 @@
+#include "cache.h"
+#include "conf.h"
+#include "hash.h"
+#include "http.h"
+#include "lz.h"
+#include "proc.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+// Bump when the layout of cache keys changes.
+#define CACHE_KEY_VERSION "buildx-cache-1"
+
+// Compressed entries start with this magic followed by the uncompressed size
+// as a little endian u64. Anything else is a plain object file.
+#define COMPRESSED_MAGIC "BXZ1"
+#define COMPRESSED_HEADER_LEN (4 + 8)
+
+// After trimming, the cache is this fraction of its maximum size.
+#define TRIM_TARGET (0.9)
+
+typedef struct CacheEntry {
+    char *path;
+    uint64_t size;
+    int64_t atime_ns;
+} CacheEntry;
+
+bool cache_dir(char *out, size_t size) {
+    const char *dir = getenv("BUILDX_CACHE_DIR");
+    if (dir && *dir) {
+        snprintf(out, size, "%s", dir);
+        return true;
+    }
+
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) {
+        snprintf(out, size, "%s/buildx", xdg);
+        return true;
+    }
+
+    const char *home = getenv("HOME");
+    if (home && *home) {
+        snprintf(out, size, "%s/.cache/buildx", home);
+        return true;
+    }
+
+    return false;
+}
+
+void cache_settings(const ProjConf *proj, CacheSettings *settings) {
+    *settings = (CacheSettings){ .max_size = CACHE_DEFAULT_MAX_SIZE, .remote_upload = true };
+
+    GlobalConf global;
+    if (read_global_conf(&global)) {
+        if (global.cache_max_size) settings->max_size = global.cache_max_size;
+        if (global.cache_compression) settings->compress = global.cache_compression == TOGGLE_ON;
+        if (global.cache_remote) settings->remote = global.cache_remote;
+        if (global.cache_remote_upload) settings->remote_upload = global.cache_remote_upload == TOGGLE_ON;
+    }
+
+    if (proj) {
+        if (proj->cache_max_size) settings->max_size = proj->cache_max_size;
+        if (proj->cache_compression) settings->compress = proj->cache_compression == TOGGLE_ON;
+        if (proj->cache_remote) settings->remote = proj->cache_remote;
+        if (proj->cache_remote_upload) settings->remote_upload = proj->cache_remote_upload == TOGGLE_ON;
+    }
+
+    const char *remote = getenv("BUILDX_REMOTE_CACHE");
+    if (remote) {
+        settings->remote = *remote ? remote : NULL;
+    }
+}
+
+static bool is_entry_name(const char *name) {
+    return name[0] != '.' && (ends_with(name, ".o") || ends_with(name, ".dwo"));
+}
+
+// Calls `visit` for every entry in the cache.
+static bool walk_entries(const char *dir, void (*visit)(void *ctx, const char *path, const struct stat *s), void *ctx) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return errno == ENOENT;
+    }
+
+    struct dirent *shard;
+    while ((shard = readdir(d)) != NULL) {
+        if (shard->d_name[0] == '.' || strlen(shard->d_name) != 2) {
+            continue;
+        }
+
+        char shard_path[PATH_MAX];
+        snprintf(shard_path, sizeof(shard_path), "%s/%s", dir, shard->d_name);
+
+        DIR *sd = opendir(shard_path);
+        if (!sd) {
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(sd)) != NULL) {
+            if (!is_entry_name(entry->d_name)) {
+                continue;
+            }
+
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", shard_path, entry->d_name);
+
+            struct stat s;
+            if (stat(path, &s) == 0 && S_ISREG(s.st_mode)) {
+                visit(ctx, path, &s);
+            }
+        }
+        closedir(sd);
+    }
+
+    closedir(d);
+    return true;
+}
+
+static bool entry_is_compressed(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+
+    char magic[4];
+    bool compressed = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                      memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    return compressed;
+}
+
+static void count_entry(void *ctx, const char *path, const struct stat *s) {
+    CacheStats *stats = (CacheStats *)ctx;
+    stats->entries++;
+    stats->size += (uint64_t)s->st_size;
+    if (entry_is_compressed(path)) {
+        stats->compressed_entries++;
+    }
+}
+
+// Holds the hit and miss counters and a running total of the size of the
+// entries, so builds can tell whether the cache needs trimming without
+// listing it. The total is missing until the cache has been trimmed once.
+#define STATS_FILE "stats"
+
+// Adds to the counters and the total size in the stats file, or replaces
+// the total with `*size` if it isn't NULL. Several jobs may do this at
+// once, so the file is locked while it is updated.
+static void update_stats(const char *dir, int hits, int misses, int64_t added, const uint64_t *size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"STATS_FILE, dir);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    if (flock(fd, LOCK_EX) == 0) {
+        char buf[96] = {0};
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        unsigned long long old_hits = 0, old_misses = 0, total = 0;
+        bool has_total = n > 0 && sscanf(buf, "%llu %llu %llu", &old_hits, &old_misses, &total) == 3;
+
+        if (size) {
+            total = *size;
+            has_total = true;
+        } else if (added < 0 && (unsigned long long)-added > total) {
+            total = 0;
+        } else {
+            total += (unsigned long long)added;
+        }
+
+        int len;
+        if (has_total) {
+            len = snprintf(buf, sizeof(buf), "%llu %llu %llu\n", old_hits + hits, old_misses + misses, total);
+        } else {
+            len = snprintf(buf, sizeof(buf), "%llu %llu\n", old_hits + hits, old_misses + misses);
+        }
+        if (lseek(fd, 0, SEEK_SET) == 0 && write(fd, buf, len) == len) {
+            ftruncate(fd, len);
+        }
+        flock(fd, LOCK_UN);
+    }
+
+    close(fd);
+}
+
+static void record_result(const char *dir, bool hit, int64_t added) {
+    update_stats(dir, hit, !hit, added, NULL);
+}
+
+// Size of an entry on disk, or zero if there is none.
+static int64_t entry_size(const char *entry) {
+    struct stat s;
+    return stat(entry, &s) == 0 ? (int64_t)s.st_size : 0;
+}
+
+bool cache_stats(const char *dir, CacheStats *stats) {
+    *stats = (CacheStats){0};
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"STATS_FILE, dir);
+
+    char *counters = read_file(path, NULL);
+    if (counters) {
+        unsigned long long hits = 0, misses = 0;
+        sscanf(counters, "%llu %llu", &hits, &misses);
+        stats->hits = hits;
+        stats->misses = misses;
+        free(counters);
+    }
+
+    return walk_entries(dir, count_entry, stats);
+}
+
+typedef struct EntryList {
+    CacheEntry *items;
+    size_t length;
+    size_t capacity;
+    uint64_t total;
+} EntryList;
+
+static void collect_entry(void *ctx, const char *path, const struct stat *s) {
+    EntryList *list = (EntryList *)ctx;
+    if (list->length == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = realloc(list->items, list->capacity * sizeof(*list->items));
+    }
+
+#ifdef __APPLE__
+    int64_t atime = (int64_t)s->st_atimespec.tv_sec * 1000000000 + s->st_atimespec.tv_nsec;
+#else
+    int64_t atime = (int64_t)s->st_atim.tv_sec * 1000000000 + s->st_atim.tv_nsec;
+#endif
+
+    list->items[list->length++] = (CacheEntry){
+        .path = strdup(path),
+        .size = (uint64_t)s->st_size,
+        .atime_ns = atime,
+    };
+    list->total += (uint64_t)s->st_size;
+}
+
+static int compare_atime(const void *a, const void *b) {
+    int64_t x = ((const CacheEntry *)a)->atime_ns;
+    int64_t y = ((const CacheEntry *)b)->atime_ns;
+    return (x > y) - (x < y);
+}
+
+bool cache_trim(const char *dir, uint64_t max_size) {
+    EntryList list = {0};
+    if (!walk_entries(dir, collect_entry, &list)) {
+        return false;
+    }
+
+    bool ok = true;
+    if (list.total > max_size) {
+        uint64_t target = (uint64_t)((double)max_size * TRIM_TARGET);
+        if (list.length > 0) {
+            qsort(list.items, list.length, sizeof(*list.items), compare_atime);
+        }
+
+        for (size_t i = 0; i < list.length && list.total > target; i++) {
+            if (unlink(list.items[i].path) == 0) {
+                list.total -= list.items[i].size;
+            } else if (errno != ENOENT) {
+                ok = false;
+            }
+        }
+    }
+
+    // Entries stored while the cache was being listed are left out of the
+    // total, which the next trim corrects.
+    update_stats(dir, 0, 0, 0, &list.total);
+
+    for (size_t i = 0; i < list.length; i++) {
+        free(list.items[i].path);
+    }
+    free(list.items);
+    return ok;
+}
+
+bool cache_trim_if_needed(const char *dir, uint64_t max_size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"STATS_FILE, dir);
+
+    char *counters = read_file(path, NULL);
+    unsigned long long hits, misses, total;
+    bool fits = counters && sscanf(counters, "%llu %llu %llu", &hits, &misses, &total) == 3 && total <= max_size;
+    free(counters);
+
+    return fits || cache_trim(dir, max_size);
+}
+
+static void remove_entry(void *ctx, const char *path, const struct stat *s) {
+    UNUSED(s);
+    if (unlink(path) != 0 && errno != ENOENT) {
+        *(bool *)ctx = false;
+    }
+}
+
+bool cache_clear(const char *dir) {
+    bool ok = true;
+    if (!walk_entries(dir, remove_entry, &ok)) {
+        return false;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/"STATS_FILE, dir);
+    unlink(path);
+
+    return ok;
+}
+
+static bool find_in_path(const char *name, char *out, size_t size) {
+    if (strchr(name, '/')) {
+        return realpath(name, out) != NULL;
+    }
+
+    const char *path = getenv("PATH");
+    if (!path) {
+        return false;
+    }
+
+    char *dirs = strdup(path);
+    char *save = NULL;
+    bool found = false;
+    for (char *dir = strtok_r(dirs, ":", &save); dir && !found; dir = strtok_r(NULL, ":", &save)) {
+        char candidate[PATH_MAX];
+        snprintf(candidate, sizeof(candidate), "%s/%s", *dir ? dir : ".", name);
+        if (access(candidate, X_OK) == 0 && realpath(candidate, out) && strlen(out) < size) {
+            found = true;
+        }
+    }
+
+    free(dirs);
+    return found;
+}
+
+void compiler_stamp(const char *compiler, char *out, size_t size) {
+    char path[PATH_MAX];
+    struct stat s;
+    if (!find_in_path(compiler, path, sizeof(path)) || stat(path, &s) != 0) {
+        snprintf(out, size, "%s", compiler);
+        return;
+    }
+
+    snprintf(out, size, "%s %lld", path, (long long)s.st_mtime);
+}
+
+static void collect_output(void *ctx, const void *data, size_t len) {
+    strbuf_append_len((StrBuf *)ctx, data, len);
+}
+
+void compiler_identity(const char *compiler, StrBuf *out) {
+    char path[PATH_MAX];
+    struct stat s;
+    if (!find_in_path(compiler, path, sizeof(path)) || stat(path, &s) != 0) {
+        strbuf_append(out, compiler);
+        return;
+    }
+
+    // Nothing machine specific like the install path or mtime goes in, so
+    // identical toolchains on different machines can share a remote cache.
+    strbuf_appendf(out, "%s %lld\n", compiler, (long long)s.st_size);
+
+    char *argv[] = { path, "--version", NULL };
+    int exit_code;
+    proc_run_piped(argv, collect_output, out, &exit_code);
+}
+
+static void hash_output(void *ctx, const void *data, size_t len) {
+    sha256_update((Sha256 *)ctx, data, len);
+}
+
+// Copies a cache entry to `obj`, decompressing it if needed.
+static bool fetch_entry(const char *entry, const char *obj) {
+    if (!entry_is_compressed(entry)) {
+        return copy_file(entry, obj);
+    }
+
+    size_t len;
+    unsigned char *data = (unsigned char *)read_file(entry, &len);
+    if (!data) {
+        return false;
+    }
+
+    bool ok = false;
+    unsigned char *raw = NULL;
+    if (len >= COMPRESSED_HEADER_LEN) {
+        uint64_t raw_len = 0;
+        for (int i = 0; i < 8; i++) {
+            raw_len |= (uint64_t)data[4 + i] << (i * 8);
+        }
+
+        raw = malloc(raw_len ? raw_len : 1);
+        ok = raw && lz_decompress(data + COMPRESSED_HEADER_LEN, len - COMPRESSED_HEADER_LEN, raw, raw_len) &&
+             write_file_atomic(obj, (const char *)raw, raw_len);
+    }
+
+    if (!ok) {
+        logprint(LOG_WARN, "Ignoring corrupt cache entry '%s'.", entry);
+        unlink(entry);
+    }
+
+    free(raw);
+    free(data);
+    return ok;
+}
+
+static bool store_entry(const char *obj, const char *entry, bool compress) {
+    if (!make_parent_dirs(entry)) {
+        return false;
+    }
+
+    if (!compress) {
+        return copy_file(obj, entry);
+    }
+
+    size_t len;
+    unsigned char *raw = (unsigned char *)read_file(obj, &len);
+    if (!raw) {
+        return false;
+    }
+
+    size_t cap = COMPRESSED_HEADER_LEN + lz_compress_bound(len);
+    unsigned char *out = malloc(cap);
+    memcpy(out, COMPRESSED_MAGIC, 4);
+    for (int i = 0; i < 8; i++) {
+        out[4 + i] = (unsigned char)((uint64_t)len >> (i * 8));
+    }
+
+    size_t compressed_len = lz_compress(raw, len, out + COMPRESSED_HEADER_LEN, cap - COMPRESSED_HEADER_LEN);
+    bool ok = compressed_len > 0 && write_file_atomic(entry, (const char *)out, COMPRESSED_HEADER_LEN + compressed_len);
+
+    free(out);
+    free(raw);
+    return ok;
+}
+
+// Marks an entry as recently used. Access times can't be relied on since
+// most file systems are mounted relatime or noatime.
+static void touch_entry(const char *entry) {
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_NOW },
+        { .tv_nsec = UTIME_OMIT },
+    };
+    utimensat(AT_FDCWD, entry, times, 0);
+}
+
+static bool is_key(const char *s) {
+    size_t len = 0;
+    for (; s[len]; len++) {
+        if (!((s[len] >= '0' && s[len] <= '9') || (s[len] >= 'a' && s[len] <= 'f'))) {
+            return false;
+        }
+    }
+    return len == SHA256_HEX_LEN;
+}
+
+static void entry_path(const char *dir, const char *key, char *out, size_t size) {
+    snprintf(out, size, "%s/%.2s/%s.o", dir, key, key + 2);
+}
+
+// Split debug info is stored beside the object's entry. Either may be
+// evicted on its own, in which case the pair counts as a miss.
+static void dwo_entry_path(const char *dir, const char *key, char *out, size_t size) {
+    snprintf(out, size, "%s/%.2s/%s.dwo", dir, key, key + 2);
+}
+
+bool cache_remote_reachable(const HttpUrl *remote) {
+    int status;
+    return http_get(remote, "/", NULL, &status);
+}
+
+// Downloads the entry for `key` into the local cache. Entries are
+// transferred as stored, so compressed ones stay compressed.
+static bool fetch_remote(const HttpUrl *remote, const char *key, const char *entry) {
+    char path[SHA256_HEX_LEN + 2];
+    snprintf(path, sizeof(path), "/%s", key);
+
+    StrBuf body = {0};
+    int status;
+    bool ok = http_get(remote, path, &body, &status) && status == 200 &&
+              make_parent_dirs(entry) &&
+              write_file_atomic(entry, body.bytes, body.length);
+
+    strbuf_free(&body);
+    return ok;
+}
+
+static void upload_remote(const HttpUrl *remote, const char *key, const char *entry) {
+    size_t len;
+    char *data = read_file(entry, &len);
+    if (!data) {
+        return;
+    }
+
+    char path[SHA256_HEX_LEN + 2];
+    snprintf(path, sizeof(path), "/%s", key);
+
+    int status;
+    if (!http_put(remote, path, data, len, &status)) {
+        logprint(LOG_WARN, "Couldn't reach the remote cache at '%s:%s'.", remote->host, remote->port);
+    } else if (status / 100 != 2) {
+        logprint(LOG_WARN, "Remote cache rejected an upload with status %d.", status);
+    }
+
+    free(data);
+}
+
+typedef struct ServeCtx {
+    const char *dir;
+    uint64_t max_size;
+} ServeCtx;
+
+static int serve_request(void *ctx, const HttpRequest *req, StrBuf *response) {
+    ServeCtx *serve = (ServeCtx *)ctx;
+
+    // Clients may put the cache under any prefix. Only the last path
+    // component matters.
+    const char *key = strrchr(req->path, '/');
+    key = key ? key + 1 : req->path;
+
+    if (*key == '\0' && strcmp(req->method, "GET") == 0) {
+        return 200;
+    }
+
+    if (!is_key(key)) {
+        return 404;
+    }
+
+    char entry[PATH_MAX];
+    entry_path(serve->dir, key, entry, sizeof(entry));
+
+    if (strcmp(req->method, "GET") == 0) {
+        size_t len;
+        char *data = read_file(entry, &len);
+        if (!data) {
+            return 404;
+        }
+        strbuf_append_len(response, data, len);
+        free(data);
+        touch_entry(entry);
+        return 200;
+    }
+
+    if (strcmp(req->method, "PUT") == 0) {
+        int64_t old_size = entry_size(entry);
+        if (!make_parent_dirs(entry) || !write_file_atomic(entry, req->body, req->body_length)) {
+            return 500;
+        }
+        update_stats(serve->dir, 0, 0, (int64_t)req->body_length - old_size, NULL);
+        return 201;
+    }
+
+    return 405;
+}
+
+static void serve_idle(void *ctx) {
+    ServeCtx *serve = (ServeCtx *)ctx;
+    if (!cache_trim_if_needed(serve->dir, serve->max_size)) {
+        logprint(LOG_WARN, "Failed to trim the cache at '%s'.", serve->dir);
+    }
+}
+
+bool cache_serve(const char *dir, const char *host, const char *port, uint64_t max_size) {
+    if (!make_dirs(dir)) {
+        return false;
+    }
+
+    ServeCtx ctx = { .dir = dir, .max_size = max_size };
+    serve_idle(&ctx);
+
+    logprint(LOG_INFO, "Serving the cache at '%s' on %s:%s.", dir, host ? host : "*", port);
+    fflush(stdout);
+    return http_serve(host, port, serve_request, serve_idle, &ctx);
+}
+
+int cache_compile(void *ctx) {
+    CacheCompile *cc = (CacheCompile *)ctx;
+
+    Sha256 sha;
+    sha256_init(&sha);
+    sha256_update_str(&sha, CACHE_KEY_VERSION);
+    sha256_update_str(&sha, cc->compiler_id);
+    for (size_t i = 0; i < cc->compile_argv.length; i++) {
+        sha256_update_str(&sha, cc->compile_argv.items[i]);
+    }
+
+    if (cc->hash_cwd) {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd))) {
+            sha256_update_str(&sha, cwd);
+        }
+    }
+
+    // Preprocessing also writes the dependency file, so hits keep
+    // incremental builds working.
+    int exit_code;
+    if (!proc_run_piped(cc->preprocess_argv.items, hash_output, &sha, &exit_code)) {
+        return 1;
+    }
+    if (exit_code != 0) {
+        return exit_code;
+    }
+
+    char key[SHA256_HEX_LEN + 1];
+    sha256_final_hex(&sha, key);
+
+    char entry[PATH_MAX];
+    entry_path(cc->cache_dir, key, entry, sizeof(entry));
+
+    char dwo_entry[PATH_MAX];
+    dwo_entry_path(cc->cache_dir, key, dwo_entry, sizeof(dwo_entry));
+
+    bool hit = access(entry, F_OK) == 0 &&
+               (!cc->dwo || access(dwo_entry, F_OK) == 0) &&
+               fetch_entry(entry, cc->obj) &&
+               (!cc->dwo || fetch_entry(dwo_entry, cc->dwo));
+    if (hit) {
+        touch_entry(entry);
+        if (cc->dwo) touch_entry(dwo_entry);
+        record_result(cc->cache_dir, true, 0);
+        return 0;
+    }
+
+    // Whatever is there is about to be replaced.
+    int64_t old_size = entry_size(entry) + (cc->dwo ? entry_size(dwo_entry) : 0);
+
+    // The remote cache only holds objects, not split debug info.
+    const HttpUrl *remote = cc->dwo ? NULL : cc->remote;
+
+    if (remote && fetch_remote(remote, key, entry) && fetch_entry(entry, cc->obj)) {
+        record_result(cc->cache_dir, true, entry_size(entry) - old_size);
+        return 0;
+    }
+
+    // Never write through a link into something else.
+    unlink(cc->obj);
+
+    if (!proc_run(cc->compile_argv.items, &exit_code)) {
+        return 1;
+    }
+    if (exit_code != 0) {
+        return exit_code;
+    }
+
+    if (!store_entry(cc->obj, entry, cc->compress) ||
+        (cc->dwo && !store_entry(cc->dwo, dwo_entry, cc->compress)))
+    {
+        logprint(LOG_WARN, "Failed to store '%s' in the cache.", cc->obj);
+    } else if (remote && cc->remote_upload) {
+        upload_remote(remote, key, entry);
+    }
+    int64_t new_size = entry_size(entry) + (cc->dwo ? entry_size(dwo_entry) : 0);
+    record_result(cc->cache_dir, false, new_size - old_size);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "conf.h"
+#include "http.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_DEFAULT_MAX_SIZE (5ull << 30)
+
+typedef struct CacheSettings {
+	uint64_t max_size;
+	bool compress;
+	const char *remote;       // URL of a shared HTTP cache. NULL if there is none.
+	bool remote_upload;       // Store newly compiled objects in the remote cache too.
+} CacheSettings;
+
+typedef struct CacheStats {
+	size_t entries;
+	size_t compressed_entries;
+	uint64_t size;
+	uint64_t hits;
+	uint64_t misses;
+} CacheStats;
+
+// Everything needed to compile one translation unit through the object cache.
+typedef struct CacheCompile {
+	StrList compile_argv;
+	StrList preprocess_argv;  // Same flags as `compile_argv` but only preprocesses to stdout.
+	const char *obj;
+	const char *dwo;          // Split debug info written next to `obj`. May be NULL.
+	const char *compiler_id;
+	const char *cache_dir;
+	bool hash_cwd;            // Debug info embeds the working directory.
+	bool compress;
+	const HttpUrl *remote;    // Consulted on local misses. May be NULL.
+	bool remote_upload;
+} CacheCompile;
+
+// Resolves the object cache directory: $BUILDX_CACHE_DIR, then
+// $XDG_CACHE_HOME/buildx, then ~/.cache/buildx.
+bool cache_dir(char *out, size_t size);
+
+// Resolves cache settings. The project's conf.ini (if `proj` isn't NULL)
+// takes precedence over the global configuration. $BUILDX_REMOTE_CACHE
+// overrides the remote cache URL from either; set it empty to disable it.
+void cache_settings(const ProjConf *proj, CacheSettings *settings);
+
+bool cache_stats(const char *dir, CacheStats *stats);
+
+// Evicts least recently used entries until the cache is no larger than
+// `max_size`. Trims a little further than needed so the next few builds
+// don't each have to evict again.
+bool cache_trim(const char *dir, uint64_t max_size);
+
+// Trims only if the running total of entry sizes kept in the cache's stats
+// file is over `max_size`, or if there is no total yet.
+bool cache_trim_if_needed(const char *dir, uint64_t max_size);
+
+bool cache_clear(const char *dir);
+
+// Checks that a remote cache answers at all, so a build doesn't pay a
+// connection timeout for every translation unit.
+bool cache_remote_reachable(const HttpUrl *remote);
+
+// Serves `dir` as a remote cache: `GET /<key>` and `PUT /<key>`, where the
+// key is the hex SHA-256 the builder computes. Entries are stored in the same
+// layout as a local cache and trimmed to `max_size` periodically.
+bool cache_serve(const char *dir, const char *host, const char *port, uint64_t max_size);
+
+// Names the file `compiler` resolves to through PATH along with its mtime,
+// which changes whenever the compiler is replaced or upgraded. Anything
+// learned by running the compiler can be remembered under this.
+#define COMPILER_STAMP_MAX (PATH_MAX + 32)
+void compiler_stamp(const char *compiler, char *out, size_t size);
+
+// Describes `compiler` (resolved through PATH) well enough that upgrading it
+// changes every cache key, but the same on every machine with that compiler.
+void compiler_identity(const char *compiler, StrBuf *out);
+
+// Job function. Hashes the preprocessed translation unit together with the
+// compiler and flags, and copies the object out of the cache on a hit.
+// Local misses are looked up in the remote cache, if there is one.
+// Otherwise compiles normally and stores the result.
+int cache_compile(void *ctx);
+
+#endif // _CACHE_H_
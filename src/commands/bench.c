@@ -0,0 +1,555 @@
+#include "argiter.h"
+#include "builder.h"
+#include "cmd.h"
+#include "conf.h"
+#include "jobs.h"
+#include "proc.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+#define BENCH_DIR BUILDX_DIR"/bench"
+#define BENCH_WORKTREE BENCH_DIR"/rev"  // Checkout of the revision `--rev` compares against.
+
+#define DEFAULT_RUNS (10)
+#define DEFAULT_WARMUP (2)
+
+typedef struct CmdBenchData {
+    const char *profile;    // Defaults to release.
+    int runs;
+    int warmup;
+    bool show_output;
+    const char *compare_exe;
+    const char *compare_rev;
+    StrList args;
+} CmdBenchData;
+
+static void usage_bench(void) {
+    printf("Usage: bx bench [-h] [-d|-r|-p NAME] [-n RUNS] [--warmup N] [--show-output] [--compare EXE|--rev REV] [-- args...]\n");
+    printf("Builds the project, then times repeated runs of the executable with `args`.\n");
+    printf("Options:\n");
+    printf("    -d, --debug:     Benchmark debug executable.\n");
+    printf("    -r, --release:   Benchmark release executable. This is the default.\n");
+    printf("    -p, --profile:   Benchmark the executable of a profile.\n");
+    printf("    -n, --runs:      Number of measured runs. Default is %d.\n", DEFAULT_RUNS);
+    printf("    --warmup:        Number of runs before measuring, to warm up caches. Default is %d.\n", DEFAULT_WARMUP);
+    printf("    --show-output:   Let the executable write to the terminal instead of discarding its output.\n");
+    printf("    --compare:       Also benchmark EXE with the same arguments and compare the two.\n");
+    printf("    --rev:           Also build the sources of git revision REV with the same flags, benchmark them\n");
+    printf("                     and compare the two. The revision is checked out in `%s`.\n", BENCH_WORKTREE);
+    printf("    -h, --help:      Show this help message.\n");
+}
+
+static bool cmd_bench_help(ArgIter *args, void *cmd_data) {
+    UNUSED(args, cmd_data);
+    usage_bench();
+    exit(0);
+    return true;
+}
+
+static bool cmd_bench_debug(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+    bench_data->profile = "debug";
+
+    return true;
+}
+
+static bool cmd_bench_release(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+    bench_data->profile = "release";
+
+    return true;
+}
+
+static bool cmd_bench_profile(ArgIter *args, void *cmd_data) {
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+
+    bench_data->profile = iter_next(args);
+    if (!bench_data->profile) {
+        logprint(LOG_ERROR, "Expected a profile after `-p/--profile` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_count(const char *s, int min, int *out) {
+    if (!s) {
+        return false;
+    }
+
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (*end != '\0' || n < min || n > 1000000) {
+        return false;
+    }
+
+    *out = (int)n;
+    return true;
+}
+
+static bool cmd_bench_runs(ArgIter *args, void *cmd_data) {
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+
+    const char *runs = iter_next(args);
+    if (!parse_count(runs, 2, &bench_data->runs)) {
+        logprint(LOG_ERROR, "Expected at least 2 runs after `-n/--runs` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_bench_warmup(ArgIter *args, void *cmd_data) {
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+
+    const char *warmup = iter_next(args);
+    if (!parse_count(warmup, 0, &bench_data->warmup)) {
+        logprint(LOG_ERROR, "Expected a number after `--warmup` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_bench_show_output(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+    bench_data->show_output = true;
+
+    return true;
+}
+
+static bool cmd_bench_compare(ArgIter *args, void *cmd_data) {
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+
+    bench_data->compare_exe = iter_next(args);
+    if (!bench_data->compare_exe) {
+        logprint(LOG_ERROR, "Expected an executable after `--compare` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_bench_rev(ArgIter *args, void *cmd_data) {
+    CmdBenchData *bench_data = (CmdBenchData *)cmd_data;
+
+    bench_data->compare_rev = iter_next(args);
+    if (!bench_data->compare_rev) {
+        logprint(LOG_ERROR, "Expected a git revision after `--rev` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static const CmdFlagInfo flags[] = {
+    (CmdFlagInfo){
+        .short_name = "h",
+        .long_name = "help",
+        .cmd = cmd_bench_help
+    },
+    (CmdFlagInfo){
+        .short_name = "d",
+        .long_name = "debug",
+        .cmd = cmd_bench_debug
+    },
+    (CmdFlagInfo){
+        .short_name = "r",
+        .long_name = "release",
+        .cmd = cmd_bench_release
+    },
+    (CmdFlagInfo){
+        .short_name = "p",
+        .long_name = "profile",
+        .cmd = cmd_bench_profile
+    },
+    (CmdFlagInfo){
+        .short_name = "n",
+        .long_name = "runs",
+        .cmd = cmd_bench_runs
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "warmup",
+        .cmd = cmd_bench_warmup
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "show-output",
+        .cmd = cmd_bench_show_output
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "compare",
+        .cmd = cmd_bench_compare
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "rev",
+        .cmd = cmd_bench_rev
+    },
+};
+
+static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
+
+// The measurements of one executable.
+typedef struct Bench {
+    const char *label;
+    StrList argv;
+    double *wall;           // Seconds, one per measured run.
+    double *cpu;
+    uint64_t peak_rss;
+    int done;
+} Bench;
+
+typedef struct Summary {
+    double mean;
+    double median;
+    double stddev;
+    double min;
+    double max;
+    double ci_low;          // 95% confidence interval of the mean.
+    double ci_high;
+} Summary;
+
+// Two-sided 95% critical values of Student's t distribution for 1 to 30
+// degrees of freedom. Beyond that the normal distribution is close enough.
+static const double t_table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static double t_critical(double df) {
+    size_t i = df < 1 ? 0 : (size_t)df - 1;
+    return i < sizeof(t_table) / sizeof(t_table[0]) ? t_table[i] : 1.960;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static Summary summarize(const double *samples, int n) {
+    double *sorted = malloc((size_t)n * sizeof(*sorted));
+    memcpy(sorted, samples, (size_t)n * sizeof(*sorted));
+    qsort(sorted, (size_t)n, sizeof(*sorted), compare_doubles);
+
+    Summary s = {
+        .min = sorted[0],
+        .max = sorted[n - 1],
+        .median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2,
+    };
+    free(sorted);
+
+    for (int i = 0; i < n; i++) {
+        s.mean += samples[i];
+    }
+    s.mean /= n;
+
+    double squares = 0;
+    for (int i = 0; i < n; i++) {
+        squares += (samples[i] - s.mean) * (samples[i] - s.mean);
+    }
+    s.stddev = sqrt(squares / (n - 1));
+
+    double margin = t_critical(n - 1) * s.stddev / sqrt(n);
+    s.ci_low = s.mean - margin;
+    s.ci_high = s.mean + margin;
+    return s;
+}
+
+static void format_seconds(double seconds, char *out, size_t out_size) {
+    format_duration((int64_t)(seconds * 1e9), out, out_size);
+}
+
+static bool run_once(Bench *bench, bool show_output, bool measure) {
+    ProcUsage usage;
+    int exit_code;
+    if (!proc_run_measured(bench->argv.items, !show_output, &usage, &exit_code)) {
+        return false;
+    }
+
+    if (exit_code != 0) {
+        logprint(LOG_ERROR, "'%s' exited with code %d. Use `--show-output` to see why.", bench->argv.items[0], exit_code);
+        return false;
+    }
+
+    if (measure) {
+        bench->wall[bench->done] = (double)usage.wall_ns / 1e9;
+        bench->cpu[bench->done] = (double)(usage.user_ns + usage.sys_ns) / 1e9;
+        bench->done++;
+        if (usage.peak_rss > bench->peak_rss) {
+            bench->peak_rss = usage.peak_rss;
+        }
+    }
+    return true;
+}
+
+static void report(const Bench *bench) {
+    Summary wall = summarize(bench->wall, bench->done);
+    Summary cpu = summarize(bench->cpu, bench->done);
+
+    char mean[32], stddev[32], ci_low[32], ci_high[32];
+    char median[32], min[32], max[32], cpu_mean[32], rss[32];
+    format_seconds(wall.mean, mean, sizeof(mean));
+    format_seconds(wall.stddev, stddev, sizeof(stddev));
+    format_seconds(wall.ci_low, ci_low, sizeof(ci_low));
+    format_seconds(wall.ci_high, ci_high, sizeof(ci_high));
+    format_seconds(wall.median, median, sizeof(median));
+    format_seconds(wall.min, min, sizeof(min));
+    format_seconds(wall.max, max, sizeof(max));
+    format_seconds(cpu.mean, cpu_mean, sizeof(cpu_mean));
+    format_size(bench->peak_rss, rss, sizeof(rss));
+
+    printf("==== %s ====\n", bench->label);
+    printf("    Time (mean ± σ):      %s ± %s  (95%% CI %s … %s)\n", mean, stddev, ci_low, ci_high);
+    printf("    Median / min / max:   %s / %s / %s\n", median, min, max);
+    printf("    CPU time (mean):      %s\n", cpu_mean);
+    printf("    Peak memory:          %s\n", rss);
+    printf("    Runs:                 %d\n", bench->done);
+}
+
+// Compares mean wall times with Welch's t-test, which doesn't assume the
+// two have the same variance.
+static void report_comparison(const Bench *current, const Bench *baseline) {
+    Summary a = summarize(current->wall, current->done);
+    Summary b = summarize(baseline->wall, baseline->done);
+
+    double va = a.stddev * a.stddev / current->done;
+    double vb = b.stddev * b.stddev / baseline->done;
+    double se = sqrt(va + vb);
+    double df = se > 0
+        ? (va + vb) * (va + vb) / (va * va / (current->done - 1) + vb * vb / (baseline->done - 1))
+        : current->done + baseline->done - 2;
+
+    // Change of the mean time relative to the baseline.
+    double diff = a.mean - b.mean;
+    double margin = t_critical(df) * se;
+    double pct_low = 100 * (diff - margin) / b.mean;
+    double pct_high = 100 * (diff + margin) / b.mean;
+
+    printf("==== Comparison ====\n");
+    if (pct_high < 0) {
+        printf("    %s is %.2fx faster than %s (time %+.1f%% … %+.1f%%, 95%% CI).\n",
+            current->label, b.mean / a.mean, baseline->label, pct_low, pct_high);
+    } else if (pct_low > 0) {
+        printf("    %s is %.2fx slower than %s (time %+.1f%% … %+.1f%%, 95%% CI).\n",
+            current->label, a.mean / b.mean, baseline->label, pct_low, pct_high);
+    } else {
+        printf("    No significant difference between %s and %s (time %+.1f%% … %+.1f%%, 95%% CI).\n",
+            current->label, baseline->label, pct_low, pct_high);
+    }
+}
+
+static void collect_output(void *ctx, const void *data, size_t len) {
+    strbuf_append_len((StrBuf *)ctx, data, len);
+}
+
+// Runs git with `argv` and returns the first line it prints.
+static char *git_line(char **argv) {
+    StrBuf out = {0};
+    int exit_code;
+    if (!proc_run_piped(argv, collect_output, &out, &exit_code) || exit_code != 0) {
+        strbuf_free(&out);
+        return NULL;
+    }
+
+    char *line = strndup(out.bytes ? out.bytes : "", out.bytes ? strcspn(out.bytes, "\n") : 0);
+    strbuf_free(&out);
+    return line;
+}
+
+// Checks out `rev` in BENCH_WORKTREE and builds its sources with the
+// current configuration. The worktree is kept, so later comparisons only
+// rebuild what differs.
+static bool build_revision(const ProjConf *proj, const char *profile, const char *rev, char *exe_path, size_t exe_size) {
+    if (proj->src_dir[0] == '/' || proj->out_dir[0] == '/') {
+        logprint(LOG_ERROR, "`--rev` needs source_directory and output_directory to be inside the project.");
+        return false;
+    }
+
+    StrBuf spec = {0};
+    strbuf_appendf(&spec, "%s^{commit}", rev);
+    char *commit = git_line((char *[]){ "git", "rev-parse", "--verify", "--quiet", spec.bytes, NULL });
+    char *prefix = git_line((char *[]){ "git", "rev-parse", "--show-prefix", NULL });
+    strbuf_free(&spec);
+
+    bool result = true;
+    bool ok;
+    char cwd[PATH_MAX];
+    if (!commit || !prefix) {
+        logprint(LOG_ERROR, "'%s' is not a revision of a git repository here.", rev);
+        RETURN(false);
+    }
+
+    int exit_code;
+    if (access(BENCH_WORKTREE, F_OK) == 0) {
+        char *argv[] = { "git", "-C", BENCH_WORKTREE, "checkout", "--quiet", "--detach", commit, NULL };
+        ok = proc_run(argv, &exit_code) && exit_code == 0;
+    } else {
+        char *argv[] = { "git", "worktree", "add", "--quiet", "--detach", BENCH_WORKTREE, commit, NULL };
+        ok = make_dirs(BENCH_DIR) && proc_run(argv, &exit_code) && exit_code == 0;
+    }
+    if (!ok) {
+        logprint(LOG_ERROR, "Failed to check out '%s' in '%s'.", rev, BENCH_WORKTREE);
+        RETURN(false);
+    }
+
+    // The worktree has the whole repository, and the project may be in a
+    // subdirectory of it.
+    char project_dir[PATH_MAX];
+    snprintf(project_dir, sizeof(project_dir), BENCH_WORKTREE"/%s", prefix);
+    if (!getcwd(cwd, sizeof(cwd)) || chdir(project_dir) != 0) {
+        logprint(LOG_ERROR, "Couldn't enter '%s'.", project_dir);
+        RETURN(false);
+    }
+
+    // Objects go to the worktree's own .buildx directory.
+    BuildConfig config;
+    ok = build_config_init(&config, proj, profile);
+    if (ok) {
+        BuildOptions opts = {
+            .max_jobs = jobs_default_count(),
+            .use_cache = true,
+        };
+        ok = build_project(proj, &config, 1, &opts);
+        build_config_free(&config);
+    }
+
+    if (chdir(cwd) != 0) {
+        logprint(LOG_FATAL, "Couldn't return to '%s'.", cwd);
+        ok = false;
+    }
+    snprintf(exe_path, exe_size, "%s%s/%s/%s", project_dir, proj->out_dir, profile, proj->exe_name);
+    result = ok;
+
+CLEAN_UP_AND_RETURN:
+    free(commit);
+    free(prefix);
+    return result;
+}
+
+static void bench_free(Bench *bench) {
+    strlist_free(&bench->argv);
+    free(bench->wall);
+    free(bench->cpu);
+}
+
+bool cmd_bench(ArgIter *args) {
+    bool result = true;
+    CmdBenchData cmd_data = {
+        .profile = "release",
+        .runs = DEFAULT_RUNS,
+        .warmup = DEFAULT_WARMUP,
+    };
+    Bench benches[2] = {0};
+    size_t benches_len = 0;
+    char exe_path[PATH_MAX];
+    char baseline_path[PATH_MAX];
+    char baseline_label[PATH_MAX];
+
+    if (!process_options(args, &cmd_data, flags, flags_length)) {
+        usage_bench();
+        return false;
+    }
+
+    if (iter_match(args, "--")) {
+        while (args->length > 0) {
+            strlist_push(&cmd_data.args, iter_next(args));
+        }
+    }
+
+    if (cmd_data.compare_exe && cmd_data.compare_rev) {
+        logprint(LOG_ERROR, "`--compare` and `--rev` can't be used together.");
+        RETURN(false);
+    }
+
+    Conf conf;
+    if (!read_conf(CONF_DIR, &conf)) {
+        logprint(LOG_FATAL, "Couldn't read conf.ini file at '%s'.", CONF_DIR);
+        RETURN(false);
+    }
+
+    BuildConfig config;
+    if (!build_config_init(&config, &conf.proj, cmd_data.profile)) {
+        RETURN(false);
+    }
+    BuildOptions opts = {
+        .max_jobs = jobs_default_count(),
+        .use_cache = true,
+    };
+    bool built = build_project(&conf.proj, &config, 1, &opts);
+    build_config_free(&config);
+    if (!built) {
+        RETURN(false);
+    }
+
+    snprintf(exe_path, sizeof(exe_path), "%s/%s/%s", conf.proj.out_dir, cmd_data.profile, conf.proj.exe_name);
+
+    const char *baseline = cmd_data.compare_exe;
+    if (cmd_data.compare_rev) {
+        if (!build_revision(&conf.proj, cmd_data.profile, cmd_data.compare_rev, baseline_path, sizeof(baseline_path))) {
+            RETURN(false);
+        }
+        baseline = baseline_path;
+        snprintf(baseline_label, sizeof(baseline_label), "%s", cmd_data.compare_rev);
+    } else if (baseline) {
+        snprintf(baseline_label, sizeof(baseline_label), "%s", baseline);
+    }
+
+    benches[benches_len++].label = cmd_data.compare_rev ? "Working tree" : exe_path;
+    strlist_push(&benches[0].argv, exe_path);
+    if (baseline) {
+        benches[benches_len].label = baseline_label;
+        strlist_push(&benches[benches_len++].argv, baseline);
+    }
+
+    for (size_t i = 0; i < benches_len; i++) {
+        Bench *bench = &benches[i];
+        strlist_extend(&bench->argv, &cmd_data.args);
+        bench->wall = calloc((size_t)cmd_data.runs, sizeof(*bench->wall));
+        bench->cpu = calloc((size_t)cmd_data.runs, sizeof(*bench->cpu));
+    }
+
+    printf("==== Benchmarking %s (%s): %d warmup and %d measured runs ====\n",
+        conf.proj.exe_name, cmd_data.profile, cmd_data.warmup, cmd_data.runs);
+    fflush(stdout);
+
+    // Runs of the two executables take turns, so drift in the machine's
+    // state (thermals, other load) affects both alike.
+    for (int run = 0; run < cmd_data.warmup + cmd_data.runs; run++) {
+        for (size_t i = 0; i < benches_len; i++) {
+            if (!run_once(&benches[i], cmd_data.show_output, run >= cmd_data.warmup)) {
+                RETURN(false);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < benches_len; i++) {
+        report(&benches[i]);
+    }
+    if (benches_len == 2) {
+        report_comparison(&benches[0], &benches[1]);
+    }
+
+CLEAN_UP_AND_RETURN:
+    for (size_t i = 0; i < benches_len; i++) {
+        bench_free(&benches[i]);
+    }
+    strlist_free(&cmd_data.args);
+    return result;
+}
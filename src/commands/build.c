@@ -1,19 +1,72 @@
+#include "builder.h"
 #include "cmd.h"
+#include "conf.h"
+#include "daemon.h"
+#include "hash.h"
+#include "jobs.h"
+#include "layout.h"
+#include "pgo.h"
+#include "trace.h"
 #include "utils.h"
+#include <dirent.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
 
 typedef struct CmdBuildData {
     bool build_debug;
     bool build_release;
+    const char *profile;
+    bool use_premake;
+    bool no_cache;
+    bool no_daemon;
+    int jobs;
+    const char *trace_path;
+    bool stats;
+    bool time_trace;
+    size_t unity_files;
+    uint64_t unity_size;
+    Linker linker;
+    Lto lto;
+    bool pgo;
+    bool layout;
+    StrList train_args;
 } CmdBuildData;
 
 static void usage_build(void) {
-    printf("Usage: bx build [-h|-d|-r]\n");
+    printf("Usage: bx build [-h|-d|-r|-p NAME] [-j N] [--no-cache] [--no-daemon] [--premake] [--trace FILE] [--stats] [--time-trace] [--unity[=N]] [--linker NAME]\n");
+    printf("                [--lto MODE] [--pgo|--layout [-- training args...]]\n");
     printf("Options:\n");
     printf("    -d, --debug:     Build debug executable.\n");
     printf("    -r, --release:   Build release executable.\n");
+    printf("    -p, --profile:   Build the executable of a profile from conf.ini, or of a built-in one\n");
+    printf("                     (relwithdebinfo, native, profile or asan).\n");
+    printf("    -j, --jobs:      Number of compile jobs to run at once. Default is the number of cores.\n");
+    printf("    --no-cache:      Don't use the shared object cache.\n");
+    printf("    --no-daemon:     Build in this process even if `bx daemon` is running.\n");
+    printf("    --premake:       Build through premake5 and make instead of buildx.\n");
+    printf("    --trace:         Write a timeline of the build to FILE in Chrome trace format\n");
+    printf("                     (open it in ui.perfetto.dev or chrome://tracing).\n");
+    printf("    --stats:         Report wall time, CPU time and peak memory of the slowest compiles and links.\n");
+    printf("                     Numbers for every job are written to `%s`.\n", STATS_PATH);
+    printf("    --time-trace:    Recompile with clang's -ftime-trace and report the most expensive headers,\n");
+    printf("                     template instantiations and optimization passes across the project.\n");
+    printf("    --unity:         Compile sources in batches of N files (default %d), or of N bytes with a K/M suffix.\n", UNITY_DEFAULT_FILES);
+    printf("                     Sources matching a pattern in the `unity_exclude` setting are compiled on their own.\n");
+    printf("    --linker:        Link with `default`, `lld`, `mold` or `gold`. Overrides the `linker` setting.\n");
+    printf("    --lto:           Link-time optimization of release builds: `off`, `full` or `thin`. Overrides the `lto`\n");
+    printf("                     setting. ThinLTO (clang only) caches its work in `%s` for faster relinks.\n", LTO_CACHE_DIR);
+    printf("    --pgo:           Build release with profile-guided optimization. A profile is recorded by running an\n");
+    printf("                     instrumented build with the arguments after `--` (or the `pgo_train` setting), and\n");
+    printf("                     recorded again once the sources drift too far from it. Profiles are kept in `%s`.\n", PGO_DIR);
+    printf("    --layout:        Build release with its hottest functions packed together. They are found by sampling\n");
+    printf("                     a training run like `--pgo` does. Needs lld, mold or gold outside macOS.\n");
+    printf("                     The function order is kept in `%s`.\n", LAYOUT_DIR);
     printf("    -h, --help:      Show this help message.\n");
 }
 
@@ -42,6 +95,182 @@ static bool cmd_build_release(ArgIter *args, void *cmd_data) {
     return true;
 }
 
+static bool cmd_build_profile(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    const char *profile = iter_next(args);
+    if (!profile) {
+        logprint(LOG_ERROR, "Expected a profile after `-p/--profile` flag.");
+        return false;
+    }
+
+    if (strlen(profile) >= PROFILE_NAME_MAX) {
+        logprint(LOG_ERROR, "Profile name '%s' is too long.", profile);
+        return false;
+    }
+
+    if (strcmp(profile, "debug") == 0) {
+        build_data->build_debug = true;
+    } else if (strcmp(profile, "release") == 0) {
+        build_data->build_release = true;
+    } else {
+        build_data->profile = profile;
+    }
+
+    return true;
+}
+
+static bool cmd_build_jobs(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    const char *jobs = iter_next(args);
+    if (!jobs) {
+        logprint(LOG_ERROR, "Expected a number after `-j/--jobs` flag.");
+        return false;
+    }
+
+    char *end;
+    long n = strtol(jobs, &end, 10);
+    if (*end != '\0' || n < 1) {
+        logprint(LOG_ERROR, "'%s' is not a valid number of jobs.", jobs);
+        return false;
+    }
+
+    build_data->jobs = (int)n;
+
+    return true;
+}
+
+static bool cmd_build_no_cache(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->no_cache = true;
+
+    return true;
+}
+
+static bool cmd_build_no_daemon(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->no_daemon = true;
+
+    return true;
+}
+
+static bool cmd_build_premake(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->use_premake = true;
+
+    return true;
+}
+
+static bool cmd_build_trace(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    build_data->trace_path = iter_next(args);
+    if (!build_data->trace_path) {
+        logprint(LOG_ERROR, "Expected a file after `--trace` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_build_stats(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->stats = true;
+
+    return true;
+}
+
+static bool cmd_build_time_trace(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->time_trace = true;
+
+    return true;
+}
+
+static bool cmd_build_unity(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    const char *value = iter_value(args);
+    if (!value) {
+        build_data->unity_files = UNITY_DEFAULT_FILES;
+        return true;
+    }
+
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    if (end != value && *end == '\0' && n > 0) {
+        build_data->unity_files = n;
+    } else if (!parse_size(value, &build_data->unity_size) || build_data->unity_size == 0) {
+        logprint(LOG_ERROR, "'%s' is not a valid unity batch size.", value);
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_build_linker(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    const char *linker = iter_next(args);
+    if (!linker) {
+        logprint(LOG_ERROR, "Expected a linker after `--linker` flag.");
+        return false;
+    }
+
+    if (!parse_linker(linker, &build_data->linker)) {
+        logprint(LOG_ERROR, "'%s' is not a valid linker. Expected default, lld, mold or gold.", linker);
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_build_lto(ArgIter *args, void *cmd_data) {
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+
+    const char *mode = iter_next(args);
+    if (!mode) {
+        logprint(LOG_ERROR, "Expected off, full or thin after `--lto` flag.");
+        return false;
+    }
+
+    if (!parse_lto(mode, &build_data->lto)) {
+        logprint(LOG_ERROR, "'%s' is not a valid LTO mode. Expected off, full or thin.", mode);
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_build_pgo(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->pgo = true;
+
+    return true;
+}
+
+static bool cmd_build_layout(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdBuildData *build_data = (CmdBuildData *)cmd_data;
+    build_data->layout = true;
+
+    return true;
+}
+
 static const CmdFlagInfo flags[] = {
     (CmdFlagInfo){
         .short_name = "h",
@@ -58,16 +287,279 @@ static const CmdFlagInfo flags[] = {
         .long_name = "release",
         .cmd = cmd_build_release
     },
+    (CmdFlagInfo){
+        .short_name = "p",
+        .long_name = "profile",
+        .cmd = cmd_build_profile
+    },
+    (CmdFlagInfo){
+        .short_name = "j",
+        .long_name = "jobs",
+        .cmd = cmd_build_jobs
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "no-cache",
+        .cmd = cmd_build_no_cache
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "no-daemon",
+        .cmd = cmd_build_no_daemon
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "premake",
+        .cmd = cmd_build_premake
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "trace",
+        .cmd = cmd_build_trace
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "stats",
+        .cmd = cmd_build_stats
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "time-trace",
+        .cmd = cmd_build_time_trace
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "unity",
+        .cmd = cmd_build_unity
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "linker",
+        .cmd = cmd_build_linker
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "lto",
+        .cmd = cmd_build_lto
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "pgo",
+        .cmd = cmd_build_pgo
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "layout",
+        .cmd = cmd_build_layout
+    },
 };
 
 static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
 
-static const char *build_cmd_fmt = 
-    "premake5 gmake2; "
-    "premake5 export-compile-commands; "
-    "cp compile_commands/debug.json compile_commands.json; "
-    "rm -r compile_commands; "
-    "make config=%s";
+#define PREMAKE_FINGERPRINT_PATH BUILDX_DIR"/premake.fingerprint"
+
+static const char *generate_cmd =
+    "premake5 gmake2 && "
+    "premake5 export-compile-commands && "
+    "cp compile_commands/debug.json compile_commands.json && "
+    "rm -r compile_commands";
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Hashes the names (not contents) of every file under `dir` in a stable
+// order. Adding, removing or renaming a file changes the hash.
+static bool hash_tree(uint64_t *h, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return false;
+    }
+
+    StrList names = {0};
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            strlist_push(&names, entry->d_name);
+        }
+    }
+    closedir(d);
+
+    if (names.length > 0) {
+        qsort(names.items, names.length, sizeof(*names.items), compare_names);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < names.length && ok; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, names.items[i]);
+        *h = hash_str(*h, path);
+
+        struct stat s;
+        if (stat(path, &s) == 0 && S_ISDIR(s.st_mode)) {
+            ok = hash_tree(h, path);
+        }
+    }
+
+    strlist_free(&names);
+    return ok;
+}
+
+// Fingerprints everything premake's output depends on. Returns false if the
+// fingerprint couldn't be computed, in which case generation must not be
+// skipped.
+static bool premake_fingerprint(char *out, size_t out_size) {
+    Conf conf;
+    if (!read_conf(CONF_DIR, &conf)) {
+        logprint(LOG_WARN, "Couldn't read conf.ini file at '%s'. Regenerating project files.", CONF_DIR);
+        return false;
+    }
+
+    uint64_t h = HASH_SEED;
+    if (!hash_file(&h, "premake5.lua") ||
+        !hash_file(&h, CONF_DIR) ||
+        !hash_tree(&h, conf.proj.src_dir))
+    {
+        return false;
+    }
+
+    snprintf(out, out_size, "%016" PRIx64 "\n", h);
+    return true;
+}
+
+static bool generate_premake_files(void) {
+    char fingerprint[32];
+    bool have_fingerprint = premake_fingerprint(fingerprint, sizeof(fingerprint));
+
+    if (have_fingerprint && access("Makefile", F_OK) == 0) {
+        char *old = read_file(PREMAKE_FINGERPRINT_PATH, NULL);
+        bool same = old && strcmp(old, fingerprint) == 0;
+        free(old);
+        if (same) {
+            return true;
+        }
+    }
+
+    unlink(PREMAKE_FINGERPRINT_PATH);
+
+    int status = system(generate_cmd);
+    if (status == -1) {
+        logprint(LOG_FATAL, "Failed to run build command '%s'.", generate_cmd);
+        return false;
+    }
+
+    if (status != 0) {
+        logprint(LOG_ERROR, "Failed to generate project files with premake5.");
+        return false;
+    }
+
+    if (have_fingerprint) {
+        write_file_if_changed(PREMAKE_FINGERPRINT_PATH, fingerprint, strlen(fingerprint));
+    }
+
+    return true;
+}
+
+static bool build_with_premake(CmdBuildData *cmd_data) {
+    int64_t start = monotonic_ns();
+    bool generated = generate_premake_files();
+    trace_add("Generate project files", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+    if (!generated) {
+        return false;
+    }
+
+    const char *configs[2];
+    int configs_len = 0;
+    if (cmd_data->build_debug) configs[configs_len++] = "debug";
+    if (cmd_data->build_release) configs[configs_len++] = "release";
+
+    // Configurations share the job budget and build side by side.
+    int jobs_per_config = cmd_data->jobs / configs_len;
+    if (jobs_per_config < 1) jobs_per_config = 1;
+
+    JobGraph graph = {0};
+    for (int i = 0; i < configs_len; i++) {
+        StrList argv = {0};
+        strlist_push(&argv, "make");
+        strlist_pushf(&argv, "-j%d", jobs_per_config);
+        strlist_pushf(&argv, "config=%s", configs[i]);
+        jobs_add(&graph, argv, NULL, 1);
+    }
+
+    bool ok = jobs_run(&graph, configs_len);
+    trace_jobs(&graph, "job");
+    jobs_free(&graph);
+
+    if (!ok) {
+        logprint(LOG_ERROR, "Failed to build with make.");
+    }
+    return ok;
+}
+
+static bool build_native(CmdBuildData *cmd_data) {
+    int64_t start = monotonic_ns();
+    Conf conf;
+    if (!read_conf(CONF_DIR, &conf)) {
+        logprint(LOG_FATAL, "Couldn't read conf.ini file at '%s'.", CONF_DIR);
+        return false;
+    }
+    trace_add("Read conf.ini", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+
+    if (!version_is_compatible(conf.buildx.major, conf.buildx.minor)) {
+        logprint(LOG_WARN, "Mismatched version %d.%d.%d. This version is %d.%d.%d.\n",
+            conf.buildx.major,
+            conf.buildx.minor,
+            conf.buildx.patch,
+            MAJOR_VERSION,
+            MINOR_VERSION,
+            PATCH_VERSION
+        );
+    }
+
+    if (cmd_data->lto) {
+        conf.proj.lto = cmd_data->lto;
+    }
+
+    BuildOptions opts = {
+        .max_jobs = cmd_data->jobs,
+        .use_cache = !cmd_data->no_cache,
+        .stats = cmd_data->stats,
+        .time_trace = cmd_data->time_trace,
+        .unity_files = cmd_data->unity_files,
+        .unity_size = cmd_data->unity_size,
+        .linker = cmd_data->linker,
+    };
+
+    if (cmd_data->pgo) {
+        return pgo_build(&conf.proj, &opts, &cmd_data->train_args);
+    }
+
+    if (cmd_data->layout) {
+        return layout_build(&conf.proj, &opts, &cmd_data->train_args);
+    }
+
+    const char *names[3];
+    size_t names_len = 0;
+    if (cmd_data->build_debug) names[names_len++] = "debug";
+    if (cmd_data->build_release) names[names_len++] = "release";
+    if (cmd_data->profile) names[names_len++] = cmd_data->profile;
+
+    BuildConfig configs[3];
+    size_t configs_len = 0;
+    bool ok = true;
+    for (size_t i = 0; i < names_len && ok; i++) {
+        ok = build_config_init(&configs[configs_len], &conf.proj, names[i]);
+        if (ok) configs_len++;
+    }
+
+    ok = ok && build_project(&conf.proj, configs, configs_len, &opts);
+
+    for (size_t i = 0; i < configs_len; i++) {
+        build_config_free(&configs[i]);
+    }
+
+    return ok;
+}
 
 bool cmd_build(ArgIter *args) {
     bool ok;
@@ -79,27 +571,98 @@ bool cmd_build(ArgIter *args) {
         return false;
     }
 
-    if (!cmd_data.build_debug && !cmd_data.build_release) {
-        cmd_data.build_debug = true;
+    if (iter_match(args, "--")) {
+        while (args->length > 0) {
+            strlist_push(&cmd_data.train_args, iter_next(args));
+        }
+    }
+
+    bool trains = cmd_data.pgo || cmd_data.layout;
+    if (cmd_data.train_args.length > 0 && !trains) {
+        logprint(LOG_ERROR, "Arguments after `--` are only used with `--pgo` and `--layout`.");
+        return false;
     }
 
-    char cmd[2048];
-    if (cmd_data.build_debug) {
-        snprintf(cmd, sizeof(cmd), build_cmd_fmt, "debug");
-        if (system(cmd) == -1) {
-            logprint(LOG_FATAL, "Failed to run build command '%s'.", cmd);
+    if (trains) {
+        const char *flag = cmd_data.pgo ? "--pgo" : "--layout";
+        if (cmd_data.pgo && cmd_data.layout) {
+            logprint(LOG_ERROR, "`--pgo` and `--layout` can't be used together.");
+            return false;
+        }
+        if (cmd_data.use_premake) {
+            logprint(LOG_ERROR, "`%s` only works for builds done by buildx, not `--premake`.", flag);
             return false;
         }
+        if (cmd_data.build_debug || cmd_data.profile) {
+            logprint(LOG_WARN, "`%s` only builds the release configuration.", flag);
+        }
+        cmd_data.build_debug = false;
+        cmd_data.build_release = true;
+        cmd_data.profile = NULL;
     }
 
-    if (cmd_data.build_release) {
-        snprintf(cmd, sizeof(cmd), build_cmd_fmt, "release");
-        if (system(cmd) == -1) {
-            logprint(LOG_FATAL, "Failed to run build command '%s'.", cmd);
-            return false;
+    // The premake file only has the two built-in configurations.
+    if (cmd_data.profile && cmd_data.use_premake) {
+        logprint(LOG_ERROR, "Profiles other than debug and release only work for builds done by buildx, not `--premake`.");
+        return false;
+    }
+
+    if (!cmd_data.build_debug && !cmd_data.build_release && !cmd_data.profile) {
+        cmd_data.build_debug = true;
+    }
+
+    if (cmd_data.jobs == 0) {
+        cmd_data.jobs = jobs_default_count();
+    }
+
+    // Training runs belong to this terminal, so they stay in process.
+    if (!cmd_data.no_daemon && !cmd_data.use_premake && !trains) {
+        DaemonBuild build = {
+            .debug = cmd_data.build_debug,
+            .release = cmd_data.build_release,
+            .use_cache = !cmd_data.no_cache,
+            .max_jobs = cmd_data.jobs,
+            .stats = cmd_data.stats,
+            .time_trace = cmd_data.time_trace,
+            .unity_files = cmd_data.unity_files,
+            .unity_size = cmd_data.unity_size,
+            .linker = cmd_data.linker,
+            .lto = cmd_data.lto,
+        };
+        if (cmd_data.profile) {
+            snprintf(build.profile, sizeof(build.profile), "%s", cmd_data.profile);
+        }
+        if (cmd_data.trace_path) {
+            snprintf(build.trace_path, sizeof(build.trace_path), "%s", cmd_data.trace_path);
+        }
+        if (daemon_build(&build, &ok)) {
+            return ok;
         }
     }
 
-    return true;
-}
+    if (cmd_data.trace_path) {
+        trace_start();
+    }
 
+    if (cmd_data.use_premake) {
+        if (cmd_data.stats || cmd_data.time_trace) {
+            logprint(LOG_WARN, "`--stats` and `--time-trace` only cover builds done by buildx, not `--premake`.");
+        }
+        if (cmd_data.lto) {
+            logprint(LOG_WARN, "`--lto` only applies to builds done by buildx, not `--premake`.");
+        }
+        if (cmd_data.linker) {
+            logprint(LOG_WARN, "`--linker` only applies to builds done by buildx, not `--premake`.");
+        }
+        ok = build_with_premake(&cmd_data);
+    } else {
+        ok = build_native(&cmd_data);
+    }
+
+    if (cmd_data.trace_path && trace_finish(cmd_data.trace_path)) {
+        logprint(LOG_INFO, "Wrote build trace to '%s'.", cmd_data.trace_path);
+    }
+
+    strlist_free(&cmd_data.train_args);
+    return ok;
+}
@@ -0,0 +1,243 @@
+#include "cmd.h"
+
+#include "argiter.h"
+#include "cache.h"
+#include "conf.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT "8722"
+
+typedef struct CmdCacheData {
+    uint64_t max_size;
+    const char *address;
+    const char *port;
+    const char *dir;
+} CmdCacheData;
+
+static void usage_cache(void) {
+    printf("Usage: \n");
+    printf("    bx cache stats [-h]\n");
+    printf("    bx cache trim [-h] [-s SIZE]\n");
+    printf("    bx cache clear [-h]\n");
+    printf("    bx cache serve [-h] [-a ADDRESS] [-p PORT] [-s SIZE] [--dir DIR]\n");
+    printf("Subcommands:\n");
+    printf("    stats:         Show size, entry count and hit rate of the object cache.\n");
+    printf("    trim:          Evict least recently used entries until the cache fits its size limit.\n");
+    printf("    clear:         Remove every entry from the cache.\n");
+    printf("    serve:         Serve a cache over HTTP for other machines to use as `cache_remote`.\n");
+    printf("Options:\n");
+    printf("    -s, --size:    Trim to SIZE (e.g. `500M`, `2G`) instead of the configured limit.\n");
+    printf("    -a, --address: Address to listen on (default: all interfaces).\n");
+    printf("    -p, --port:    Port to listen on (default: %s).\n", DEFAULT_PORT);
+    printf("    --dir:         Directory to serve (default: the local cache directory).\n");
+    printf("    -h, --help:    Show this help message.\n");
+}
+
+static bool cmd_cache_help(ArgIter *args, void *cmd_data) {
+    UNUSED(args, cmd_data);
+    usage_cache();
+    exit(0);
+    return true;
+}
+
+static bool cmd_cache_size(ArgIter *args, void *cmd_data) {
+    CmdCacheData *cache_data = (CmdCacheData *)cmd_data;
+
+    const char *size = iter_next(args);
+    if (!size) {
+        logprint(LOG_ERROR, "Expected a size after `-s/--size` flag.");
+        return false;
+    }
+
+    if (!parse_size(size, &cache_data->max_size)) {
+        logprint(LOG_ERROR, "'%s' is not a valid size.", size);
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_cache_address(ArgIter *args, void *cmd_data) {
+    CmdCacheData *cache_data = (CmdCacheData *)cmd_data;
+
+    cache_data->address = iter_next(args);
+    if (!cache_data->address) {
+        logprint(LOG_ERROR, "Expected an address after `-a/--address` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_cache_port(ArgIter *args, void *cmd_data) {
+    CmdCacheData *cache_data = (CmdCacheData *)cmd_data;
+
+    cache_data->port = iter_next(args);
+    if (!cache_data->port) {
+        logprint(LOG_ERROR, "Expected a port after `-p/--port` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_cache_dir(ArgIter *args, void *cmd_data) {
+    CmdCacheData *cache_data = (CmdCacheData *)cmd_data;
+
+    cache_data->dir = iter_next(args);
+    if (!cache_data->dir) {
+        logprint(LOG_ERROR, "Expected a directory after `--dir` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static const CmdFlagInfo flags[] = {
+    (CmdFlagInfo){
+        .short_name = "h",
+        .long_name = "help",
+        .cmd = cmd_cache_help
+    },
+    (CmdFlagInfo){
+        .short_name = "s",
+        .long_name = "size",
+        .cmd = cmd_cache_size
+    },
+    (CmdFlagInfo){
+        .short_name = "a",
+        .long_name = "address",
+        .cmd = cmd_cache_address
+    },
+    (CmdFlagInfo){
+        .short_name = "p",
+        .long_name = "port",
+        .cmd = cmd_cache_port
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "dir",
+        .cmd = cmd_cache_dir
+    },
+};
+
+static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
+
+// Settings of the project in the current directory, if there is one.
+static void current_cache_settings(CacheSettings *settings) {
+    Conf conf;
+    if (access(CONF_DIR, F_OK) == 0 && read_conf(CONF_DIR, &conf)) {
+        cache_settings(&conf.proj, settings);
+    } else {
+        cache_settings(NULL, settings);
+    }
+}
+
+static bool cmd_cache_stats(const char *dir) {
+    CacheSettings settings;
+    current_cache_settings(&settings);
+
+    CacheStats stats;
+    if (!cache_stats(dir, &stats)) {
+        logprint(LOG_ERROR, "Failed to read the cache at '%s'.", dir);
+        return false;
+    }
+
+    char size[32], max_size[32];
+    format_size(stats.size, size, sizeof(size));
+    format_size(settings.max_size, max_size, sizeof(max_size));
+
+    uint64_t lookups = stats.hits + stats.misses;
+
+    printf("Cache directory:    %s\n", dir);
+    printf("Entries:            %zu (%zu compressed)\n", stats.entries, stats.compressed_entries);
+    printf("Size:               %s / %s\n", size, max_size);
+    printf("Compression:        %s\n", settings.compress ? "on" : "off");
+    printf("Hits:               %llu\n", (unsigned long long)stats.hits);
+    printf("Misses:             %llu\n", (unsigned long long)stats.misses);
+    if (lookups > 0) {
+        printf("Hit rate:           %.1f%%\n", 100.0 * (double)stats.hits / (double)lookups);
+    }
+
+    return true;
+}
+
+static bool cmd_cache_trim(const char *dir, CmdCacheData *cmd_data) {
+    uint64_t max_size = cmd_data->max_size;
+    if (max_size == 0) {
+        CacheSettings settings;
+        current_cache_settings(&settings);
+        max_size = settings.max_size;
+    }
+
+    if (!cache_trim(dir, max_size)) {
+        logprint(LOG_ERROR, "Failed to trim the cache at '%s'.", dir);
+        return false;
+    }
+
+    return cmd_cache_stats(dir);
+}
+
+static bool cmd_cache_clear(const char *dir) {
+    if (!cache_clear(dir)) {
+        logprint(LOG_ERROR, "Failed to clear the cache at '%s'.", dir);
+        return false;
+    }
+
+    logprint(LOG_INFO, "Cleared the cache at '%s'.", dir);
+    return true;
+}
+
+static bool cmd_cache_serve(const char *dir, CmdCacheData *cmd_data) {
+    uint64_t max_size = cmd_data->max_size;
+    if (max_size == 0) {
+        CacheSettings settings;
+        cache_settings(NULL, &settings);
+        max_size = settings.max_size;
+    }
+
+    const char *port = cmd_data->port ? cmd_data->port : DEFAULT_PORT;
+    return cache_serve(dir, cmd_data->address, port, max_size);
+}
+
+bool cmd_cache(ArgIter *args) {
+    CmdCacheData cmd_data = {0};
+
+    const char *subcommand = iter_next(args);
+
+    if (!process_options(args, &cmd_data, flags, flags_length)) {
+        usage_cache();
+        return false;
+    }
+
+    char dir[PATH_MAX];
+    if (cmd_data.dir) {
+        snprintf(dir, sizeof(dir), "%s", cmd_data.dir);
+    } else if (!cache_dir(dir, sizeof(dir))) {
+        logprint(LOG_FATAL, "Couldn't determine cache directory. Set BUILDX_CACHE_DIR or HOME.");
+        return false;
+    }
+
+    if (!subcommand || strcmp(subcommand, "stats") == 0) {
+        return cmd_cache_stats(dir);
+    } else if (strcmp(subcommand, "trim") == 0) {
+        return cmd_cache_trim(dir, &cmd_data);
+    } else if (strcmp(subcommand, "clear") == 0) {
+        return cmd_cache_clear(dir);
+    } else if (strcmp(subcommand, "serve") == 0) {
+        return cmd_cache_serve(dir, &cmd_data);
+    } else if (strcmp(subcommand, "-h") == 0 || strcmp(subcommand, "--help") == 0) {
+        usage_cache();
+        return true;
+    }
+
+    logprint(LOG_ERROR, "'%s' is not a valid cache subcommand.", subcommand);
+    usage_cache();
+    return false;
+}
@@ -22,6 +22,10 @@ bool cmd_build(ArgIter *args);
 bool cmd_run(ArgIter *args);
 bool cmd_install(ArgIter *args);
 bool cmd_project(ArgIter *args);
+bool cmd_cache(ArgIter *args);
+bool cmd_daemon(ArgIter *args);
+bool cmd_watch(ArgIter *args);
+bool cmd_bench(ArgIter *args);
 
 #endif
 
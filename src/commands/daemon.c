@@ -0,0 +1,94 @@
+#include "cmd.h"
+
+#include "argiter.h"
+#include "daemon.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CmdDaemonData {
+    bool foreground;
+} CmdDaemonData;
+
+static void usage_daemon(void) {
+    printf("Usage: \n");
+    printf("    bx daemon [start] [-h] [-f]\n");
+    printf("    bx daemon stop [-h]\n");
+    printf("    bx daemon status [-h]\n");
+    printf("Subcommands:\n");
+    printf("    start:            Start a daemon for the project in the current directory.\n");
+    printf("                      `bx build` hands builds to it, skipping the scan of the source tree\n");
+    printf("                      and header dependencies that haven't changed.\n");
+    printf("    stop:             Stop the project's daemon.\n");
+    printf("    status:           Show whether the project has a daemon running.\n");
+    printf("Options:\n");
+    printf("    -f, --foreground: Don't detach from the terminal.\n");
+    printf("    -h, --help:       Show this help message.\n");
+}
+
+static bool cmd_daemon_help(ArgIter *args, void *cmd_data) {
+    UNUSED(args, cmd_data);
+    usage_daemon();
+    exit(0);
+    return true;
+}
+
+static bool cmd_daemon_foreground(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdDaemonData *daemon_data = (CmdDaemonData *)cmd_data;
+    daemon_data->foreground = true;
+
+    return true;
+}
+
+static const CmdFlagInfo flags[] = {
+    (CmdFlagInfo){
+        .short_name = "h",
+        .long_name = "help",
+        .cmd = cmd_daemon_help
+    },
+    (CmdFlagInfo){
+        .short_name = "f",
+        .long_name = "foreground",
+        .cmd = cmd_daemon_foreground
+    },
+};
+
+static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
+
+bool cmd_daemon(ArgIter *args) {
+    CmdDaemonData cmd_data = {0};
+
+    const char *subcommand = iter_peek(args);
+    if (subcommand && subcommand[0] != '-') {
+        iter_next(args);
+    } else {
+        subcommand = "start";
+    }
+
+    if (!process_options(args, &cmd_data, flags, flags_length)) {
+        usage_daemon();
+        return false;
+    }
+
+    if (strcmp(subcommand, "start") == 0) {
+        return daemon_serve(cmd_data.foreground);
+    } else if (strcmp(subcommand, "stop") == 0) {
+        if (!daemon_stop()) {
+            logprint(LOG_INFO, "No daemon is running.");
+            return true;
+        }
+        logprint(LOG_INFO, "Stopped daemon.");
+        return true;
+    } else if (strcmp(subcommand, "status") == 0) {
+        printf("%s\n", daemon_running() ? "running" : "stopped");
+        return true;
+    }
+
+    logprint(LOG_ERROR, "'%s' is not a valid daemon subcommand.", subcommand);
+    usage_daemon();
+    return false;
+}
@@ -31,7 +31,7 @@ static void usage_new(void) {
     printf("    -o, --output_dir: Set the output directory. Default is `bin`.\n");
     printf("    -s, --src_dir:    Set the source directory. Default is `src`.\n");
     printf("    -d, --dialect:    Set the language standard. Default is `c99`.\n");
-    printf("        Variants: {c99,c11,c17,c++11,c++14,c++17}\n");
+    printf("        Variants: {c99,c11,c17,c23,c++11,c++14,c++17,c++20,c++23}\n");
     printf("    --cpp:            Make a C++ project. Alias for `-d c++17`.\n");
     printf("    -n, --name:       Override name of executable. If not set, will be the same as `project_name`.\n");
 }
@@ -431,6 +431,9 @@ bool make_premake_file(CmdNewData *cmd_data) {
     fprintf(f, "        symbols 'On'\n");
     fprintf(f, "        optimize 'Debug'\n");
     fprintf(f, "\n");
+    fprintf(f, "    filter { 'configurations:debug', 'system:not macosx' }\n");
+    fprintf(f, "        buildoptions { '-gsplit-dwarf' }\n");
+    fprintf(f, "\n");
     fprintf(f, "    filter 'configurations:release'\n");
     fprintf(f, "        defines { 'NDEBUG' }\n");
     fprintf(f, "        targetdir '%s/release'\n", out_dir);
@@ -263,8 +263,20 @@ static bool cmd_project_upgrade(void) {
     return write_conf(CONF_DIR, conf.proj);
 }
 
+// Returns true if `line` sets `setting`: the name, optional blanks, then `=`.
+static bool is_setting_line(twString line, twString setting) {
+    if (!twStartsWith(line, setting)) {
+        return false;
+    }
+
+    twString rest = twDrop(line, setting.length);
+    while (rest.length > 0 && (rest.bytes[0] == ' ' || rest.bytes[0] == '\t')) {
+        rest = twDrop(rest, 1);
+    }
+    return twFirstUTF8(rest) == '=';
+}
+
 // TODO: 
-// - [ ] Check that setting is allowed to be changed.
 // - [ ] Change settings in premake5.lua where appropriate.
 static bool cmd_project_change(ArgIter *args, CmdProjectData *cmd_data, twString setting, twString value) {
     UNUSED(args, cmd_data);
@@ -275,6 +287,14 @@ static bool cmd_project_change(ArgIter *args, CmdProjectData *cmd_data, twString
     char bufmem[PATH_MAX*2];
     twStringBuf buf = twStaticBuf(bufmem);
 
+    char *name = twDupToC(setting);
+    bool known = is_project_setting(name);
+    free(name);
+    if (!known) {
+        logprint(LOG_ERROR, "Unknown setting '"twFmt"'.", twArg(setting));
+        RETURN(false);
+    }
+
     // Read in conf file and change the desired line
     {
         f = fopen(CONF_DIR, "r");
@@ -287,9 +307,30 @@ static bool cmd_project_change(ArgIter *args, CmdProjectData *cmd_data, twString
         size_t linecap = 0;
         ssize_t len = 0;
 
+        // Optional settings may not be in the file yet. They get added to
+        // the end of the [project] section.
+        bool found = false;
+        bool in_project = false;
+
         while ((len = getline(&line_c_str, &linecap, f)) > 0) {
             twString line = (twString){.bytes = line_c_str, .length = len - 1}; // -1 for newline
-            if (twStartsWith(line, setting)) {
+
+            if (in_project && !found && line.length == 0) {
+                if (!twAppendFmtUTF8(&buf, twFmt" = "twFmt"\n", twArg(setting), twArg(value))) {
+                    logprint(LOG_FATAL, "Failed to append line to string buffer: '"twFmt" = "twFmt"'.", twArg(setting), twArg(value));
+                    RETURN(false);
+                }
+                found = true;
+            }
+
+            if (line.length == 0) {
+                in_project = false;
+            } else if (twEqual(line, twStatic("[project]"))) {
+                in_project = true;
+            }
+
+            if (in_project && is_setting_line(line, setting)) {
+                found = true;
                 if (!twAppendFmtUTF8(&buf, twFmt" = "twFmt"\n", twArg(setting), twArg(value))) {
                     logprint(LOG_FATAL, "Failed to append line to string buffer: '"twFmt" = "twFmt"'.", twArg(setting), twArg(value));
                     RETURN(false);
@@ -302,6 +343,13 @@ static bool cmd_project_change(ArgIter *args, CmdProjectData *cmd_data, twString
             }
         }
 
+        if (!found && in_project) {
+            if (!twAppendFmtUTF8(&buf, twFmt" = "twFmt"\n", twArg(setting), twArg(value))) {
+                logprint(LOG_FATAL, "Failed to append line to string buffer: '"twFmt" = "twFmt"'.", twArg(setting), twArg(value));
+                RETURN(false);
+            }
+        }
+
         twPushASCII(&buf, '\0'); // guarantee null terminator
 
         fclose(f);
@@ -309,9 +357,9 @@ static bool cmd_project_change(ArgIter *args, CmdProjectData *cmd_data, twString
 
     // Write changed file to disk
     {
-        f = fopen(conf_path, "w");
+        f = fopen(CONF_DIR, "w");
         if (!f) {
-            logprint(LOG_FATAL, "Failed to open conf.ini file at '%s'.", conf_path);
+            logprint(LOG_FATAL, "Failed to open conf.ini file at '%s'.", CONF_DIR);
             RETURN(false);
         }
 
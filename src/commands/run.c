@@ -1,26 +1,43 @@
 #include "argiter.h"
 #include "cmd.h"
 #include "conf.h"
+#include "counters.h"
+#include "heap.h"
+#include "locks.h"
+#include "proc.h"
+#include "sampler.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/syslimits.h>
 #include <unistd.h>
 
-typedef enum RunMode {
-    RM_DEBUG,
-    RM_RELEASE
-} RunMode;
-
 typedef struct CmdRunData {
-    RunMode mode;
+    const char *profile;    // Defaults to debug.
+    bool counters;
+    StrList counter_names;
+    int sample_hz;          // Zero unless sampling.
+    bool heap;
+    bool locks;
 } CmdRunData;
 
 static void usage_run(void) {
-    printf("Usage: bx run [-h] [-d|-r]\n");
+    printf("Usage: bx run [-h] [-d|-r|-p NAME] [--counters[=LIST]|--sample[=HZ]|--heap|--locks] [-- ARGS...]\n");
     printf("Options:\n");
     printf("    -d, --debug:     Run debug executable.\n");
     printf("    -r, --release:   Run release executable.\n");
+    printf("    -p, --profile:   Run the executable of a profile.\n");
+    printf("    --counters:      Count hardware events while it runs and print IPC and\n");
+    printf("                     miss rates. LIST is comma separated perf event names\n");
+    printf("                     (default: %s).\n", COUNTERS_DEFAULT);
+    printf("    --sample:        Sample call stacks HZ times a second of CPU time (default: %d)\n", SAMPLER_DEFAULT_HZ);
+    printf("                     and write them with a flame graph to %s. Build with\n", SAMPLER_DIR);
+    printf("                     `-p profile` for complete stacks from release code.\n");
+    printf("    --heap:          Count allocations, bytes and the peak heap, and report\n");
+    printf("                     allocation sizes and the call sites that allocate most.\n");
+    printf("    --locks:         Measure how long threads wait for and hold each pthread\n");
+    printf("                     lock, and report the most contended locks and call sites.\n");
     printf("    -h, --help:      Show this help message.\n");
 }
 
@@ -35,7 +52,7 @@ static bool cmd_run_debug(ArgIter *args, void *cmd_data) {
     UNUSED(args);
 
     CmdRunData *build_data = (CmdRunData *)cmd_data;
-    build_data->mode = RM_DEBUG;
+    build_data->profile = "debug";
 
     return true;
 }
@@ -44,7 +61,64 @@ static bool cmd_run_release(ArgIter *args, void *cmd_data) {
     UNUSED(args);
 
     CmdRunData *build_data = (CmdRunData *)cmd_data;
-    build_data->mode = RM_RELEASE;
+    build_data->profile = "release";
+
+    return true;
+}
+
+static bool cmd_run_profile(ArgIter *args, void *cmd_data) {
+    CmdRunData *run_data = (CmdRunData *)cmd_data;
+
+    run_data->profile = iter_next(args);
+    if (!run_data->profile) {
+        logprint(LOG_ERROR, "Expected a profile after `-p/--profile` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_run_counters(ArgIter *args, void *cmd_data) {
+    CmdRunData *run_data = (CmdRunData *)cmd_data;
+
+    const char *value = iter_value(args);
+    run_data->counters = true;
+    return counters_parse(value ? value : COUNTERS_DEFAULT, &run_data->counter_names);
+}
+
+static bool cmd_run_sample(ArgIter *args, void *cmd_data) {
+    CmdRunData *run_data = (CmdRunData *)cmd_data;
+
+    const char *value = iter_value(args);
+    if (!value) {
+        run_data->sample_hz = SAMPLER_DEFAULT_HZ;
+        return true;
+    }
+
+    char *end;
+    long hz = strtol(value, &end, 10);
+    if (*end != '\0' || hz < 1 || hz > 10000) {
+        logprint(LOG_ERROR, "Expected a sample rate between 1 and 10000 after `--sample=`.");
+        return false;
+    }
+    run_data->sample_hz = (int)hz;
+    return true;
+}
+
+static bool cmd_run_heap(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdRunData *run_data = (CmdRunData *)cmd_data;
+    run_data->heap = true;
+
+    return true;
+}
+
+static bool cmd_run_locks(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdRunData *run_data = (CmdRunData *)cmd_data;
+    run_data->locks = true;
 
     return true;
 }
@@ -65,6 +139,31 @@ static const CmdFlagInfo flags[] = {
         .long_name = "release",
         .cmd = cmd_run_release
     },
+    (CmdFlagInfo){
+        .short_name = "p",
+        .long_name = "profile",
+        .cmd = cmd_run_profile
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "counters",
+        .cmd = cmd_run_counters
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "sample",
+        .cmd = cmd_run_sample
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "heap",
+        .cmd = cmd_run_heap
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "locks",
+        .cmd = cmd_run_locks
+    },
 };
 
 static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
@@ -93,45 +192,56 @@ bool cmd_run(ArgIter *args) {
 
     ok = process_options(args, &cmd_data, flags, flags_length);
     if (!ok) {
+        strlist_free(&cmd_data.counter_names);
         return false;
     }
 
-    char cmd_buf[2048];
-    twStringBuf cmdbuf = twStaticBuf(cmd_buf);
+    if (cmd_data.counters + (cmd_data.sample_hz > 0) + cmd_data.heap + cmd_data.locks > 1) {
+        logprint(LOG_ERROR, "Only one of `--counters`, `--sample`, `--heap` and `--locks` can be used at a time.");
+        strlist_free(&cmd_data.counter_names);
+        return false;
+    }
 
-    const char *mode_str = cmd_data.mode == RM_RELEASE ? "release" : "debug";
+    const char *mode_str = cmd_data.profile ? cmd_data.profile : "debug";
 
     char exe_path[PATH_MAX];
     snprintf(exe_path, sizeof(exe_path), "%s/%s/%s", conf.proj.out_dir, mode_str, conf.proj.exe_name);
 
     if (access(exe_path, F_OK) != 0) {
-        logprint(LOG_ERROR, "No executable. Use `bs build --%s` first.", mode_str);
-        return false;
-    }
-
-    if (!twAppendASCII(&cmdbuf, twStr(exe_path))) {
-        logprint(LOG_FATAL, "Failed to append executable path to command.");
+        logprint(LOG_ERROR, "No executable. Use `bx build -p %s` first.", mode_str);
+        strlist_free(&cmd_data.counter_names);
         return false;
     }
 
+    // Run directly rather than through a shell so the arguments arrive as
+    // given and counters attach to the program itself.
+    StrList argv = {0};
+    strlist_push(&argv, exe_path);
     if (iter_match(args, "--")) {
         while (args->length > 0) {
-            const char *arg = iter_next(args);
-            if (!twAppendFmtUTF8(&cmdbuf, " %s", arg)) {
-                logprint(LOG_FATAL, "Failed to append argument to command.");
-                return false;
-            }
+            strlist_push(&argv, iter_next(args));
         }
     }
 
-    twPushASCII(&cmdbuf, '\0');
-
-    const char *cmd = twToC(cmdbuf);
-    if (system(cmd) == -1) {
-        logprint(LOG_FATAL, "Failed to run executable '%s'.", exe_path);
-        return false;
+    int exit_code;
+    if (cmd_data.counters) {
+        ok = counters_run(argv.items, &cmd_data.counter_names, &exit_code);
+    } else if (cmd_data.sample_hz) {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s-%s", conf.proj.exe_name, mode_str);
+        ok = sampler_run(argv.items, cmd_data.sample_hz, name, &exit_code);
+    } else if (cmd_data.heap) {
+        ok = heap_run(argv.items, &exit_code);
+    } else if (cmd_data.locks) {
+        ok = locks_run(argv.items, &exit_code);
+    } else {
+        ok = proc_run(argv.items, &exit_code);
+        if (!ok) {
+            logprint(LOG_FATAL, "Failed to run executable '%s'.", exe_path);
+        }
     }
 
-    return true;
+    strlist_free(&argv);
+    strlist_free(&cmd_data.counter_names);
+    return ok;
 }
-
@@ -0,0 +1,297 @@
+#include "cmd.h"
+
+#include "argiter.h"
+#include "builder.h"
+#include "conf.h"
+#include "jobs.h"
+#include "utils.h"
+#include "watch.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long the source tree has to be quiet before a burst of saves is built.
+#define SETTLE_MS (150)
+
+// How long a restarted executable gets to exit after SIGTERM.
+#define STOP_TIMEOUT_MS (2000)
+
+typedef struct CmdWatchData {
+    const char *profile;    // Defaults to debug.
+    bool run;
+    bool no_cache;
+    int jobs;
+} CmdWatchData;
+
+static void usage_watch(void) {
+    printf("Usage: bx watch [-h] [-d|-r|-p NAME] [-j N] [--no-cache] [--run] [-- args...]\n");
+    printf("Builds the project, then rebuilds whenever a file in the source directory changes.\n");
+    printf("Options:\n");
+    printf("    -d, --debug:     Build debug executable.\n");
+    printf("    -r, --release:   Build release executable.\n");
+    printf("    -p, --profile:   Build the executable of a profile.\n");
+    printf("    -j, --jobs:      Number of compile jobs to run at once. Default is the number of cores.\n");
+    printf("    --no-cache:      Don't use the shared object cache.\n");
+    printf("    --run:           Run the executable after each successful build, restarting it\n");
+    printf("                     whenever it is relinked. Arguments after `--` are passed to it.\n");
+    printf("    -h, --help:      Show this help message.\n");
+}
+
+static bool cmd_watch_help(ArgIter *args, void *cmd_data) {
+    UNUSED(args, cmd_data);
+    usage_watch();
+    exit(0);
+    return true;
+}
+
+static bool cmd_watch_debug(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+    watch_data->profile = "debug";
+
+    return true;
+}
+
+static bool cmd_watch_release(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+    watch_data->profile = "release";
+
+    return true;
+}
+
+static bool cmd_watch_profile(ArgIter *args, void *cmd_data) {
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+
+    watch_data->profile = iter_next(args);
+    if (!watch_data->profile) {
+        logprint(LOG_ERROR, "Expected a profile after `-p/--profile` flag.");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cmd_watch_jobs(ArgIter *args, void *cmd_data) {
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+
+    const char *jobs = iter_next(args);
+    if (!jobs) {
+        logprint(LOG_ERROR, "Expected a number after `-j/--jobs` flag.");
+        return false;
+    }
+
+    char *end;
+    long n = strtol(jobs, &end, 10);
+    if (*end != '\0' || n < 1) {
+        logprint(LOG_ERROR, "'%s' is not a valid number of jobs.", jobs);
+        return false;
+    }
+
+    watch_data->jobs = (int)n;
+
+    return true;
+}
+
+static bool cmd_watch_no_cache(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+    watch_data->no_cache = true;
+
+    return true;
+}
+
+static bool cmd_watch_run(ArgIter *args, void *cmd_data) {
+    UNUSED(args);
+
+    CmdWatchData *watch_data = (CmdWatchData *)cmd_data;
+    watch_data->run = true;
+
+    return true;
+}
+
+static const CmdFlagInfo flags[] = {
+    (CmdFlagInfo){
+        .short_name = "h",
+        .long_name = "help",
+        .cmd = cmd_watch_help
+    },
+    (CmdFlagInfo){
+        .short_name = "d",
+        .long_name = "debug",
+        .cmd = cmd_watch_debug
+    },
+    (CmdFlagInfo){
+        .short_name = "r",
+        .long_name = "release",
+        .cmd = cmd_watch_release
+    },
+    (CmdFlagInfo){
+        .short_name = "p",
+        .long_name = "profile",
+        .cmd = cmd_watch_profile
+    },
+    (CmdFlagInfo){
+        .short_name = "j",
+        .long_name = "jobs",
+        .cmd = cmd_watch_jobs
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "no-cache",
+        .cmd = cmd_watch_no_cache
+    },
+    (CmdFlagInfo){
+        .short_name = "",
+        .long_name = "run",
+        .cmd = cmd_watch_run
+    },
+};
+
+static const size_t flags_length = sizeof(flags) / sizeof(flags[0]);
+
+static pid_t start_exe(char *const *argv) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to fork: %s.", err);
+        return -1;
+    }
+
+    if (pid == 0) {
+        execv(argv[0], argv);
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to run '%s': %s.", argv[0], err);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// Returns true once `pid` has exited. A `pid` that was already reaped counts
+// as exited, so it is never signalled after it could have been reused.
+static bool exe_exited(pid_t pid) {
+    int status;
+    pid_t waited = waitpid(pid, &status, WNOHANG);
+    return waited == pid || (waited == -1 && errno == ECHILD);
+}
+
+static void stop_exe(pid_t pid) {
+    if (pid <= 0 || exe_exited(pid)) {
+        return;
+    }
+
+    kill(pid, SIGTERM);
+
+    struct timespec tick = { .tv_nsec = 10 * 1000000 };
+    for (int waited_ms = 0; waited_ms < STOP_TIMEOUT_MS; waited_ms += 10) {
+        if (exe_exited(pid)) {
+            return;
+        }
+        nanosleep(&tick, NULL);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+bool cmd_watch(ArgIter *args) {
+    bool result = true;
+    CmdWatchData cmd_data = {0};
+    BuildConfig config = {0};
+    BuildState *state = NULL;
+    Watcher *watcher = NULL;
+    StrList exe_argv = {0};
+    pid_t exe = -1;
+
+    if (!process_options(args, &cmd_data, flags, flags_length)) {
+        usage_watch();
+        return false;
+    }
+
+    if (cmd_data.jobs == 0) {
+        cmd_data.jobs = jobs_default_count();
+    }
+
+    Conf conf;
+    if (!read_conf(CONF_DIR, &conf)) {
+        logprint(LOG_FATAL, "Couldn't read conf.ini file at '%s'.", CONF_DIR);
+        return false;
+    }
+
+    const char *mode_str = cmd_data.profile ? cmd_data.profile : "debug";
+    if (!build_config_init(&config, &conf.proj, mode_str)) {
+        return false;
+    }
+
+    char exe_path[PATH_MAX];
+    snprintf(exe_path, sizeof(exe_path), "%s/%s/%s", conf.proj.out_dir, mode_str, conf.proj.exe_name);
+
+    strlist_push(&exe_argv, exe_path);
+    if (iter_match(args, "--")) {
+        while (args->length > 0) {
+            strlist_push(&exe_argv, iter_next(args));
+        }
+    }
+
+    watcher = watcher_new(conf.proj.src_dir);
+    if (!watcher) {
+        RETURN(false);
+    }
+
+    // The state stays warm between builds, so only what changed is looked at
+    // again.
+    state = build_state_new();
+    BuildOptions opts = {
+        .max_jobs = cmd_data.jobs,
+        .use_cache = !cmd_data.no_cache,
+        .state = state,
+    };
+
+    for (;;) {
+        int64_t old_mtime = 0;
+        file_mtime(exe_path, &old_mtime);
+
+        bool ok = build_project(&conf.proj, &config, 1, &opts);
+
+        if (ok && cmd_data.run) {
+            int64_t new_mtime = 0;
+            file_mtime(exe_path, &new_mtime);
+
+            if (exe != -1 && exe_exited(exe)) {
+                exe = -1;
+            }
+            if (new_mtime != old_mtime || exe == -1) {
+                stop_exe(exe);
+                exe = start_exe(exe_argv.items);
+            }
+        }
+
+        printf("Watching '%s' for changes. Press Ctrl-C to stop.\n", conf.proj.src_dir);
+        fflush(stdout);
+
+        if (!watcher_wait(watcher, SETTLE_MS)) {
+            RETURN(false);
+        }
+    }
+
+CLEAN_UP_AND_RETURN:
+    stop_exe(exe);
+    watcher_free(watcher);
+    build_state_free(state);
+    strlist_free(&exe_argv);
+    build_config_free(&config);
+    return result;
+}
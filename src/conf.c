@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/syslimits.h>
 
@@ -42,13 +43,14 @@ typedef enum {
     SEC_OPEN,
     SEC_BULIDX,
     SEC_PROJECT,
+    SEC_PROFILE,
 } Section;
 
 #define SCAN_FIELD(_field_) do {                                      \
     int nscanned = sscanf(line, _field_ " = %s\n", field);            \
     if (nscanned != 1) {                                              \
         logprint(LOG_ERROR, "Unable to parse " _field_ ". %s", line); \
-        return false;                                                 \
+        RETURN(false);                                                \
     }                                                                 \
 } while (0)
 
@@ -57,6 +59,106 @@ typedef enum {
     conf->proj._dst_ = strdup(field);                                 \
 } while (0)
 
+static bool split_field(const char *line, const char *separators, StrList *out) {
+    const char *value = strchr(line, '=');
+    if (!value) {
+        return false;
+    }
+
+    char *values = strdup(value + 1);
+    for (char *item = strtok(values, separators); item; item = strtok(NULL, separators)) {
+        strlist_push(out, item);
+    }
+    free(values);
+    return true;
+}
+
+// Splits a comma or space separated list of values out of `line`.
+static bool parse_list_field(const char *line, StrList *out) {
+    return split_field(line, ", \t\n", out);
+}
+
+// Splits space separated compiler flags out of `line`. Commas are part of
+// flags like `-Wl,--as-needed`.
+static bool parse_flags_field(const char *line, StrList *out) {
+    return split_field(line, " \t\n", out);
+}
+
+// Starts a profile for a `[profile NAME]` line. Its name ends up in paths,
+// so it is kept to letters, digits, '-' and '_'.
+static bool begin_profile(const char *line, ProjConf *proj) {
+    char name[PROFILE_NAME_MAX];
+    char rest[2];
+    if (sscanf(line, "[profile %63[A-Za-z0-9_-]%1[]]", name, rest) != 2) {
+        logprint(LOG_ERROR, "Invalid profile section %s", line);
+        return false;
+    }
+
+    if (strcmp(name, "debug") == 0 || strcmp(name, "release") == 0) {
+        logprint(LOG_ERROR, "The %s profile is built in. Define a new one that inherits from it instead.", name);
+        return false;
+    }
+
+    if (find_profile(proj, name)) {
+        logprint(LOG_ERROR, "Profile '%s' is defined twice.", name);
+        return false;
+    }
+
+    proj->profiles = realloc(proj->profiles, (proj->profiles_len + 1) * sizeof(*proj->profiles));
+    proj->profiles[proj->profiles_len++] = (Profile){ .name = strdup(name) };
+    return true;
+}
+
+const Profile *find_profile(const ProjConf *proj, const char *name) {
+    for (size_t i = 0; i < proj->profiles_len; i++) {
+        if (strcmp(proj->profiles[i].name, name) == 0) {
+            return &proj->profiles[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the whole value of `line`, spaces included.
+static char *parse_line_field(const char *line) {
+    const char *value = strchr(line, '=');
+    if (!value) {
+        return NULL;
+    }
+
+    value++;
+    while (*value == ' ' || *value == '\t') value++;
+
+    size_t len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) len--;
+    return strndup(value, len);
+}
+
+static const char *project_settings[] = {
+    "project_directory",
+    "executable",
+    "output_directory",
+    "source_directory",
+    "dialect",
+    "cache_max_size",
+    "cache_compression",
+    "cache_remote",
+    "cache_remote_upload",
+    "linker",
+    "lto",
+    "pgo_train",
+    "pch",
+    "unity_exclude",
+};
+
+bool is_project_setting(const char *name) {
+    for (size_t i = 0; i < sizeof(project_settings) / sizeof(project_settings[0]); i++) {
+        if (strcmp(project_settings[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static Conf unset_conf = {
     .buildx.major = -1,
     .buildx.minor = -1,
@@ -114,6 +216,12 @@ bool read_conf(const char *path, Conf *conf) {
                     current_section = SEC_BULIDX;
                 } else if (strcmp(line, "[project]\n") == 0) {
                     current_section = SEC_PROJECT;
+                } else if (starts_with(line, "[profile ")) {
+                    if (begin_profile(line, &conf->proj)) {
+                        current_section = SEC_PROFILE;
+                    } else {
+                        result = false;
+                    }
                 } else {
                     logprint(LOG_ERROR, "Unexpected line in conf.ini file: %s\n", line);
                     result = false;
@@ -146,11 +254,67 @@ bool read_conf(const char *path, Conf *conf) {
                 } else if (starts_with(line, "dialect")) {
                     SCAN_FIELD("dialect");
                     conf->proj.dialect = dialect_from_str(field);
+                } else if (starts_with(line, "cache_max_size")) {
+                    SCAN_FIELD("cache_max_size");
+                    if (!parse_size(field, &conf->proj.cache_max_size)) {
+                        logprint(LOG_ERROR, "Invalid cache_max_size '%s'.", field);
+                        result = false;
+                    }
+                } else if (starts_with(line, "cache_compression")) {
+                    SCAN_FIELD("cache_compression");
+                    if (!parse_toggle(field, &conf->proj.cache_compression)) {
+                        logprint(LOG_ERROR, "Invalid cache_compression '%s'. Expected on or off.", field);
+                        result = false;
+                    }
+                } else if (starts_with(line, "cache_remote_upload")) {
+                    SCAN_FIELD("cache_remote_upload");
+                    if (!parse_toggle(field, &conf->proj.cache_remote_upload)) {
+                        logprint(LOG_ERROR, "Invalid cache_remote_upload '%s'. Expected on or off.", field);
+                        result = false;
+                    }
+                } else if (starts_with(line, "cache_remote")) {
+                    PARSE_PATH_FIELD("cache_remote", cache_remote);
+                } else if (starts_with(line, "linker")) {
+                    SCAN_FIELD("linker");
+                    if (!parse_linker(field, &conf->proj.linker)) {
+                        logprint(LOG_ERROR, "Invalid linker '%s'. Expected default, lld, mold or gold.", field);
+                        result = false;
+                    }
+                } else if (starts_with(line, "lto")) {
+                    SCAN_FIELD("lto");
+                    if (!parse_lto(field, &conf->proj.lto)) {
+                        logprint(LOG_ERROR, "Invalid lto '%s'. Expected off, full or thin.", field);
+                        result = false;
+                    }
+                } else if (starts_with(line, "pgo_train")) {
+                    conf->proj.pgo_train = parse_line_field(line);
+                } else if (starts_with(line, "pch")) {
+                    PARSE_PATH_FIELD("pch", pch);
+                } else if (starts_with(line, "unity_exclude")) {
+                    if (!parse_list_field(line, &conf->proj.unity_exclude)) {
+                        logprint(LOG_ERROR, "Unable to parse unity_exclude. %s", line);
+                        result = false;
+                    }
                 } else {
                     logprint(LOG_ERROR, "Unexpected line in [project] section of conf.ini file: %s\n", line);
                     result = false;
                 }
             } break;
+            case SEC_PROFILE: {
+                Profile *profile = &conf->proj.profiles[conf->proj.profiles_len - 1];
+                char field[PATH_MAX];
+                if (starts_with(line, "inherits")) {
+                    SCAN_FIELD("inherits");
+                    profile->inherits = strdup(field);
+                } else if (starts_with(line, "cflags")) {
+                    parse_flags_field(line, &profile->cflags);
+                } else if (starts_with(line, "ldflags")) {
+                    parse_flags_field(line, &profile->ldflags);
+                } else {
+                    logprint(LOG_ERROR, "Unexpected line in [profile %s] section of conf.ini file: %s\n", profile->name, line);
+                    result = false;
+                }
+            } break;
             default:
                 logprint(LOG_FATAL, "Invalid Section value: %d\n", current_section);
                 result = false;
@@ -163,7 +327,125 @@ bool read_conf(const char *path, Conf *conf) {
     }
 
 CLEAN_UP_AND_RETURN:
+    free(line);
     if (f) fclose(f);
     return result;
 }
 
+void conf_free(Conf *conf) {
+    ProjConf *proj = &conf->proj;
+    free((char *)proj->proj_dir);
+    free((char *)proj->exe_name);
+    free((char *)proj->out_dir);
+    free((char *)proj->src_dir);
+    free((char *)proj->cache_remote);
+    free((char *)proj->pch);
+    free((char *)proj->pgo_train);
+    strlist_free(&proj->unity_exclude);
+
+    for (size_t i = 0; i < proj->profiles_len; i++) {
+        free(proj->profiles[i].name);
+        free(proj->profiles[i].inherits);
+        strlist_free(&proj->profiles[i].cflags);
+        strlist_free(&proj->profiles[i].ldflags);
+    }
+    free(proj->profiles);
+
+    *conf = (Conf){0};
+}
+
+
+bool global_conf_path(char *out, size_t size) {
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    if (xdg && *xdg) {
+        snprintf(out, size, "%s/buildx/conf.ini", xdg);
+        return true;
+    }
+
+    const char *home = getenv("HOME");
+    if (home && *home) {
+        snprintf(out, size, "%s/.config/buildx/conf.ini", home);
+        return true;
+    }
+
+    return false;
+}
+
+typedef enum {
+    GSEC_OPEN,
+    GSEC_CACHE,
+} GlobalSection;
+
+bool read_global_conf(GlobalConf *conf) {
+    *conf = (GlobalConf){0};
+
+    bool result = true;
+    FILE *f = NULL;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len = 0;
+
+    char path[PATH_MAX];
+    if (!global_conf_path(path, sizeof(path))) {
+        RETURN(true);
+    }
+
+    f = fopen(path, "r");
+    if (!f) {
+        // Having no global configuration is fine.
+        RETURN(errno == ENOENT);
+    }
+
+    GlobalSection current_section = GSEC_OPEN;
+    while ((len = getline(&line, &linecap, f)) != -1) {
+        if (len == 1) { // empty line
+            current_section = GSEC_OPEN;
+            continue;
+        }
+
+        char field[PATH_MAX];
+        switch (current_section) {
+            case GSEC_OPEN: {
+                if (strcmp(line, "[cache]\n") == 0) {
+                    current_section = GSEC_CACHE;
+                } else {
+                    logprint(LOG_ERROR, "Unexpected line in %s: %s\n", path, line);
+                    result = false;
+                }
+            } break;
+            case GSEC_CACHE: {
+                if (starts_with(line, "max_size")) {
+                    SCAN_FIELD("max_size");
+                    if (!parse_size(field, &conf->cache_max_size)) {
+                        logprint(LOG_ERROR, "Invalid max_size '%s' in %s.", field, path);
+                        result = false;
+                    }
+                } else if (starts_with(line, "compression")) {
+                    SCAN_FIELD("compression");
+                    if (!parse_toggle(field, &conf->cache_compression)) {
+                        logprint(LOG_ERROR, "Invalid compression '%s' in %s. Expected on or off.", field, path);
+                        result = false;
+                    }
+                } else if (starts_with(line, "remote_upload")) {
+                    SCAN_FIELD("remote_upload");
+                    if (!parse_toggle(field, &conf->cache_remote_upload)) {
+                        logprint(LOG_ERROR, "Invalid remote_upload '%s' in %s. Expected on or off.", field, path);
+                        result = false;
+                    }
+                } else if (starts_with(line, "remote")) {
+                    SCAN_FIELD("remote");
+                    conf->cache_remote = strdup(field);
+                } else {
+                    logprint(LOG_ERROR, "Unexpected line in [cache] section of %s: %s\n", path, line);
+                    result = false;
+                }
+            } break;
+        }
+    }
+
+CLEAN_UP_AND_RETURN:
+    free(line);
+    if (f) fclose(f);
+    return result;
+}
@@ -4,6 +4,8 @@
 #include "utils.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
 	int major;
@@ -11,12 +13,36 @@ typedef struct {
 	int patch;
 } BuildxConf;
 
+#define PROFILE_NAME_MAX (64)
+
+// A build configuration defined in a `[profile NAME]` section.
+typedef struct {
+	char *name;
+	char *inherits;           // Profile whose flags come first. NULL for none.
+	StrList cflags;
+	StrList ldflags;
+} Profile;
+
 typedef struct {
 	const char *proj_dir;
 	const char *exe_name;
 	const char *out_dir;
 	const char *src_dir;
 	Dialect dialect;
+
+	// Optional settings. Zero when not set.
+	uint64_t cache_max_size;
+	Toggle cache_compression;
+	const char *cache_remote;
+	Toggle cache_remote_upload;
+	StrList unity_exclude;    // Patterns of sources `build --unity` compiles on their own.
+	const char *pch;          // Header to precompile, "auto" or "off".
+	Linker linker;
+	Lto lto;                  // Link-time optimization of release builds.
+	const char *pgo_train;    // Arguments (and redirections) for PGO training runs.
+
+	Profile *profiles;
+	size_t profiles_len;
 } ProjConf;
 
 typedef struct {
@@ -24,8 +50,28 @@ typedef struct {
 	ProjConf proj;
 } Conf;
 
+// Per-user settings shared by every project, read from
+// $XDG_CONFIG_HOME/buildx/conf.ini or ~/.config/buildx/conf.ini.
+typedef struct {
+	uint64_t cache_max_size;
+	Toggle cache_compression;
+	const char *cache_remote;
+	Toggle cache_remote_upload;
+} GlobalConf;
+
 bool write_conf(const char *path, ProjConf conf);
 bool read_conf(const char *path, Conf *conf);
+// Frees what `read_conf` allocated in `conf`.
+void conf_free(Conf *conf);
+
+// Returns true if `name` is a setting `read_conf` accepts in [project].
+bool is_project_setting(const char *name);
+
+// Returns the profile called `name` from conf.ini, or NULL.
+const Profile *find_profile(const ProjConf *proj, const char *name);
+
+bool global_conf_path(char *out, size_t size);
+bool read_global_conf(GlobalConf *conf);
 
 #endif // _CONF_H_ 
 
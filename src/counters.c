@@ -0,0 +1,281 @@
+#include "counters.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define HW_CACHE(_cache_, _op_, _result_) \
+    ((_cache_) | ((_op_) << 8) | ((_result_) << 16))
+
+typedef struct CounterInfo {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    const char *base;       // Counter this one is reported as a share of, if any.
+    const char *rate_label;
+} CounterInfo;
+
+static const CounterInfo known_counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, NULL, NULL },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "cycles", "per cycle" },
+    { "ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES, NULL, NULL },
+    { "bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES, NULL, NULL },
+    { "stalled-cycles-frontend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND, "cycles", "of cycles" },
+    { "stalled-cycles-backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND, "cycles", "of cycles" },
+    { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, NULL, NULL },
+    { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-references", "of cache references" },
+    { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, NULL, NULL },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branches", "of branches" },
+    { "L1-dcache-loads", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_ACCESS), NULL, NULL },
+    { "L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), "L1-dcache-loads", "of L1 loads" },
+    { "L1-icache-load-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), NULL, NULL },
+    { "LLC-loads", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_ACCESS), NULL, NULL },
+    { "LLC-load-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), "LLC-loads", "of LLC loads" },
+    { "dTLB-load-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), NULL, NULL },
+    { "iTLB-load-misses", PERF_TYPE_HW_CACHE,
+        HW_CACHE(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), NULL, NULL },
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, NULL, NULL },
+    { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, NULL, NULL },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, NULL, NULL },
+    { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, NULL, NULL },
+};
+
+static const size_t known_counters_len = sizeof(known_counters) / sizeof(known_counters[0]);
+
+static const CounterInfo *find_counter(const char *name) {
+    for (size_t i = 0; i < known_counters_len; i++) {
+        if (strcmp(known_counters[i].name, name) == 0) {
+            return &known_counters[i];
+        }
+    }
+    return NULL;
+}
+
+typedef struct Counter {
+    const CounterInfo *info;
+    int fd;
+    double value;           // Scaled up if the counter had to share the hardware.
+    bool counted;
+    bool scaled;
+} Counter;
+
+static bool open_counter(Counter *counter, pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->info->type;
+    attr.config = counter->info->config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    // Unprivileged users may only count their own code.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    counter->fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (counter->fd != -1) {
+        return true;
+    }
+
+    if (errno == EACCES || errno == EPERM) {
+        logprint(LOG_ERROR, "Not allowed to count '%s'. Lower /proc/sys/kernel/perf_event_paranoid to 2 or less.", counter->info->name);
+        return false;
+    }
+
+    // Virtual machines and some CPUs lack some counters. The rest are still
+    // worth having.
+    const char *err = strerror(errno);
+    logprint(LOG_WARN, "Can't count '%s' here: %s.", counter->info->name, err);
+    return true;
+}
+
+static void read_counter(Counter *counter) {
+    uint64_t values[3];
+    if (counter->fd == -1 || read(counter->fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+        return;
+    }
+
+    counter->counted = true;
+    counter->scaled = values[2] < values[1];
+    counter->value = (double)values[0] * ((double)values[1] / (double)values[2]);
+}
+
+static void print_counters(const Counter *counters, size_t len) {
+    printf("==== Counters ====\n");
+    for (size_t i = 0; i < len; i++) {
+        const Counter *counter = &counters[i];
+        if (!counter->counted) {
+            printf("    %-24s %18s\n", counter->info->name, "not counted");
+            continue;
+        }
+
+        char count[32];
+        if (counter->info->type == PERF_TYPE_SOFTWARE && counter->info->config == PERF_COUNT_SW_TASK_CLOCK) {
+            format_duration((int64_t)counter->value, count, sizeof(count));
+        } else {
+            format_count((uint64_t)counter->value, count, sizeof(count));
+        }
+        printf("    %-24s %18s%s", counter->info->name, count, counter->scaled ? "~" : " ");
+
+        for (size_t j = 0; counter->info->base && j < len; j++) {
+            const Counter *base = &counters[j];
+            if (strcmp(base->info->name, counter->info->base) != 0 || !base->counted || base->value == 0) {
+                continue;
+            }
+
+            double rate = counter->value / base->value;
+            if (strcmp(counter->info->rate_label, "per cycle") == 0) {
+                printf("   %.2f %s", rate, counter->info->rate_label);
+            } else {
+                printf("   %.2f%% %s", 100 * rate, counter->info->rate_label);
+            }
+        }
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (counters[i].scaled) {
+            printf("    ~ More counters were requested than the CPU has, so they took turns and were scaled up.\n");
+            break;
+        }
+    }
+}
+
+bool counters_parse(const char *list, StrList *names) {
+    bool ok = true;
+    char *copy = strdup(list);
+    for (char *name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        if (!find_counter(name)) {
+            logprint(LOG_ERROR, "'%s' is not a known counter.", name);
+            ok = false;
+        } else {
+            strlist_push(names, name);
+        }
+    }
+    free(copy);
+
+    if (ok && names->length == 0) {
+        logprint(LOG_ERROR, "No counters given.");
+        ok = false;
+    }
+
+    if (!ok) {
+        printf("Known counters:");
+        for (size_t i = 0; i < known_counters_len; i++) {
+            printf("%s %s", i ? "," : "", known_counters[i].name);
+        }
+        printf("\n");
+    }
+    return ok;
+}
+
+bool counters_run(char *const *argv, const StrList *names, int *exit_code) {
+    // The child waits for the counters to be attached before it execs.
+    int go[2];
+    if (pipe(go) == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to create pipe: %s.", err);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to fork: %s.", err);
+        close(go[0]);
+        close(go[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(go[1]);
+        char c;
+        if (read(go[0], &c, 1) != 1) {
+            _exit(127);
+        }
+        close(go[0]);
+        execvp(argv[0], argv);
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to run '%s': %s.", argv[0], err);
+        _exit(127);
+    }
+
+    close(go[0]);
+
+    Counter *counters = calloc(names->length, sizeof(*counters));
+    bool ok = true;
+    for (size_t i = 0; i < names->length && ok; i++) {
+        counters[i] = (Counter){ .info = find_counter(names->items[i]), .fd = -1 };
+        ok = open_counter(&counters[i], pid);
+    }
+
+    // Closing the pipe without writing makes the child give up.
+    if (ok && write(go[1], "x", 1) != 1) {
+        ok = false;
+    }
+    close(go[1]);
+
+    int status;
+    bool waited = true;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            const char *err = strerror(errno);
+            logprint(LOG_FATAL, "Failed to wait for '%s': %s.", argv[0], err);
+            waited = false;
+            ok = false;
+            break;
+        }
+    }
+
+    *exit_code = -1;
+    if (waited && WIFEXITED(status)) {
+        *exit_code = WEXITSTATUS(status);
+    } else if (waited && WIFSIGNALED(status)) {
+        *exit_code = 128 + WTERMSIG(status);
+    }
+
+    for (size_t i = 0; i < names->length; i++) {
+        read_counter(&counters[i]);
+        if (counters[i].fd != -1) {
+            close(counters[i].fd);
+        }
+    }
+
+    if (ok) {
+        print_counters(counters, names->length);
+    }
+
+    free(counters);
+    return ok;
+}
+
+#else
+
+bool counters_parse(const char *list, StrList *names) {
+    UNUSED(list, names);
+    logprint(LOG_ERROR, "Counters need Linux's perf_event_open.");
+    return false;
+}
+
+bool counters_run(char *const *argv, const StrList *names, int *exit_code) {
+    UNUSED(argv, names, exit_code);
+    logprint(LOG_ERROR, "Counters need Linux's perf_event_open.");
+    return false;
+}
+
+#endif
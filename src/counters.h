@@ -0,0 +1,21 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+
+// Counted when no list is given.
+#define COUNTERS_DEFAULT "cycles,instructions,cache-references,cache-misses,branches,branch-misses"
+
+// Splits a comma separated list of hardware and software counter names
+// (perf's names, like `cycles` or `LLC-load-misses`) into `names`. Reports
+// names it doesn't know.
+bool counters_parse(const char *list, StrList *names);
+
+// Runs `argv` like `proc_run` while the kernel counts `names` for it and
+// the threads and processes it starts, then prints the totals along with
+// rates like instructions per cycle and cache miss rates. Needs Linux.
+bool counters_run(char *const *argv, const StrList *names, int *exit_code);
+
+#endif // _COUNTERS_H_
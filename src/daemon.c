@@ -0,0 +1,519 @@
+#include "daemon.h"
+#include "builder.h"
+#include "conf.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Bump when `DaemonRequest` changes. A daemon started by another version of
+// bx refuses requests and the client builds by itself.
+#define PROTOCOL_VERSION (9)
+
+#define IDLE_TIMEOUT_MS (3 * 60 * 60 * 1000)
+#define MAX_ENV_LENGTH (1024 * 1024)
+
+typedef enum DaemonCommand {
+    DC_PING,
+    DC_BUILD,
+    DC_STOP,
+} DaemonCommand;
+
+typedef enum DaemonReply {
+    DR_FAILED,
+    DR_OK,
+    DR_REFUSED,
+} DaemonReply;
+
+typedef struct DaemonRequest {
+    int version;
+    DaemonCommand command;
+    DaemonBuild build;
+    size_t env_length;          // Bytes of the client's environment, sent after the
+                                // request as NUL terminated NAME=value strings.
+} DaemonRequest;
+
+static bool socket_address(struct sockaddr_un *addr) {
+    *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    if (strlen(DAEMON_SOCKET) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, DAEMON_SOCKET);
+    return true;
+}
+
+static int connect_daemon(void) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = read(fd, data, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// Sends `req` along with this process' stdout and stderr so the daemon can
+// write to the terminal directly, followed by `env`, and waits for the reply.
+static bool send_request(const DaemonRequest *req, const char *env, DaemonReply *reply) {
+    int fd = connect_daemon();
+    if (fd == -1) {
+        return false;
+    }
+
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = { .iov_base = (void *)req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // Our own output must not end up after the daemon's.
+    fflush(stdout);
+    fflush(stderr);
+
+    bool ok = sendmsg(fd, &msg, 0) == (ssize_t)sizeof(*req);
+    ok = ok && send_all(fd, env, req->env_length);
+
+    unsigned char byte;
+    ssize_t n = 0;
+    while (ok && (n = read(fd, &byte, 1)) == -1 && errno == EINTR);
+    ok = ok && n == 1;
+    if (ok) {
+        *reply = (DaemonReply)byte;
+    }
+
+    close(fd);
+    return ok;
+}
+
+static void request_init(DaemonRequest *req, DaemonCommand command) {
+    *req = (DaemonRequest){ .version = PROTOCOL_VERSION, .command = command };
+}
+
+bool daemon_build(const DaemonBuild *build, bool *ok) {
+    DaemonRequest req;
+    request_init(&req, DC_BUILD);
+    req.build = *build;
+
+    StrBuf env = {0};
+    for (char **var = environ; *var; var++) {
+        strbuf_append_len(&env, *var, strlen(*var) + 1);
+    }
+    req.env_length = env.length;
+
+    DaemonReply reply;
+    bool sent = req.env_length <= MAX_ENV_LENGTH && send_request(&req, env.bytes, &reply);
+    strbuf_free(&env);
+    if (!sent || reply == DR_REFUSED) {
+        return false;
+    }
+
+    *ok = reply == DR_OK;
+    return true;
+}
+
+bool daemon_running(void) {
+    DaemonRequest req;
+    request_init(&req, DC_PING);
+
+    DaemonReply reply;
+    return send_request(&req, NULL, &reply) && reply == DR_OK;
+}
+
+bool daemon_stop(void) {
+    DaemonRequest req;
+    request_init(&req, DC_STOP);
+
+    DaemonReply reply;
+    return send_request(&req, NULL, &reply) && reply == DR_OK;
+}
+
+typedef struct Daemon {
+    BuildState *state;
+    Conf conf;
+    bool have_conf;
+    int64_t conf_mtime;
+} Daemon;
+
+// Rereads conf.ini only when it changed.
+static bool load_conf(Daemon *d) {
+    int64_t mtime;
+    if (!file_mtime(CONF_DIR, &mtime)) {
+        logprint(LOG_FATAL, "Couldn't find conf.ini file at '%s'.", CONF_DIR);
+        return false;
+    }
+
+    if (d->have_conf && mtime == d->conf_mtime) {
+        return true;
+    }
+
+    // The old configuration stays until the new one parses.
+    Conf conf;
+    if (!read_conf(CONF_DIR, &conf)) {
+        logprint(LOG_FATAL, "Couldn't read conf.ini file at '%s'.", CONF_DIR);
+        conf_free(&conf);
+        return false;
+    }
+
+    if (d->have_conf) {
+        conf_free(&d->conf);
+    }
+    d->conf = conf;
+    d->have_conf = true;
+    d->conf_mtime = mtime;
+    return true;
+}
+
+// Builds with the client's environment in place of the daemon's, so a daemon
+// started from another shell still sees the client's $PATH, $CC, cache
+// settings and so on.
+static bool serve_build(Daemon *d, const DaemonRequest *req, StrList *env) {
+    static char *no_env[] = { NULL };
+    char **saved_environ = environ;
+    environ = env->items ? env->items : no_env;
+
+    const char *trace_path = req->build.trace_path[0] ? req->build.trace_path : NULL;
+    if (trace_path) {
+        trace_start();
+    }
+
+    int64_t start = monotonic_ns();
+    if (!load_conf(d)) {
+        if (trace_path) trace_finish(trace_path);
+        environ = saved_environ;
+        return false;
+    }
+    trace_add("Read conf.ini", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+
+    ProjConf proj = d->conf.proj;
+    if (req->build.lto) {
+        proj.lto = req->build.lto;
+    }
+
+    const char *names[3];
+    size_t names_len = 0;
+    if (req->build.debug) names[names_len++] = "debug";
+    if (req->build.release) names[names_len++] = "release";
+    if (req->build.profile[0]) names[names_len++] = req->build.profile;
+
+    BuildConfig configs[3];
+    size_t configs_len = 0;
+    bool ok = true;
+    for (size_t i = 0; i < names_len && ok; i++) {
+        ok = build_config_init(&configs[configs_len], &proj, names[i]);
+        if (ok) configs_len++;
+    }
+
+    BuildOptions opts = {
+        .max_jobs = req->build.max_jobs,
+        .use_cache = req->build.use_cache,
+        .state = d->state,
+        .stats = req->build.stats,
+        .time_trace = req->build.time_trace,
+        .unity_files = req->build.unity_files,
+        .unity_size = req->build.unity_size,
+        .linker = req->build.linker,
+    };
+
+    ok = ok && build_project(&proj, configs, configs_len, &opts);
+
+    for (size_t i = 0; i < configs_len; i++) {
+        build_config_free(&configs[i]);
+    }
+
+    if (trace_path && trace_finish(trace_path)) {
+        logprint(LOG_INFO, "Wrote build trace to '%s'.", trace_path);
+    }
+
+    environ = saved_environ;
+    return ok;
+}
+
+// Receives a request, the client's stdout and stderr and, for builds, the
+// client's environment into `env`.
+static bool receive_request(int fd, DaemonRequest *req, int fds[2], StrList *env) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    fds[0] = fds[1] = -1;
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+        }
+    }
+
+    if (n != (ssize_t)sizeof(*req)) {
+        return false;
+    }
+    if (req->version != PROTOCOL_VERSION || req->env_length == 0) {
+        return true;
+    }
+    if (req->env_length > MAX_ENV_LENGTH) {
+        return false;
+    }
+
+    char *block = malloc(req->env_length + 1);
+    bool ok = receive_all(fd, block, req->env_length);
+    block[req->env_length] = '\0';
+    for (char *var = block; ok && var < block + req->env_length; var += strlen(var) + 1) {
+        strlist_push(env, var);
+    }
+    free(block);
+    return ok;
+}
+
+// Runs `req` with stdout and stderr pointed at the client's.
+static DaemonReply serve_request(Daemon *d, const DaemonRequest *req, int fds[2], StrList *env) {
+    if (req->version != PROTOCOL_VERSION) {
+        return DR_REFUSED;
+    }
+
+    switch (req->command) {
+        case DC_PING:
+        case DC_STOP:
+            return DR_OK;
+        case DC_BUILD:
+            break;
+        default:
+            return DR_REFUSED;
+    }
+
+    if (fds[0] == -1 || fds[1] == -1) {
+        return DR_REFUSED;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+
+    bool ok = serve_build(d, req, env);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    return ok ? DR_OK : DR_FAILED;
+}
+
+static int listen_socket(void) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr)) {
+        logprint(LOG_FATAL, "Daemon socket path '%s' is too long.", DAEMON_SOCKET);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to create socket: %s.", err);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (bound != 0 && errno == EADDRINUSE) {
+        // Left behind by a daemon that didn't shut down cleanly.
+        unlink(DAEMON_SOCKET);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    if (bound != 0 || listen(fd, 16) != 0) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to listen on '%s': %s.", DAEMON_SOCKET, err);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void detach(void) {
+    setsid();
+
+    int null_fd = open("/dev/null", O_RDONLY);
+    int log_fd = open(DAEMON_LOG, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    if (log_fd != -1) {
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+    }
+}
+
+bool daemon_serve(bool foreground) {
+    if (access(CONF_DIR, F_OK) != 0) {
+        logprint(LOG_FATAL, "No buildx project in the current directory.");
+        return false;
+    }
+
+    if (daemon_running()) {
+        logprint(LOG_INFO, "Daemon is already running.");
+        return true;
+    }
+
+    Daemon d = { .state = build_state_new() };
+    if (!load_conf(&d)) {
+        build_state_free(d.state);
+        return false;
+    }
+
+    int listen_fd = listen_socket();
+    if (listen_fd == -1) {
+        build_state_free(d.state);
+        conf_free(&d.conf);
+        return false;
+    }
+
+    if (!foreground) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+            const char *err = strerror(errno);
+            logprint(LOG_FATAL, "Failed to fork: %s.", err);
+            close(listen_fd);
+            unlink(DAEMON_SOCKET);
+            return false;
+        }
+
+        if (pid > 0) {
+            logprint(LOG_INFO, "Started daemon (pid %d). `bx build` will use it until `bx daemon stop`.", (int)pid);
+            close(listen_fd);
+            build_state_free(d.state);
+            conf_free(&d.conf);
+            return true;
+        }
+
+        detach();
+    }
+
+    // A client going away mid-build must not take the daemon with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        struct pollfd p = { .fd = listen_fd, .events = POLLIN };
+        int ready = poll(&p, 1, IDLE_TIMEOUT_MS);
+        if (ready == 0) {
+            logprint(LOG_INFO, "Stopping after being idle for too long.");
+            break;
+        }
+        if (ready == -1) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        DaemonRequest req;
+        int fds[2];
+        StrList env = {0};
+        DaemonReply reply = DR_REFUSED;
+        if (receive_request(fd, &req, fds, &env)) {
+            reply = serve_request(&d, &req, fds, &env);
+        }
+        strlist_free(&env);
+
+        if (fds[0] != -1) close(fds[0]);
+        if (fds[1] != -1) close(fds[1]);
+
+        unsigned char byte = (unsigned char)reply;
+        write(fd, &byte, 1);
+        close(fd);
+
+        if (reply == DR_OK && req.command == DC_STOP) {
+            break;
+        }
+    }
+
+    close(listen_fd);
+    unlink(DAEMON_SOCKET);
+    build_state_free(d.state);
+    conf_free(&d.conf);
+
+    if (!foreground) {
+        _exit(0);
+    }
+    return true;
+}
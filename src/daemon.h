@@ -0,0 +1,42 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "conf.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DAEMON_SOCKET BUILDX_DIR"/daemon.sock"
+#define DAEMON_LOG BUILDX_DIR"/daemon.log"
+
+typedef struct DaemonBuild {
+	bool debug;
+	bool release;
+	bool use_cache;
+	int max_jobs;
+	bool stats;
+	bool time_trace;
+	size_t unity_files;
+	uint64_t unity_size;
+	Linker linker;
+	Lto lto;
+	char profile[PROFILE_NAME_MAX];   // Empty unless a profile besides debug and release is built.
+	char trace_path[1024];    // Empty unless the build should be traced.
+} DaemonBuild;
+
+// Asks the daemon of the project in the current directory to build, writing
+// to this process' stdout and stderr. Returns false if there is no daemon
+// (or it can't take the request), otherwise stores the outcome in `ok`.
+bool daemon_build(const DaemonBuild *build, bool *ok);
+
+bool daemon_running(void);
+bool daemon_stop(void);
+
+// Keeps the project's configuration, source tree and header dependencies in
+// memory and serves builds from them until stopped or idle for a few hours.
+// Detaches from the terminal unless `foreground` is set.
+bool daemon_serve(bool foreground);
+
+#endif // _DAEMON_H_
@@ -0,0 +1,172 @@
+#include "flamegraph.h"
+#include "hash.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLAME_WIDTH 1200
+#define FLAME_FRAME_HEIGHT 16
+#define FLAME_PAD 10
+#define FLAME_TITLE_HEIGHT 30
+#define FLAME_FONT_SIZE 12
+#define FLAME_CHAR_WIDTH 7.0    // Roughly, for the default sans-serif font at 12px.
+#define FLAME_MIN_WIDTH 0.1     // Narrower frames and their callees are left out.
+
+typedef struct FlameNode {
+    char *name;
+    size_t count;
+    struct FlameNode *children;
+    size_t children_len;
+    size_t children_cap;
+} FlameNode;
+
+static FlameNode *child_node(FlameNode *parent, const char *name, size_t name_len) {
+    for (size_t i = 0; i < parent->children_len; i++) {
+        FlameNode *child = &parent->children[i];
+        if (strncmp(child->name, name, name_len) == 0 && child->name[name_len] == '\0') {
+            return child;
+        }
+    }
+
+    if (parent->children_len == parent->children_cap) {
+        parent->children_cap = parent->children_cap ? parent->children_cap * 2 : 4;
+        parent->children = realloc(parent->children, parent->children_cap * sizeof(*parent->children));
+    }
+    FlameNode *child = &parent->children[parent->children_len++];
+    *child = (FlameNode){ .name = strndup(name, name_len) };
+    return child;
+}
+
+static void add_stack(FlameNode *root, const FoldedStack *stack) {
+    root->count += stack->count;
+
+    FlameNode *node = root;
+    const char *frame = stack->frames;
+    while (*frame) {
+        const char *end = strchr(frame, ';');
+        size_t len = end ? (size_t)(end - frame) : strlen(frame);
+        node = child_node(node, frame, len);
+        node->count += stack->count;
+        frame += end ? len + 1 : len;
+    }
+}
+
+static void free_node(FlameNode *node) {
+    for (size_t i = 0; i < node->children_len; i++) {
+        free_node(&node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    return strcmp(((const FlameNode *)a)->name, ((const FlameNode *)b)->name);
+}
+
+// Callees are drawn in name order so the same stacks always line up the
+// same way, whatever order they were sampled in.
+static size_t sort_and_measure(FlameNode *node, double scale) {
+    qsort(node->children, node->children_len, sizeof(*node->children), compare_nodes);
+
+    size_t depth = 0;
+    for (size_t i = 0; i < node->children_len; i++) {
+        if (node->children[i].count * scale >= FLAME_MIN_WIDTH) {
+            size_t child_depth = 1 + sort_and_measure(&node->children[i], scale);
+            depth = child_depth > depth ? child_depth : depth;
+        }
+    }
+    return depth;
+}
+
+static void append_escaped(StrBuf *svg, const char *s, size_t len) {
+    for (size_t i = 0; i < len && s[i]; i++) {
+        switch (s[i]) {
+            case '&': strbuf_append(svg, "&amp;"); break;
+            case '<': strbuf_append(svg, "&lt;"); break;
+            case '>': strbuf_append(svg, "&gt;"); break;
+            case '"': strbuf_append(svg, "&quot;"); break;
+            default: strbuf_append_len(svg, &s[i], 1); break;
+        }
+    }
+}
+
+static void draw_node(StrBuf *svg, const FlameNode *node, size_t total, double scale, double x, size_t depth, size_t height) {
+    double width = node->count * scale;
+    if (width < FLAME_MIN_WIDTH) {
+        return;
+    }
+
+    // Warm colors that stay the same for a function across graphs.
+    uint64_t h = hash_str(HASH_SEED, node->name);
+    int r = 205 + (int)(h % 51);
+    int g = (int)((h >> 8) % 231);
+    int b = (int)((h >> 16) % 56);
+
+    double y = (double)height - FLAME_PAD - (double)(depth + 1) * FLAME_FRAME_HEIGHT;
+
+    strbuf_append(svg, "<g><title>");
+    append_escaped(svg, node->name, strlen(node->name));
+    strbuf_appendf(svg, " (%zu samples, %.2f%%)</title>", node->count, 100.0 * (double)node->count / (double)total);
+    strbuf_appendf(svg, "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d\" fill=\"rgb(%d,%d,%d)\" rx=\"2\"/>",
+        x, y, width, FLAME_FRAME_HEIGHT - 1, r, g, b);
+
+    size_t fits = (size_t)((width - 6) / FLAME_CHAR_WIDTH);
+    if (fits >= 3) {
+        size_t len = strlen(node->name);
+        strbuf_appendf(svg, "<text x=\"%.1f\" y=\"%.1f\">", x + 3, y + FLAME_FRAME_HEIGHT - 4);
+        if (len <= fits) {
+            append_escaped(svg, node->name, len);
+        } else {
+            append_escaped(svg, node->name, fits - 2);
+            strbuf_append(svg, "..");
+        }
+        strbuf_append(svg, "</text>");
+    }
+    strbuf_append(svg, "</g>\n");
+
+    for (size_t i = 0; i < node->children_len; i++) {
+        draw_node(svg, &node->children[i], total, scale, x, depth + 1, height);
+        x += node->children[i].count * scale;
+    }
+}
+
+bool flamegraph_write(const char *path, const char *title, const FoldedStack *stacks, size_t len) {
+    FlameNode root = { .name = strdup("all") };
+    for (size_t i = 0; i < len; i++) {
+        add_stack(&root, &stacks[i]);
+    }
+
+    if (root.count == 0) {
+        free_node(&root);
+        logprint(LOG_ERROR, "No stacks to draw a flame graph of.");
+        return false;
+    }
+
+    double scale = (double)(FLAME_WIDTH - 2 * FLAME_PAD) / (double)root.count;
+    size_t depth = sort_and_measure(&root, scale) + 1;
+    size_t height = FLAME_TITLE_HEIGHT + depth * FLAME_FRAME_HEIGHT + 2 * FLAME_PAD;
+
+    StrBuf svg = {0};
+    strbuf_appendf(&svg,
+        "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+        "<svg version=\"1.1\" width=\"%d\" height=\"%zu\" viewBox=\"0 0 %d %zu\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "<style>text { font-family: Verdana, sans-serif; font-size: %dpx; fill: #000; } "
+        "g:hover rect { stroke: #000; stroke-width: 0.5; }</style>\n"
+        "<rect width=\"100%%\" height=\"100%%\" fill=\"#f8f8f8\"/>\n"
+        "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\" font-size=\"%d\">",
+        FLAME_WIDTH, height, FLAME_WIDTH, height, FLAME_FONT_SIZE,
+        FLAME_WIDTH / 2, FLAME_TITLE_HEIGHT - 8, FLAME_FONT_SIZE + 5);
+    append_escaped(&svg, title, strlen(title));
+    strbuf_append(&svg, "</text>\n");
+
+    draw_node(&svg, &root, root.count, scale, FLAME_PAD, 0, height);
+    strbuf_append(&svg, "</svg>\n");
+
+    bool ok = write_file_if_changed(path, svg.bytes, svg.length);
+
+    strbuf_free(&svg);
+    free_node(&root);
+    return ok;
+}
@@ -0,0 +1,18 @@
+#ifndef _FLAMEGRAPH_H_
+#define _FLAMEGRAPH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A call stack in collapsed form: frames from the outermost caller in,
+// separated by semicolons, like "main;parse;next_token".
+typedef struct FoldedStack {
+	char *frames;
+	size_t count;
+} FoldedStack;
+
+// Writes `stacks` to `path` as an SVG flame graph. Each frame is as wide as
+// the share of samples it appeared in, with its callees stacked on top.
+bool flamegraph_write(const char *path, const char *title, const FoldedStack *stacks, size_t len);
+
+#endif // _FLAMEGRAPH_H_
@@ -0,0 +1,30 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SEED (0xcbf29ce484222325ull)
+
+// 64-bit FNV-1a. Chain calls by passing the previous result as `h`.
+uint64_t hash_bytes(uint64_t h, const void *data, size_t len);
+uint64_t hash_str(uint64_t h, const char *s);
+bool hash_file(uint64_t *h, const char *path);
+
+// SHA-256, for content addressing where collisions must not happen.
+typedef struct Sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t block_len;
+} Sha256;
+
+#define SHA256_HEX_LEN (64)
+
+void sha256_init(Sha256 *sha);
+void sha256_update(Sha256 *sha, const void *data, size_t len);
+void sha256_update_str(Sha256 *sha, const char *s);
+void sha256_final_hex(Sha256 *sha, char out[SHA256_HEX_LEN + 1]);
+
+#endif // _HASH_H_
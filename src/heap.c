@@ -0,0 +1,505 @@
+#include "heap.h"
+#include "inject.h"
+#include "symbols.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAP_SIZE_BUCKETS 40    // Powers of two, as the tracker counts them.
+#define HEAP_TOP_SITES 15
+#define HEAP_BAR_WIDTH 30
+
+// Longer than the 4095 characters ISO C guarantees, which GCC and clang allow.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverlength-strings"
+static const char tracker_source[] =
+    "// Loaded into programs by `bx run --heap`. Wraps the allocator to count\n"
+    "// allocations, bytes and the live heap, and which call sites in the\n"
+    "// executable allocate. C++'s new and delete go through malloc and free.\n"
+    "// When the program exits, writes the totals for bx to report.\n"
+    "#define _GNU_SOURCE\n"
+    "#include \"bx_inject.h\"\n"
+    "#include <dlfcn.h>\n"
+    "#include <stdio.h>\n"
+    "#include <unistd.h>\n"
+    "#ifdef __APPLE__\n"
+    "#include <malloc/malloc.h>\n"
+    "#else\n"
+    "#include <malloc.h>\n"
+    "#endif\n"
+    "\n"
+    "#define SIZE_BUCKETS 40         // Powers of two.\n"
+    "#define MAX_SITES 4096          // Power of two.\n"
+    "#define UNKNOWN_SITE UINTPTR_MAX\n"
+    "\n"
+    "typedef struct Site {\n"
+    "    uintptr_t pc;\n"
+    "    size_t count;\n"
+    "    size_t bytes;\n"
+    "} Site;\n"
+    "\n"
+    "static int enabled;\n"
+    "static pid_t tracking_pid;\n"
+    "\n"
+    "static size_t allocs;\n"
+    "static size_t frees;\n"
+    "static size_t total_bytes;\n"
+    "static int64_t live_bytes;\n"
+    "static int64_t peak_bytes;\n"
+    "static size_t size_counts[SIZE_BUCKETS];\n"
+    "static Site sites[MAX_SITES];\n"
+    "static size_t dropped_sites;\n"
+    "\n"
+    "#ifdef __APPLE__\n"
+    "// dyld swaps these in for every call to the originals outside this library.\n"
+    "#define HOOK(name) bx_##name\n"
+    "#define REAL(name) name\n"
+    "#define usable_size(p) malloc_size(p)\n"
+    "#else\n"
+    "#define HOOK(name) name\n"
+    "#define REAL(name) real_##name\n"
+    "#define usable_size(p) malloc_usable_size(p)\n"
+    "\n"
+    "static void *(*real_malloc)(size_t);\n"
+    "static void *(*real_calloc)(size_t, size_t);\n"
+    "static void *(*real_realloc)(void *, size_t);\n"
+    "static void (*real_free)(void *);\n"
+    "static int (*real_posix_memalign)(void **, size_t, size_t);\n"
+    "static void *(*real_aligned_alloc)(size_t, size_t);\n"
+    "static void *(*real_memalign)(size_t, size_t);\n"
+    "\n"
+    "// dlsym may allocate before the real allocator is known.\n"
+    "static char bootstrap[4096] __attribute__((aligned(16)));\n"
+    "static size_t bootstrap_used;\n"
+    "static int resolving;\n"
+    "\n"
+    "static void *bootstrap_alloc(size_t size) {\n"
+    "    size = (size + 15) & ~(size_t)15;\n"
+    "    if (bootstrap_used + size > sizeof(bootstrap)) {\n"
+    "        return NULL;\n"
+    "    }\n"
+    "    void *p = &bootstrap[bootstrap_used];\n"
+    "    bootstrap_used += size;\n"
+    "    return p;\n"
+    "}\n"
+    "\n"
+    "static int is_bootstrap(void *p) {\n"
+    "    return (char *)p >= bootstrap && (char *)p < bootstrap + sizeof(bootstrap);\n"
+    "}\n"
+    "\n"
+    "static void resolve(void) {\n"
+    "    resolving = 1;\n"
+    "    real_malloc = dlsym(RTLD_NEXT, \"malloc\");\n"
+    "    real_calloc = dlsym(RTLD_NEXT, \"calloc\");\n"
+    "    real_realloc = dlsym(RTLD_NEXT, \"realloc\");\n"
+    "    real_free = dlsym(RTLD_NEXT, \"free\");\n"
+    "    real_posix_memalign = dlsym(RTLD_NEXT, \"posix_memalign\");\n"
+    "    real_aligned_alloc = dlsym(RTLD_NEXT, \"aligned_alloc\");\n"
+    "    real_memalign = dlsym(RTLD_NEXT, \"memalign\");\n"
+    "    resolving = 0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "static size_t size_bucket(size_t size) {\n"
+    "    size_t bucket = 0;\n"
+    "    while (bucket + 1 < SIZE_BUCKETS && ((size_t)1 << bucket) < size) {\n"
+    "        bucket++;\n"
+    "    }\n"
+    "    return bucket;\n"
+    "}\n"
+    "\n"
+    "static void count_site(uintptr_t pc, size_t size) {\n"
+    "    size_t h = (pc >> 2) * 0x9e3779b97f4a7c15ull;\n"
+    "    for (size_t i = 0; i < MAX_SITES; i++) {\n"
+    "        Site *site = &sites[(h + i) & (MAX_SITES - 1)];\n"
+    "        uintptr_t expected = 0;\n"
+    "        if (__atomic_load_n(&site->pc, __ATOMIC_RELAXED) == pc ||\n"
+    "            __atomic_compare_exchange_n(&site->pc, &expected, pc, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||\n"
+    "            expected == pc)\n"
+    "        {\n"
+    "            __atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);\n"
+    "            __atomic_fetch_add(&site->bytes, size, __ATOMIC_RELAXED);\n"
+    "            return;\n"
+    "        }\n"
+    "    }\n"
+    "    __atomic_fetch_add(&dropped_sites, 1, __ATOMIC_RELAXED);\n"
+    "}\n"
+    "\n"
+    "static void track_alloc(void *p, size_t size, uintptr_t site) {\n"
+    "    if (!p || !enabled) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);\n"
+    "    __atomic_fetch_add(&total_bytes, size, __ATOMIC_RELAXED);\n"
+    "    __atomic_fetch_add(&size_counts[size_bucket(size)], 1, __ATOMIC_RELAXED);\n"
+    "\n"
+    "    int64_t live = __atomic_add_fetch(&live_bytes, (int64_t)usable_size(p), __ATOMIC_RELAXED);\n"
+    "    int64_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);\n"
+    "    while (live > peak && !__atomic_compare_exchange_n(&peak_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {\n"
+    "    }\n"
+    "\n"
+    "    count_site(site ? site - slide : UNKNOWN_SITE, size);\n"
+    "}\n"
+    "\n"
+    "static void track_free(void *p) {\n"
+    "    if (!p || !enabled) {\n"
+    "        return;\n"
+    "    }\n"
+    "    __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);\n"
+    "    __atomic_sub_fetch(&live_bytes, (int64_t)usable_size(p), __ATOMIC_RELAXED);\n"
+    "}\n"
+    "\n"
+    "void *HOOK(malloc)(size_t size) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (!real_malloc) {\n"
+    "        if (resolving) {\n"
+    "            return bootstrap_alloc(size);\n"
+    "        }\n"
+    "        resolve();\n"
+    "    }\n"
+    "#endif\n"
+    "    void *p = REAL(malloc)(size);\n"
+    "    track_alloc(p, size, CALL_SITE());\n"
+    "    return p;\n"
+    "}\n"
+    "\n"
+    "void *HOOK(calloc)(size_t n, size_t size) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (!real_calloc) {\n"
+    "        if (resolving) {\n"
+    "            // Static memory starts zeroed.\n"
+    "            return n && size > SIZE_MAX / n ? NULL : bootstrap_alloc(n * size);\n"
+    "        }\n"
+    "        resolve();\n"
+    "    }\n"
+    "#endif\n"
+    "    void *p = REAL(calloc)(n, size);\n"
+    "    track_alloc(p, n * size, CALL_SITE());\n"
+    "    return p;\n"
+    "}\n"
+    "\n"
+    "void *HOOK(realloc)(void *old, size_t size) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (!real_realloc) {\n"
+    "        resolve();\n"
+    "    }\n"
+    "    if (is_bootstrap(old)) {\n"
+    "        void *p = REAL(malloc)(size);\n"
+    "        if (p) {\n"
+    "            size_t available = (size_t)(bootstrap + sizeof(bootstrap) - (char *)old);\n"
+    "            memcpy(p, old, size < available ? size : available);\n"
+    "        }\n"
+    "        track_alloc(p, size, CALL_SITE());\n"
+    "        return p;\n"
+    "    }\n"
+    "#endif\n"
+    "    // Counted as freeing the old block and allocating a new one.\n"
+    "    track_free(old);\n"
+    "    void *p = REAL(realloc)(old, size);\n"
+    "    track_alloc(p, size, CALL_SITE());\n"
+    "    return p;\n"
+    "}\n"
+    "\n"
+    "void HOOK(free)(void *p) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (is_bootstrap(p)) {\n"
+    "        return;\n"
+    "    }\n"
+    "    if (!real_free) {\n"
+    "        resolve();\n"
+    "    }\n"
+    "#endif\n"
+    "    track_free(p);\n"
+    "    REAL(free)(p);\n"
+    "}\n"
+    "\n"
+    "int HOOK(posix_memalign)(void **out, size_t alignment, size_t size) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (!real_posix_memalign) {\n"
+    "        resolve();\n"
+    "    }\n"
+    "#endif\n"
+    "    int err = REAL(posix_memalign)(out, alignment, size);\n"
+    "    track_alloc(err == 0 ? *out : NULL, size, CALL_SITE());\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "void *HOOK(aligned_alloc)(size_t alignment, size_t size) {\n"
+    "#ifndef __APPLE__\n"
+    "    if (!real_aligned_alloc) {\n"
+    "        resolve();\n"
+    "    }\n"
+    "#endif\n"
+    "    void *p = REAL(aligned_alloc)(alignment, size);\n"
+    "    track_alloc(p, size, CALL_SITE());\n"
+    "    return p;\n"
+    "}\n"
+    "\n"
+    "#ifndef __APPLE__\n"
+    "void *memalign(size_t alignment, size_t size) {\n"
+    "    if (!real_memalign) {\n"
+    "        resolve();\n"
+    "    }\n"
+    "    void *p = real_memalign(alignment, size);\n"
+    "    track_alloc(p, size, CALL_SITE());\n"
+    "    return p;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "#ifdef __APPLE__\n"
+    "static const struct {\n"
+    "    const void *replacement;\n"
+    "    const void *original;\n"
+    "} interposers[] __attribute__((used, section(\"__DATA,__interpose\"))) = {\n"
+    "    { (const void *)bx_malloc, (const void *)malloc },\n"
+    "    { (const void *)bx_calloc, (const void *)calloc },\n"
+    "    { (const void *)bx_realloc, (const void *)realloc },\n"
+    "    { (const void *)bx_free, (const void *)free },\n"
+    "    { (const void *)bx_posix_memalign, (const void *)posix_memalign },\n"
+    "    { (const void *)bx_aligned_alloc, (const void *)aligned_alloc },\n"
+    "};\n"
+    "#endif\n"
+    "\n"
+    "__attribute__((constructor))\n"
+    "static void start_tracking(void) {\n"
+    "    if (!is_target()) {\n"
+    "        return;\n"
+    "    }\n"
+    "    tracking_pid = getpid();\n"
+    "    enabled = 1;\n"
+    "}\n"
+    "\n"
+    "__attribute__((destructor))\n"
+    "static void write_totals(void) {\n"
+    "    // Forked children inherit the counts.\n"
+    "    if (!enabled || tracking_pid != getpid()) {\n"
+    "        return;\n"
+    "    }\n"
+    "    enabled = 0;\n"
+    "\n"
+    "    char path[PATH_MAX];\n"
+    "    results_path(path, sizeof(path), tracking_pid, \".heap\");\n"
+    "    FILE *f = fopen(path, \"w\");\n"
+    "    if (!f) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    fprintf(f, \"allocs %zu\\n\", allocs);\n"
+    "    fprintf(f, \"frees %zu\\n\", frees);\n"
+    "    fprintf(f, \"bytes %zu\\n\", total_bytes);\n"
+    "    fprintf(f, \"live %lld\\n\", (long long)live_bytes);\n"
+    "    fprintf(f, \"peak %lld\\n\", (long long)peak_bytes);\n"
+    "    fprintf(f, \"dropped %zu\\n\", dropped_sites);\n"
+    "    for (size_t i = 0; i < SIZE_BUCKETS; i++) {\n"
+    "        if (size_counts[i] > 0) {\n"
+    "            fprintf(f, \"size %zu %zu\\n\", i, size_counts[i]);\n"
+    "        }\n"
+    "    }\n"
+    "    for (size_t i = 0; i < MAX_SITES; i++) {\n"
+    "        if (sites[i].count == 0) {\n"
+    "            continue;\n"
+    "        }\n"
+    "        if (sites[i].pc == UNKNOWN_SITE) {\n"
+    "            fprintf(f, \"site ? %zu %zu\\n\", sites[i].count, sites[i].bytes);\n"
+    "        } else {\n"
+    "            fprintf(f, \"site 0x%lx %zu %zu\\n\", (unsigned long)sites[i].pc, sites[i].count, sites[i].bytes);\n"
+    "        }\n"
+    "    }\n"
+    "    fclose(f);\n"
+    "}\n";
+#pragma GCC diagnostic pop
+
+static const InjectLib tracker = {
+    .name = "heap_tracker",
+    .source = tracker_source,
+    .dir = HEAP_DIR,
+    .suffix = ".heap",
+    .records = "allocations",
+};
+
+typedef struct HeapSite {
+    uint64_t pc;
+    bool known;             // Unknown sites are in other libraries.
+    size_t count;
+    size_t bytes;
+} HeapSite;
+
+typedef struct HeapTotals {
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+    int64_t live;
+    int64_t peak;           // Of the largest process.
+    size_t dropped;
+    size_t sizes[HEAP_SIZE_BUCKETS];
+    HeapSite *sites;
+    size_t sites_len;
+    size_t sites_cap;
+    size_t processes;
+} HeapTotals;
+
+static void add_site(HeapTotals *totals, HeapSite site) {
+    for (size_t i = 0; i < totals->sites_len; i++) {
+        HeapSite *other = &totals->sites[i];
+        if (other->known == site.known && other->pc == site.pc) {
+            other->count += site.count;
+            other->bytes += site.bytes;
+            return;
+        }
+    }
+
+    if (totals->sites_len == totals->sites_cap) {
+        totals->sites_cap = totals->sites_cap ? totals->sites_cap * 2 : 64;
+        totals->sites = realloc(totals->sites, totals->sites_cap * sizeof(*totals->sites));
+    }
+    totals->sites[totals->sites_len++] = site;
+}
+
+// Adds up the file one process of the run wrote.
+static void read_process(void *ctx, FILE *f) {
+    HeapTotals *totals = ctx;
+    totals->processes++;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        size_t n;
+        size_t bucket;
+        long long value;
+        uint64_t pc;
+        HeapSite site = {0};
+        if (sscanf(line, "allocs %zu", &n) == 1) {
+            totals->allocs += n;
+        } else if (sscanf(line, "frees %zu", &n) == 1) {
+            totals->frees += n;
+        } else if (sscanf(line, "bytes %zu", &n) == 1) {
+            totals->bytes += n;
+        } else if (sscanf(line, "live %lld", &value) == 1) {
+            totals->live += value;
+        } else if (sscanf(line, "peak %lld", &value) == 1) {
+            totals->peak = value > totals->peak ? value : totals->peak;
+        } else if (sscanf(line, "dropped %zu", &n) == 1) {
+            totals->dropped += n;
+        } else if (sscanf(line, "size %zu %zu", &bucket, &n) == 2 && bucket < HEAP_SIZE_BUCKETS) {
+            totals->sizes[bucket] += n;
+        } else if (sscanf(line, "site 0x%" SCNx64 " %zu %zu", &pc, &site.count, &site.bytes) == 3) {
+            site.pc = pc;
+            site.known = true;
+            add_site(totals, site);
+        } else if (sscanf(line, "site ? %zu %zu", &site.count, &site.bytes) == 2) {
+            add_site(totals, site);
+        }
+    }
+}
+
+static int compare_sites(const void *a, const void *b) {
+    const HeapSite *x = a;
+    const HeapSite *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static void print_sizes(const HeapTotals *totals) {
+    size_t most = 0;
+    for (size_t i = 0; i < HEAP_SIZE_BUCKETS; i++) {
+        most = totals->sizes[i] > most ? totals->sizes[i] : most;
+    }
+
+    printf("==== Allocation sizes ====\n");
+    for (size_t i = 0; i < HEAP_SIZE_BUCKETS; i++) {
+        if (totals->sizes[i] == 0) {
+            continue;
+        }
+
+        char limit[32];
+        char count[32];
+        format_size((uint64_t)1 << i, limit, sizeof(limit));
+        format_count(totals->sizes[i], count, sizeof(count));
+
+        char bar[HEAP_BAR_WIDTH + 1];
+        size_t width = (totals->sizes[i] * HEAP_BAR_WIDTH + most - 1) / most;
+        memset(bar, '#', width);
+        bar[width] = '\0';
+
+        printf("    <= %-10s %12s  %5.1f%%  %s\n", limit, count,
+            100.0 * (double)totals->sizes[i] / (double)totals->allocs, bar);
+    }
+}
+
+static void print_sites(const char *exe, HeapTotals *totals) {
+    qsort(totals->sites, totals->sites_len, sizeof(*totals->sites), compare_sites);
+    size_t len = totals->sites_len < HEAP_TOP_SITES ? totals->sites_len : HEAP_TOP_SITES;
+
+    uint64_t addrs[HEAP_TOP_SITES];
+    size_t addrs_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (totals->sites[i].known) {
+            addrs[addrs_len++] = totals->sites[i].pc;
+        }
+    }
+    StrList locations = {0};
+    symbols_locate(exe, addrs, addrs_len, &locations);
+
+    printf("==== Top call sites ====\n");
+    printf("    %12s  %6s  %10s  %s\n", "allocations", "share", "bytes", "site");
+    for (size_t i = 0, known = 0; i < len; i++) {
+        const HeapSite *site = &totals->sites[i];
+        char count[32];
+        char bytes[32];
+        format_count(site->count, count, sizeof(count));
+        format_size(site->bytes, bytes, sizeof(bytes));
+        printf("    %12s  %5.1f%%  %10s  %s\n", count, 100.0 * (double)site->count / (double)totals->allocs, bytes,
+            site->known ? locations.items[known++] : "(in other libraries)");
+    }
+    if (totals->dropped > 0) {
+        printf("    %zu allocations came from more call sites than could be told apart.\n", totals->dropped);
+    }
+
+    strlist_free(&locations);
+}
+
+static bool report(const char *exe) {
+    HeapTotals totals = {0};
+    if (!inject_read(&tracker, read_process, &totals)) {
+        return false;
+    }
+
+    char count[32];
+    char bytes[32];
+    printf("==== Heap ====\n");
+    format_count(totals.allocs, count, sizeof(count));
+    printf("    Allocations       %s\n", count);
+    format_size(totals.bytes, bytes, sizeof(bytes));
+    printf("    Allocated         %s", bytes);
+    if (totals.allocs > 0) {
+        format_size(totals.bytes / totals.allocs, bytes, sizeof(bytes));
+        printf(" (%s on average)", bytes);
+    }
+    printf("\n");
+    format_count(totals.frees, count, sizeof(count));
+    printf("    Frees             %s\n", count);
+    format_size(totals.peak > 0 ? (uint64_t)totals.peak : 0, bytes, sizeof(bytes));
+    printf("    Peak heap         %s%s\n", bytes, totals.processes > 1 ? " (in the largest process)" : "");
+    if (totals.allocs > totals.frees) {
+        format_size(totals.live > 0 ? (uint64_t)totals.live : 0, bytes, sizeof(bytes));
+        format_count(totals.allocs - totals.frees, count, sizeof(count));
+        printf("    Live at exit      %s in %s blocks\n", bytes, count);
+    }
+
+    if (totals.allocs > 0) {
+        print_sizes(&totals);
+        print_sites(exe, &totals);
+    }
+
+    free(totals.sites);
+    return true;
+}
+
+bool heap_run(char *const *argv, int *exit_code) {
+    return inject_run(&tracker, argv, 0, exit_code) && report(argv[0]);
+}
@@ -0,0 +1,15 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+
+#define HEAP_DIR BUILDX_DIR"/heap"
+
+// Runs `argv` like `proc_run` with the allocator of `argv[0]` wrapped, then
+// reports how many allocations it made, how many bytes they came to, the
+// peak heap, allocation sizes and the call sites that allocated most.
+bool heap_run(char *const *argv, int *exit_code);
+
+#endif // _HEAP_H_
@@ -0,0 +1,436 @@
+#include "http.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// A cache that doesn't answer quickly is slower than compiling.
+#define CONNECT_TIMEOUT_MS (2000)
+#define IO_TIMEOUT_S (30)
+
+#define MAX_HEADER_LEN (16 * 1024)
+#define MAX_BODY_LEN (1ull << 30)
+
+#define IDLE_INTERVAL_S (60)
+
+bool http_parse_url(const char *url, HttpUrl *out) {
+    *out = (HttpUrl){0};
+
+    if (!starts_with(url, "http://")) {
+        return false;
+    }
+    const char *host = url + sizeof("http://") - 1;
+
+    const char *path = strchr(host, '/');
+    if (!path) path = host + strlen(host);
+
+    const char *port = memchr(host, ':', (size_t)(path - host));
+    const char *host_end = port ? port : path;
+    size_t host_len = (size_t)(host_end - host);
+    if (host_len == 0 || host_len >= sizeof(out->host)) {
+        return false;
+    }
+    memcpy(out->host, host, host_len);
+
+    if (port) {
+        size_t port_len = (size_t)(path - port - 1);
+        if (port_len == 0 || port_len >= sizeof(out->port)) {
+            return false;
+        }
+        memcpy(out->port, port + 1, port_len);
+    } else {
+        strcpy(out->port, "80");
+    }
+
+    size_t path_len = strlen(path);
+    while (path_len > 0 && path[path_len - 1] == '/') path_len--;
+    if (path_len >= sizeof(out->path)) {
+        return false;
+    }
+    memcpy(out->path, path, path_len);
+
+    return true;
+}
+
+static void set_timeouts(int fd) {
+    struct timeval tv = { .tv_sec = IO_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+// Connects with a short timeout so an unreachable cache doesn't stall the
+// build.
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addrs;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *a = addrs; a && fd == -1; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        bool connected = connect(fd, a->ai_addr, a->ai_addrlen) == 0;
+        if (!connected && errno == EINPROGRESS) {
+            struct pollfd p = { .fd = fd, .events = POLLOUT };
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            connected = poll(&p, 1, CONNECT_TIMEOUT_MS) == 1 &&
+                        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 &&
+                        err == 0;
+        }
+
+        if (!connected) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, flags);
+        set_timeouts(fd);
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+#ifdef MSG_NOSIGNAL
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+#else
+        ssize_t n = send(fd, data, length, 0);
+#endif
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+// Finds a header in `head` (which ends with an empty line) and returns its
+// value, or NULL.
+static const char *find_header(const char *head, const char *name, char *value, size_t size) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t len = strcspn(v, "\r\n");
+            if (len >= size) len = size - 1;
+            memcpy(value, v, len);
+            value[len] = '\0';
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static bool receive_more(int fd, StrBuf *buf) {
+    char chunk[16 * 1024];
+    ssize_t n;
+    while ((n = recv(fd, chunk, sizeof(chunk), 0)) == -1 && errno == EINTR);
+    if (n <= 0) {
+        return false;
+    }
+    strbuf_append_len(buf, chunk, (size_t)n);
+    return true;
+}
+
+// Decodes a `Transfer-Encoding: chunked` body into `body`. `raw` holds what
+// has been received of it so far. Each chunk is its size in hex, a line
+// break, the data and another line break, up to a chunk of size zero.
+static bool read_chunked(int fd, StrBuf *raw, StrBuf *body) {
+    size_t pos = 0;
+    for (;;) {
+        const char *line_end = NULL;
+        while (pos >= raw->length || !(line_end = memchr(raw->bytes + pos, '\n', raw->length - pos))) {
+            if (raw->length - pos > MAX_HEADER_LEN || !receive_more(fd, raw)) {
+                return false;
+            }
+        }
+
+        char *size_end;
+        unsigned long long size = strtoull(raw->bytes + pos, &size_end, 16);
+        if (size_end == raw->bytes + pos) {
+            return false;
+        }
+        pos = (size_t)(line_end - raw->bytes) + 1;
+
+        // Trailers after the last chunk aren't needed.
+        if (size == 0) {
+            return true;
+        }
+        if (size > MAX_BODY_LEN - body->length) {
+            return false;
+        }
+
+        while (raw->length - pos < size + 2) {
+            if (!receive_more(fd, raw)) {
+                return false;
+            }
+        }
+        strbuf_append_len(body, raw->bytes + pos, (size_t)size);
+        pos += (size_t)size + 2;
+    }
+}
+
+// Reads the head and body of one HTTP message. Without a Content-Length the
+// body runs until the connection closes, unless `body_needs_length` is set.
+// Chunked bodies are decoded.
+static bool read_message(int fd, StrBuf *head, StrBuf *body, bool body_needs_length) {
+    char buf[16 * 1024];
+    char *end = NULL;
+
+    while (!end) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        strbuf_append_len(head, buf, (size_t)n);
+        end = strstr(head->bytes, "\r\n\r\n");
+        if (!end && head->length > MAX_HEADER_LEN) {
+            return false;
+        }
+    }
+
+    // Whatever came in after the head already belongs to the body.
+    size_t head_len = (size_t)(end - head->bytes) + 4;
+    strbuf_append_len(body, head->bytes + head_len, head->length - head_len);
+    head->length = head_len;
+    head->bytes[head_len] = '\0';
+
+    char value[32];
+    if (find_header(head->bytes, "Transfer-Encoding", value, sizeof(value))) {
+        // Compressed encodings are never asked for.
+        if (strcasecmp(value, "chunked") != 0) {
+            return false;
+        }
+
+        StrBuf raw = *body;
+        *body = (StrBuf){0};
+        bool ok = read_chunked(fd, &raw, body);
+        strbuf_free(&raw);
+        return ok;
+    }
+
+    bool has_length = find_header(head->bytes, "Content-Length", value, sizeof(value)) != NULL;
+    unsigned long long length = has_length ? strtoull(value, NULL, 10) : 0;
+    if (!has_length && body_needs_length) {
+        return body->length == 0;
+    }
+    if (length > MAX_BODY_LEN) {
+        return false;
+    }
+
+    while (!has_length || body->length < length) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == 0 && !has_length) break;
+        if (n <= 0) return false;
+        strbuf_append_len(body, buf, (size_t)n);
+    }
+
+    if (has_length && body->length > length) {
+        body->length = length;
+        body->bytes[length] = '\0';
+    }
+
+    return true;
+}
+
+static bool request(const HttpUrl *url, const char *method, const char *path, const char *body, size_t length, StrBuf *response, int *status) {
+    bool result = true;
+    StrBuf head = {0};
+    StrBuf resp_body = {0};
+
+    int fd = connect_to(url->host, url->port);
+    if (fd == -1) {
+        RETURN(false);
+    }
+
+    strbuf_appendf(&head, "%s %s%s HTTP/1.1\r\n", method, url->path, path);
+    strbuf_appendf(&head, "Host: %s:%s\r\n", url->host, url->port);
+    strbuf_append(&head, "User-Agent: buildx\r\n");
+    strbuf_append(&head, "Connection: close\r\n");
+    if (body) {
+        strbuf_append(&head, "Content-Type: application/octet-stream\r\n");
+        strbuf_appendf(&head, "Content-Length: %zu\r\n", length);
+    }
+    strbuf_append(&head, "\r\n");
+
+    if (!send_all(fd, head.bytes, head.length) || (body && !send_all(fd, body, length))) {
+        RETURN(false);
+    }
+
+    head.length = 0;
+    if (!read_message(fd, &head, &resp_body, false)) {
+        RETURN(false);
+    }
+
+    if (sscanf(head.bytes, "HTTP/1.%*d %d", status) != 1) {
+        RETURN(false);
+    }
+
+    if (response && *status == 200) {
+        *response = resp_body;
+        resp_body = (StrBuf){0};
+    }
+
+CLEAN_UP_AND_RETURN:
+    if (fd != -1) close(fd);
+    strbuf_free(&head);
+    strbuf_free(&resp_body);
+    return result;
+}
+
+bool http_get(const HttpUrl *url, const char *path, StrBuf *body, int *status) {
+    return request(url, "GET", path, NULL, 0, body, status);
+}
+
+bool http_put(const HttpUrl *url, const char *path, const char *body, size_t length, int *status) {
+    return request(url, "PUT", path, body, length, NULL, status);
+}
+
+static const char *status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 500: return "Internal Server Error";
+        default:  return "Unknown";
+    }
+}
+
+static void serve_connection(int fd, HttpHandler handler, void *ctx) {
+    set_timeouts(fd);
+
+    StrBuf head = {0};
+    StrBuf body = {0};
+    StrBuf response = {0};
+    HttpRequest req = {0};
+
+    int status = 400;
+    if (read_message(fd, &head, &body, true) &&
+        sscanf(head.bytes, "%15s %1023s HTTP/1.%*d", req.method, req.path) == 2)
+    {
+        req.body = body.bytes;
+        req.body_length = body.length;
+        status = handler(ctx, &req, &response);
+    }
+
+    StrBuf out = {0};
+    strbuf_appendf(&out, "HTTP/1.1 %d %s\r\n", status, status_text(status));
+    strbuf_append(&out, "Content-Type: application/octet-stream\r\n");
+    strbuf_appendf(&out, "Content-Length: %zu\r\n", response.length);
+    strbuf_append(&out, "Connection: close\r\n\r\n");
+
+    if (send_all(fd, out.bytes, out.length) && response.length > 0) {
+        send_all(fd, response.bytes, response.length);
+    }
+
+    strbuf_free(&out);
+    strbuf_free(&response);
+    strbuf_free(&body);
+    strbuf_free(&head);
+}
+
+bool http_serve(const char *host, const char *port, HttpHandler handler, HttpIdleFunc idle, void *ctx) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *addrs;
+    int err = getaddrinfo(host, port, &hints, &addrs);
+    if (err != 0) {
+        logprint(LOG_FATAL, "Couldn't resolve '%s:%s': %s.", host ? host : "*", port, gai_strerror(err));
+        return false;
+    }
+
+    int listen_fd = -1;
+    for (struct addrinfo *a = addrs; a && listen_fd == -1; a = a->ai_next) {
+        listen_fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (listen_fd == -1) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(listen_fd, a->ai_addr, a->ai_addrlen) != 0 || listen(listen_fd, 64) != 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (listen_fd == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Couldn't listen on '%s:%s': %s.", host ? host : "*", port, err);
+        return false;
+    }
+
+    // Children are never waited for.
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    int64_t last_idle = monotonic_ns();
+    for (;;) {
+        struct pollfd p = { .fd = listen_fd, .events = POLLIN };
+        int ready = poll(&p, 1, IDLE_INTERVAL_S * 1000);
+
+        if (idle && monotonic_ns() - last_idle >= IDLE_INTERVAL_S * 1000000000ll) {
+            idle(ctx);
+            last_idle = monotonic_ns();
+        }
+
+        if (ready <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            serve_connection(fd, handler, ctx);
+            close(fd);
+            _exit(0);
+        } else if (pid == -1) {
+            const char *err = strerror(errno);
+            logprint(LOG_ERROR, "Failed to fork: %s.", err);
+        }
+
+        close(fd);
+    }
+}
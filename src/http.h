@@ -0,0 +1,45 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Minimal HTTP/1.1 over plain TCP. Just enough for the remote object cache.
+// There is no TLS; put the cache behind a trusted network or a proxy.
+
+typedef struct HttpUrl {
+	char host[256];
+	char port[8];
+	char path[1024];          // Prefix of every request path. Never ends with '/'.
+} HttpUrl;
+
+// Parses `http://host[:port][/path]`.
+bool http_parse_url(const char *url, HttpUrl *out);
+
+// Requests `url->path` + `path`. Returns false if the server couldn't be
+// reached or didn't send a valid response, otherwise stores the status code.
+// `body` is only filled in for a 200 response.
+bool http_get(const HttpUrl *url, const char *path, StrBuf *body, int *status);
+bool http_put(const HttpUrl *url, const char *path, const char *body, size_t length, int *status);
+
+typedef struct HttpRequest {
+	char method[16];
+	char path[1024];
+	char *body;
+	size_t body_length;
+} HttpRequest;
+
+// Fills in `response` and returns its status code.
+typedef int (*HttpHandler)(void *ctx, const HttpRequest *request, StrBuf *response);
+
+// Called by `http_serve` every few seconds while it is idle, and between
+// connections at most that often.
+typedef void (*HttpIdleFunc)(void *ctx);
+
+// Listens on `host:port` and serves each connection in a forked child with
+// `handler`. Only returns if the socket couldn't be set up.
+bool http_serve(const char *host, const char *port, HttpHandler handler, HttpIdleFunc idle, void *ctx);
+
+#endif // _HTTP_H_
@@ -0,0 +1,299 @@
+#include "inject.h"
+#include "builder.h"
+#include "proc.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#define PRELOAD_VAR "DYLD_INSERT_LIBRARIES"
+#define LIB_EXT ".dylib"
+#else
+#define PRELOAD_VAR "LD_PRELOAD"
+#define LIB_EXT ".so"
+#endif
+
+#define INJECT_HEADER INJECT_DIR"/bx_inject.h"
+
+static const char header_source[] =
+    "// Shared by the libraries buildx loads into the programs it runs. Finds the\n"
+    "// executable's code so addresses in it can be written as offsets for bx to\n"
+    "// symbolize, and where to write what was recorded. Include after defining\n"
+    "// _GNU_SOURCE.\n"
+    "#include <limits.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <sys/types.h>\n"
+    "#ifdef __APPLE__\n"
+    "#include <mach-o/dyld.h>\n"
+    "#include <mach-o/getsect.h>\n"
+    "#else\n"
+    "#include <link.h>\n"
+    "#endif\n"
+    "\n"
+    "#define MAX_SCAN 64     // Stack words searched for a return address into the executable.\n"
+    "\n"
+    "static uintptr_t text_start;\n"
+    "static uintptr_t text_end;\n"
+    "static uintptr_t slide;\n"
+    "\n"
+    "#ifdef __APPLE__\n"
+    "static int find_text(void) {\n"
+    "    const struct mach_header_64 *header = (const struct mach_header_64 *)_dyld_get_image_header(0);\n"
+    "    unsigned long size;\n"
+    "    uint8_t *text = getsectiondata(header, \"__TEXT\", \"__text\", &size);\n"
+    "    if (!text) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "    slide = (uintptr_t)_dyld_get_image_vmaddr_slide(0);\n"
+    "    text_start = (uintptr_t)text;\n"
+    "    text_end = text_start + size;\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "static int own_path(char *out) {\n"
+    "    char path[PATH_MAX];\n"
+    "    uint32_t size = sizeof(path);\n"
+    "    return _NSGetExecutablePath(path, &size) == 0 && realpath(path, out) != NULL;\n"
+    "}\n"
+    "#else\n"
+    "static int find_exe_text(struct dl_phdr_info *info, size_t size, void *data) {\n"
+    "    (void)size;\n"
+    "    (void)data;\n"
+    "    // The executable is always reported first.\n"
+    "    slide = info->dlpi_addr;\n"
+    "    for (int i = 0; i < info->dlpi_phnum; i++) {\n"
+    "        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];\n"
+    "        if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {\n"
+    "            text_start = slide + ph->p_vaddr;\n"
+    "            text_end = text_start + ph->p_memsz;\n"
+    "        }\n"
+    "    }\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "static int find_text(void) {\n"
+    "    dl_iterate_phdr(find_exe_text, NULL);\n"
+    "    return text_end > text_start;\n"
+    "}\n"
+    "\n"
+    "static int own_path(char *out) {\n"
+    "    return realpath(\"/proc/self/exe\", out) != NULL;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "static int in_text(uintptr_t pc) {\n"
+    "    return pc >= text_start && pc < text_end;\n"
+    "}\n"
+    "\n"
+    "// Returns true if this process runs the executable $BX_INJECT_EXE names, so\n"
+    "// that a shell running it or other programs it starts aren't observed.\n"
+    "static int is_target(void) {\n"
+    "    const char *exe = getenv(\"BX_INJECT_EXE\");\n"
+    "    char self[PATH_MAX];\n"
+    "    return getenv(\"BX_INJECT_DIR\") && exe && own_path(self) && strcmp(self, exe) == 0 && find_text();\n"
+    "}\n"
+    "\n"
+    "// The file process `pid` writes what it recorded to, in $BX_INJECT_DIR.\n"
+    "static void results_path(char *out, size_t size, pid_t pid, const char *suffix) {\n"
+    "    snprintf(out, size, \"%s/%d%s\", getenv(\"BX_INJECT_DIR\"), (int)pid, suffix);\n"
+    "}\n"
+    "\n"
+    "// Returns the first return address into the executable, given the return\n"
+    "// address and frame of a wrapped function, which skips wrappers in other\n"
+    "// libraries like C++'s operator new or std::mutex. Returns 0 if there is none.\n"
+    "__attribute__((always_inline))\n"
+    "static inline uintptr_t call_site(uintptr_t ret, const uintptr_t *frame) {\n"
+    "    if (in_text(ret)) {\n"
+    "        return ret - 1;\n"
+    "    }\n"
+    "    for (size_t i = 0; frame && i < MAX_SCAN; i++) {\n"
+    "        if (in_text(frame[i])) {\n"
+    "            return frame[i] - 1;\n"
+    "        }\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "#define CALL_SITE() call_site((uintptr_t)__builtin_return_address(0), (const uintptr_t *)__builtin_frame_address(0))\n";
+
+bool inject_build(const char *name, const char *source, char *lib, size_t lib_size) {
+    char src_path[PATH_MAX];
+    char lib_path[PATH_MAX];
+    snprintf(src_path, sizeof(src_path), INJECT_DIR"/%s.c", name);
+    snprintf(lib_path, sizeof(lib_path), INJECT_DIR"/%s"LIB_EXT, name);
+
+    if (!make_dirs(INJECT_DIR) ||
+        !write_file_if_changed(INJECT_HEADER, header_source, strlen(header_source)) ||
+        !write_file_if_changed(src_path, source, strlen(source)))
+    {
+        return false;
+    }
+
+    int64_t src_mtime;
+    int64_t header_mtime;
+    int64_t lib_mtime;
+    if (!file_mtime(src_path, &src_mtime) || !file_mtime(INJECT_HEADER, &header_mtime) ||
+        !file_mtime(lib_path, &lib_mtime) || lib_mtime < src_mtime || lib_mtime < header_mtime)
+    {
+        StrList argv = {0};
+        strlist_push(&argv, c_compiler());
+#ifdef __APPLE__
+        strlist_push(&argv, "-dynamiclib");
+#else
+        strlist_push(&argv, "-shared");
+#endif
+        strlist_push(&argv, "-fPIC");
+        strlist_push(&argv, "-O2");
+        strlist_push(&argv, "-I"INJECT_DIR);
+        strlist_push(&argv, "-o");
+        strlist_push(&argv, lib_path);
+        strlist_push(&argv, src_path);
+#ifndef __APPLE__
+        strlist_push(&argv, "-ldl");
+        strlist_push(&argv, "-lpthread");
+#endif
+
+        int exit_code;
+        bool ok = proc_run(argv.items, &exit_code) && exit_code == 0;
+        strlist_free(&argv);
+        if (!ok) {
+            logprint(LOG_ERROR, "Failed to compile '%s'.", src_path);
+            return false;
+        }
+    }
+
+    // Programs may change directory before starting others.
+    char abs_path[PATH_MAX];
+    if (!realpath(lib_path, abs_path)) {
+        logprint(LOG_ERROR, "Couldn't resolve '%s'.", lib_path);
+        return false;
+    }
+    snprintf(lib, lib_size, "%s", abs_path);
+    return true;
+}
+
+static char *saved_preload;
+static bool had_preload;
+
+void inject_preload(const char *lib) {
+    const char *old = getenv(PRELOAD_VAR);
+    had_preload = old != NULL;
+    saved_preload = old ? strdup(old) : NULL;
+
+    // Libraries the user preloads themselves keep working.
+    StrBuf value = {0};
+    strbuf_append(&value, lib);
+    if (old && *old) {
+        strbuf_appendf(&value, ":%s", old);
+    }
+    setenv(PRELOAD_VAR, value.bytes, 1);
+    strbuf_free(&value);
+}
+
+void inject_clear(void) {
+    if (had_preload) {
+        setenv(PRELOAD_VAR, saved_preload, 1);
+    } else {
+        unsetenv(PRELOAD_VAR);
+    }
+    free(saved_preload);
+    saved_preload = NULL;
+    had_preload = false;
+}
+
+static void remove_results(const InjectLib *lib) {
+    DIR *d = opendir(lib->dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (ends_with(entry->d_name, lib->suffix)) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", lib->dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+bool inject_begin(const InjectLib *lib, const char *exe, int hz) {
+    char lib_path[PATH_MAX];
+    char exe_path[PATH_MAX];
+    char dir_path[PATH_MAX];
+    if (!inject_build(lib->name, lib->source, lib_path, sizeof(lib_path)) ||
+        !make_dirs(lib->dir) ||
+        !realpath(exe, exe_path) ||
+        !realpath(lib->dir, dir_path))
+    {
+        return false;
+    }
+    remove_results(lib);
+
+    setenv("BX_INJECT_DIR", dir_path, 1);
+    setenv("BX_INJECT_EXE", exe_path, 1);
+    if (hz) {
+        char rate[16];
+        snprintf(rate, sizeof(rate), "%d", hz);
+        setenv("BX_INJECT_HZ", rate, 1);
+    }
+    inject_preload(lib_path);
+    return true;
+}
+
+void inject_end(void) {
+    inject_clear();
+    unsetenv("BX_INJECT_DIR");
+    unsetenv("BX_INJECT_EXE");
+    unsetenv("BX_INJECT_HZ");
+}
+
+bool inject_run(const InjectLib *lib, char *const *argv, int hz, int *exit_code) {
+    if (!inject_begin(lib, argv[0], hz)) {
+        return false;
+    }
+
+    bool ok = proc_run(argv, exit_code);
+    inject_end();
+
+    if (!ok) {
+        logprint(LOG_FATAL, "Failed to run executable '%s'.", argv[0]);
+    }
+    return ok;
+}
+
+bool inject_read(const InjectLib *lib, InjectReadFunc on_file, void *ctx) {
+    size_t processes = 0;
+    DIR *d = opendir(lib->dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (!ends_with(entry->d_name, lib->suffix)) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", lib->dir, entry->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        processes++;
+        on_file(ctx, f);
+        fclose(f);
+    }
+    if (d) closedir(d);
+
+    if (processes == 0) {
+        logprint(LOG_ERROR, "No %s were recorded. The program has to exit normally rather than by a signal or `_exit`.", lib->records);
+        return false;
+    }
+    return true;
+}
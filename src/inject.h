@@ -0,0 +1,51 @@
+#ifndef _INJECT_H_
+#define _INJECT_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Small libraries buildx loads into the programs it runs to observe them.
+#define INJECT_DIR BUILDX_DIR"/inject"
+
+// Compiles `source` into the shared library `INJECT_DIR/<name>` unless it is
+// already up to date, and stores the library's absolute path in `lib`. The
+// source can include "bx_inject.h" to find the code of the executable it is
+// loaded into.
+bool inject_build(const char *name, const char *source, char *lib, size_t lib_size);
+
+// Makes programs started from now on load `lib` before anything else, until
+// `inject_clear` is called.
+void inject_preload(const char *lib);
+void inject_clear(void);
+
+// A library that records something about one executable while it runs and,
+// when each of its processes exits, writes what it recorded to a file of its
+// own. It learns which executable from $BX_INJECT_EXE, where to write from
+// $BX_INJECT_DIR and, if it takes one, a rate from $BX_INJECT_HZ.
+typedef struct InjectLib {
+	const char *name;       // As for `inject_build`.
+	const char *source;
+	const char *dir;        // Where its files go.
+	const char *suffix;     // Of its files, like ".heap".
+	const char *records;    // What it records, for "No <records> were recorded."
+} InjectLib;
+
+// Builds `lib`, removes the files of its last run and makes programs started
+// from now on load it to record `exe`, until `inject_end`. `hz` is passed on
+// unless it is 0.
+bool inject_begin(const InjectLib *lib, const char *exe, int hz);
+void inject_end(void);
+
+// Runs `argv` like `proc_run` with `lib` recording `argv[0]`.
+bool inject_run(const InjectLib *lib, char *const *argv, int hz, int *exit_code);
+
+typedef void (*InjectReadFunc)(void *ctx, FILE *f);
+
+// Hands the file each process of the last run wrote to `on_file`. Returns false,
+// after saying so, if there are none.
+bool inject_read(const InjectLib *lib, InjectReadFunc on_file, void *ctx);
+
+#endif // _INJECT_H_
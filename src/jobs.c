@@ -0,0 +1,291 @@
+#include "jobs.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct RunningJob {
+    pid_t pid;
+    size_t job;
+    int64_t start_ns;
+    int lane;
+} RunningJob;
+
+typedef struct ReadyHeap {
+    size_t *items;
+    size_t length;
+} ReadyHeap;
+
+size_t jobs_add(JobGraph *graph, StrList argv, char *label, int64_t cost) {
+    if (graph->length == graph->capacity) {
+        graph->capacity = graph->capacity ? graph->capacity * 2 : 64;
+        graph->jobs = realloc(graph->jobs, graph->capacity * sizeof(*graph->jobs));
+    }
+
+    graph->jobs[graph->length] = (Job){
+        .argv = argv,
+        .label = label,
+        .cost = cost > 0 ? cost : 1,
+        .priority = -1,
+    };
+    return graph->length++;
+}
+
+size_t jobs_add_func(JobGraph *graph, JobFunc func, void *ctx, char *label, int64_t cost) {
+    size_t index = jobs_add(graph, (StrList){0}, label, cost);
+    graph->jobs[index].func = func;
+    graph->jobs[index].ctx = ctx;
+    return index;
+}
+
+void jobs_add_dep(JobGraph *graph, size_t job, size_t dependency) {
+    Job *dep = &graph->jobs[dependency];
+    if (dep->dependents_len == dep->dependents_cap) {
+        dep->dependents_cap = dep->dependents_cap ? dep->dependents_cap * 2 : 4;
+        dep->dependents = realloc(dep->dependents, dep->dependents_cap * sizeof(*dep->dependents));
+    }
+
+    dep->dependents[dep->dependents_len++] = job;
+    graph->jobs[job].pending_deps++;
+}
+
+void jobs_free(JobGraph *graph) {
+    for (size_t i = 0; i < graph->length; i++) {
+        strlist_free(&graph->jobs[i].argv);
+        free(graph->jobs[i].label);
+        free(graph->jobs[i].dependents);
+    }
+    free(graph->jobs);
+    *graph = (JobGraph){0};
+}
+
+int jobs_default_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static int64_t compute_priority(JobGraph *graph, size_t index) {
+    Job *job = &graph->jobs[index];
+    if (job->priority >= 0) {
+        return job->priority;
+    }
+
+    int64_t longest = 0;
+    for (size_t i = 0; i < job->dependents_len; i++) {
+        int64_t p = compute_priority(graph, job->dependents[i]);
+        if (p > longest) longest = p;
+    }
+
+    job->priority = job->cost + longest;
+    return job->priority;
+}
+
+static bool heap_less(const JobGraph *graph, size_t a, size_t b) {
+    return graph->jobs[a].priority < graph->jobs[b].priority;
+}
+
+static void heap_push(ReadyHeap *heap, const JobGraph *graph, size_t job) {
+    size_t i = heap->length++;
+    heap->items[i] = job;
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_less(graph, heap->items[parent], heap->items[i])) {
+            break;
+        }
+        size_t tmp = heap->items[parent];
+        heap->items[parent] = heap->items[i];
+        heap->items[i] = tmp;
+        i = parent;
+    }
+}
+
+static size_t heap_pop(ReadyHeap *heap, const JobGraph *graph) {
+    size_t top = heap->items[0];
+    heap->items[0] = heap->items[--heap->length];
+
+    size_t i = 0;
+    for (;;) {
+        size_t largest = i;
+        size_t l = 2 * i + 1;
+        size_t r = 2 * i + 2;
+        if (l < heap->length && heap_less(graph, heap->items[largest], heap->items[l])) largest = l;
+        if (r < heap->length && heap_less(graph, heap->items[largest], heap->items[r])) largest = r;
+        if (largest == i) break;
+
+        size_t tmp = heap->items[largest];
+        heap->items[largest] = heap->items[i];
+        heap->items[i] = tmp;
+        i = largest;
+    }
+
+    return top;
+}
+
+// `child_mask` is the signal mask to give the child back.
+static bool start_job(Job *job, RunningJob *running, const sigset_t *child_mask) {
+    if (job->label) {
+        printf("%s\n", job->label);
+    }
+    fflush(stdout);
+
+    running->start_ns = monotonic_ns();
+    job->start_ns = running->start_ns;
+    job->lane = running->lane;
+    running->pid = fork();
+    if (running->pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to fork: %s.", err);
+        return false;
+    }
+
+    if (running->pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, child_mask, NULL);
+
+        if (job->func) {
+            int exit_code = job->func(job->ctx);
+            fflush(NULL);
+            _exit(exit_code);
+        }
+
+        // The daemon ignores SIGPIPE, which the compiler would inherit.
+        signal(SIGPIPE, SIG_DFL);
+        execvp(job->argv.items[0], job->argv.items);
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to run '%s': %s.", job->argv.items[0], err);
+        _exit(127);
+    }
+
+    return true;
+}
+
+static void on_child_exit(int sig) {
+    UNUSED(sig);
+}
+
+// Reaps one of the running jobs if any has finished. Other children of the
+// process (like the executable `bx watch --run` started) are left alone.
+static int reap_job(const RunningJob *running, int running_len, int *status, struct rusage *usage) {
+    for (int i = 0; i < running_len; i++) {
+        pid_t pid;
+        while ((pid = wait4(running[i].pid, status, WNOHANG, usage)) == -1 && errno == EINTR);
+        if (pid == running[i].pid) {
+            return i;
+        }
+        if (pid == -1) {
+            const char *err = strerror(errno);
+            logprint(LOG_FATAL, "Failed to wait for jobs: %s.", err);
+            // Counts as the job failing.
+            *status = -1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool jobs_run(JobGraph *graph, int max_jobs) {
+    if (max_jobs < 1) max_jobs = 1;
+
+    bool result = true;
+    ReadyHeap ready = { .items = malloc((graph->length + 1) * sizeof(size_t)) };
+    RunningJob *running = calloc(max_jobs, sizeof(*running));
+    int running_len = 0;
+
+    // Which worker slots are taken, so each job can report a stable lane.
+    bool *lane_busy = calloc(max_jobs, sizeof(*lane_busy));
+
+    for (size_t i = 0; i < graph->length; i++) {
+        compute_priority(graph, i);
+    }
+
+    // SIGCHLD stays blocked except while waiting for it, so a job finishing
+    // between looking for finished jobs and going to sleep still wakes us.
+    sigset_t child_mask;
+    sigset_t wait_mask;
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &child_mask);
+    wait_mask = child_mask;
+    sigdelset(&wait_mask, SIGCHLD);
+
+    struct sigaction action = { .sa_handler = on_child_exit };
+    struct sigaction old_action;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, &old_action);
+
+    for (size_t i = 0; i < graph->length; i++) {
+        if (graph->jobs[i].pending_deps == 0) {
+            heap_push(&ready, graph, i);
+        }
+    }
+
+    while (running_len > 0 || (result && ready.length > 0)) {
+        while (result && ready.length > 0 && running_len < max_jobs) {
+            size_t index = heap_pop(&ready, graph);
+            RunningJob *slot = &running[running_len];
+            slot->job = index;
+            slot->lane = 0;
+            while (lane_busy[slot->lane]) slot->lane++;
+            lane_busy[slot->lane] = true;
+            if (!start_job(&graph->jobs[index], slot, &child_mask)) {
+                result = false;
+                break;
+            }
+            running_len++;
+        }
+
+        if (running_len == 0) {
+            break;
+        }
+
+        int status;
+        struct rusage usage = {0};
+        int slot = reap_job(running, running_len, &status, &usage);
+        if (slot == -1) {
+            sigsuspend(&wait_mask);
+            continue;
+        }
+
+        size_t index = running[slot].job;
+        Job *job = &graph->jobs[index];
+        job->duration_ns = monotonic_ns() - running[slot].start_ns;
+        job->cpu_ns = timeval_ns(usage.ru_utime) + timeval_ns(usage.ru_stime);
+#ifdef __APPLE__
+        job->peak_rss = (uint64_t)usage.ru_maxrss;
+#else
+        job->peak_rss = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+        lane_busy[running[slot].lane] = false;
+        running[slot] = running[--running_len];
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            job->failed = true;
+            result = false;
+            continue;
+        }
+
+        job->done = true;
+        for (size_t i = 0; i < job->dependents_len; i++) {
+            Job *dependent = &graph->jobs[job->dependents[i]];
+            if (--dependent->pending_deps == 0) {
+                heap_push(&ready, graph, job->dependents[i]);
+            }
+        }
+    }
+
+    sigaction(SIGCHLD, &old_action, NULL);
+    sigprocmask(SIG_SETMASK, &child_mask, NULL);
+
+    free(ready.items);
+    free(running);
+    free(lane_busy);
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs inside a forked child. The return value becomes its exit code.
+typedef int (*JobFunc)(void *ctx);
+
+typedef struct Job {
+	StrList argv;
+	JobFunc func;             // Run instead of `argv` when set.
+	void *ctx;
+	char *label;              // Printed when the job starts. May be NULL.
+	int64_t cost;             // Estimated run time. Only used for ordering.
+
+	size_t *dependents;
+	size_t dependents_len;
+	size_t dependents_cap;
+	size_t pending_deps;
+
+	int64_t priority;         // Cost of the longest chain of jobs starting at this one.
+	int64_t start_ns;         // Filled in once the job has started.
+	int lane;                 // Worker slot the job ran in, from 0 to `max_jobs` - 1.
+	int64_t duration_ns;      // Filled in once the job has finished.
+	int64_t cpu_ns;           // User + system time of the job and the processes it waited for.
+	uint64_t peak_rss;        // In bytes.
+	bool done;
+	bool failed;
+} Job;
+
+typedef struct JobGraph {
+	Job *jobs;
+	size_t length;
+	size_t capacity;
+} JobGraph;
+
+// Adds a job that runs `argv` and returns its index. Takes ownership of
+// `argv` and `label`.
+size_t jobs_add(JobGraph *graph, StrList argv, char *label, int64_t cost);
+
+// Adds a job that runs `func(ctx)` in a child process. `ctx` must outlive
+// `jobs_run`.
+size_t jobs_add_func(JobGraph *graph, JobFunc func, void *ctx, char *label, int64_t cost);
+
+// Makes `job` wait for `dependency` to finish successfully.
+void jobs_add_dep(JobGraph *graph, size_t job, size_t dependency);
+
+// Runs every job with at most `max_jobs` running at once. Ready jobs on the
+// longest remaining chain are started first, so jobs that gate others (and
+// slow translation units) don't end up as stragglers at the end of a build.
+// Stops starting new jobs after the first failure.
+bool jobs_run(JobGraph *graph, int max_jobs);
+
+void jobs_free(JobGraph *graph);
+
+int jobs_default_count(void);
+
+#endif // _JOBS_H_
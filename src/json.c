@@ -0,0 +1,281 @@
+#include "json.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Deeper documents than this are rejected instead of overflowing the stack.
+#define MAX_DEPTH (256)
+
+typedef struct Parser {
+    const char *c;
+    const char *end;
+    int depth;
+} Parser;
+
+static bool parse_value(Parser *p, JsonValue *out);
+
+static void skip_space(Parser *p) {
+    while (p->c < p->end && (*p->c == ' ' || *p->c == '\t' || *p->c == '\n' || *p->c == '\r')) {
+        p->c++;
+    }
+}
+
+static bool eat(Parser *p, char c) {
+    skip_space(p);
+    if (p->c < p->end && *p->c == c) {
+        p->c++;
+        return true;
+    }
+    return false;
+}
+
+static bool eat_word(Parser *p, const char *word) {
+    size_t len = strlen(word);
+    if ((size_t)(p->end - p->c) >= len && memcmp(p->c, word, len) == 0) {
+        p->c += len;
+        return true;
+    }
+    return false;
+}
+
+static void append_utf8(StrBuf *buf, unsigned long cp) {
+    char bytes[4];
+    size_t len;
+    if (cp < 0x80) {
+        bytes[0] = (char)cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        bytes[0] = (char)(0xC0 | (cp >> 6));
+        bytes[1] = (char)(0x80 | (cp & 0x3F));
+        len = 2;
+    } else if (cp < 0x10000) {
+        bytes[0] = (char)(0xE0 | (cp >> 12));
+        bytes[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (cp & 0x3F));
+        len = 3;
+    } else {
+        bytes[0] = (char)(0xF0 | (cp >> 18));
+        bytes[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (cp & 0x3F));
+        len = 4;
+    }
+    strbuf_append_len(buf, bytes, len);
+}
+
+static bool parse_hex4(Parser *p, unsigned long *out) {
+    if (p->end - p->c < 4) {
+        return false;
+    }
+
+    char hex[5] = {0};
+    memcpy(hex, p->c, 4);
+    char *end;
+    *out = strtoul(hex, &end, 16);
+    p->c += 4;
+    return *end == '\0';
+}
+
+static bool parse_string(Parser *p, char **out) {
+    if (!eat(p, '"')) {
+        return false;
+    }
+
+    StrBuf buf = {0};
+    strbuf_append(&buf, "");
+
+    while (p->c < p->end && *p->c != '"') {
+        const char *run = p->c;
+        while (p->c < p->end && *p->c != '"' && *p->c != '\\') p->c++;
+        strbuf_append_len(&buf, run, (size_t)(p->c - run));
+
+        if (p->c < p->end && *p->c == '\\') {
+            p->c++;
+            if (p->c >= p->end) break;
+
+            char e = *p->c++;
+            switch (e) {
+                case '"':  strbuf_append(&buf, "\""); break;
+                case '\\': strbuf_append(&buf, "\\"); break;
+                case '/':  strbuf_append(&buf, "/"); break;
+                case 'b':  strbuf_append(&buf, "\b"); break;
+                case 'f':  strbuf_append(&buf, "\f"); break;
+                case 'n':  strbuf_append(&buf, "\n"); break;
+                case 'r':  strbuf_append(&buf, "\r"); break;
+                case 't':  strbuf_append(&buf, "\t"); break;
+                case 'u': {
+                    unsigned long cp;
+                    if (!parse_hex4(p, &cp)) {
+                        strbuf_free(&buf);
+                        return false;
+                    }
+                    // Surrogate pair.
+                    if (cp >= 0xD800 && cp < 0xDC00 && eat_word(p, "\\u")) {
+                        unsigned long low;
+                        if (!parse_hex4(p, &low)) {
+                            strbuf_free(&buf);
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    append_utf8(&buf, cp);
+                } break;
+                default:
+                    strbuf_free(&buf);
+                    return false;
+            }
+        }
+    }
+
+    if (p->c >= p->end) {
+        strbuf_free(&buf);
+        return false;
+    }
+    p->c++; // closing quote
+
+    // Documents can have lots of short strings. Don't keep the slack.
+    *out = realloc(buf.bytes, buf.length + 1);
+    return true;
+}
+
+static void push_item(JsonValue *container, size_t *capacity) {
+    if (container->length == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 8;
+        container->items = realloc(container->items, *capacity * sizeof(*container->items));
+        if (container->type == JSON_OBJECT) {
+            container->keys = realloc(container->keys, *capacity * sizeof(*container->keys));
+        }
+    }
+    container->items[container->length] = (JsonValue){0};
+    if (container->type == JSON_OBJECT) {
+        container->keys[container->length] = NULL;
+    }
+    container->length++;
+}
+
+static bool parse_container(Parser *p, JsonValue *out, char close) {
+    if (++p->depth > MAX_DEPTH) {
+        return false;
+    }
+
+    size_t capacity = 0;
+    if (eat(p, close)) {
+        p->depth--;
+        return true;
+    }
+
+    do {
+        push_item(out, &capacity);
+        size_t i = out->length - 1;
+
+        if (out->type == JSON_OBJECT) {
+            skip_space(p);
+            if (!parse_string(p, &out->keys[i]) || !eat(p, ':')) {
+                return false;
+            }
+        }
+
+        if (!parse_value(p, &out->items[i])) {
+            return false;
+        }
+    } while (eat(p, ','));
+
+    p->depth--;
+    return eat(p, close);
+}
+
+static bool parse_value(Parser *p, JsonValue *out) {
+    *out = (JsonValue){0};
+    skip_space(p);
+    if (p->c >= p->end) {
+        return false;
+    }
+
+    switch (*p->c) {
+        case '{':
+            p->c++;
+            out->type = JSON_OBJECT;
+            return parse_container(p, out, '}');
+        case '[':
+            p->c++;
+            out->type = JSON_ARRAY;
+            return parse_container(p, out, ']');
+        case '"':
+            out->type = JSON_STRING;
+            return parse_string(p, &out->string);
+        case 't':
+            out->type = JSON_BOOL;
+            out->boolean = true;
+            return eat_word(p, "true");
+        case 'f':
+            out->type = JSON_BOOL;
+            return eat_word(p, "false");
+        case 'n':
+            return eat_word(p, "null");
+        default: {
+            // strtod needs a terminated string, and the text might not be.
+            char num[64];
+            size_t len = 0;
+            while (p->c + len < p->end && len + 1 < sizeof(num) && strchr("+-0123456789.eE", p->c[len])) {
+                num[len] = p->c[len];
+                len++;
+            }
+            num[len] = '\0';
+
+            char *end;
+            out->type = JSON_NUMBER;
+            out->number = strtod(num, &end);
+            p->c += len;
+            return len > 0 && *end == '\0';
+        }
+    }
+}
+
+bool json_parse(const char *text, size_t length, JsonValue *out) {
+    Parser p = { .c = text, .end = text + length };
+    if (!parse_value(&p, out)) {
+        json_free(out);
+        return false;
+    }
+
+    skip_space(&p);
+    if (p.c != p.end) {
+        json_free(out);
+        return false;
+    }
+
+    return true;
+}
+
+void json_free(JsonValue *value) {
+    for (size_t i = 0; i < value->length; i++) {
+        json_free(&value->items[i]);
+        if (value->keys) free(value->keys[i]);
+    }
+    free(value->items);
+    free(value->keys);
+    free(value->string);
+    *value = (JsonValue){0};
+}
+
+const JsonValue *json_get(const JsonValue *object, const char *key) {
+    if (!object || object->type != JSON_OBJECT) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < object->length; i++) {
+        if (object->keys[i] && strcmp(object->keys[i], key) == 0) {
+            return &object->items[i];
+        }
+    }
+    return NULL;
+}
+
+double json_number(const JsonValue *value, double fallback) {
+    return value && value->type == JSON_NUMBER ? value->number : fallback;
+}
+
+const char *json_string(const JsonValue *value, const char *fallback) {
+    return value && value->type == JSON_STRING ? value->string : fallback;
+}
@@ -0,0 +1,40 @@
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum JsonType {
+	JSON_NULL,
+	JSON_BOOL,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT
+} JsonType;
+
+// A parsed JSON document. Arrays and objects own their `items`; objects
+// also have one key per item.
+typedef struct JsonValue {
+	JsonType type;
+	bool boolean;
+	double number;
+	char *string;
+	struct JsonValue *items;
+	char **keys;
+	size_t length;
+} JsonValue;
+
+bool json_parse(const char *text, size_t length, JsonValue *out);
+void json_free(JsonValue *value);
+
+// Returns the member called `key`, or NULL if `object` isn't an object or
+// has no such member.
+const JsonValue *json_get(const JsonValue *object, const char *key);
+
+// Shorthands that return `fallback` when the value is missing or has the
+// wrong type.
+double json_number(const JsonValue *value, double fallback);
+const char *json_string(const JsonValue *value, const char *fallback);
+
+#endif // _JSON_H_
@@ -0,0 +1,157 @@
+#include "layout.h"
+#include "sampler.h"
+#include "symbols.h"
+#include "trace.h"
+#include "train.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+#define LAYOUT_SYMBOL_ORDER LAYOUT_DIR"/symbol-order.txt"
+#define LAYOUT_SECTION_ORDER LAYOUT_DIR"/section-order.txt" // For gold, which orders sections instead.
+#define LAYOUT_FINGERPRINT LAYOUT_DIR"/fingerprint"     // What the order was recorded from.
+
+static int compare_samples(const void *a, const void *b) {
+    const Symbol *x = a;
+    const Symbol *y = b;
+    if (x->samples != y->samples) {
+        return x->samples < y->samples ? 1 : -1;
+    }
+    return symbols_compare_addrs(a, b);
+}
+
+// Runs the training workload with the sampler loaded.
+static bool sample_training_run(const ProjConf *proj, const StrList *train_args, const char *exe) {
+    if (!sampler_begin(exe, SAMPLER_DEFAULT_HZ)) {
+        return false;
+    }
+    bool ok = train_run(proj, train_args);
+    sampler_end();
+    return ok;
+}
+
+// Writes the sampled functions from hottest to coldest. Functions that were
+// never sampled are left where the linker puts them, after the hot ones.
+static bool write_order(const char *exe) {
+    int64_t start = monotonic_ns();
+
+    SymbolTable table = {0};
+    if (!symbols_read(exe, false, &table)) {
+        return false;
+    }
+
+    size_t total;
+    if (!sampler_count_self(&table, &total)) {
+        symbols_free(&table);
+        return false;
+    }
+    if (total == 0) {
+        logprint(LOG_ERROR, "Training run didn't record any samples. It may have been too short.");
+        symbols_free(&table);
+        return false;
+    }
+
+    qsort(table.items, table.length, sizeof(*table.items), compare_samples);
+
+    StrBuf symbols = {0};
+    StrBuf sections = {0};
+    size_t hot = 0;
+    for (; hot < table.length && table.items[hot].samples > 0; hot++) {
+        strbuf_appendf(&symbols, "%s\n", table.items[hot].name);
+        // gold only takes exact section names, and GCC moves some functions
+        // to .text.hot.* or .text.startup.*.
+        const char *name = table.items[hot].name;
+        strbuf_appendf(&sections, ".text.%s\n.text.hot.%s\n.text.startup.%s\n", name, name, name);
+    }
+
+    bool ok = write_file_if_changed(LAYOUT_SYMBOL_ORDER, symbols.bytes, symbols.length) &&
+              write_file_if_changed(LAYOUT_SECTION_ORDER, sections.bytes, sections.length);
+    if (ok) {
+        logprint(LOG_INFO, "Ordered %zu hot functions from %zu samples. The hottest is %s.", hot, total, table.items[0].name);
+    }
+
+    strbuf_free(&symbols);
+    strbuf_free(&sections);
+    symbols_free(&table);
+    trace_add("Order functions", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+    return ok;
+}
+
+static bool build_release(const ProjConf *proj, const BuildOptions *opts, Linker linker, bool ordered) {
+    BuildConfig config;
+    if (!build_config_init(&config, proj, "release")) {
+        return false;
+    }
+
+    // Each function gets its own section, which the linker can then place
+    // anywhere.
+    strlist_push(&config.cflags, "-ffunction-sections");
+
+    if (ordered) {
+#ifdef __APPLE__
+        UNUSED(linker);
+        strlist_push(&config.ldflags, "-Wl,-order_file,"LAYOUT_SYMBOL_ORDER);
+#else
+        if (linker == LINKER_GOLD) {
+            strlist_push(&config.ldflags, "-Wl,--section-ordering-file="LAYOUT_SECTION_ORDER);
+        } else {
+            strlist_push(&config.ldflags, "-Wl,--symbol-ordering-file="LAYOUT_SYMBOL_ORDER);
+        }
+        if (linker == LINKER_LLD) {
+            // Functions that were inlined or renamed since the order was
+            // recorded are expected.
+            strlist_push(&config.ldflags, "-Wl,--no-warn-symbol-ordering");
+        }
+#endif
+    }
+
+    bool ok = build_project(proj, &config, 1, opts);
+    build_config_free(&config);
+    return ok;
+}
+
+bool layout_build(const ProjConf *proj, const BuildOptions *opts, const StrList *train_args) {
+    Linker linker = opts->linker ? opts->linker : proj->linker;
+#ifndef __APPLE__
+    if (linker <= LINKER_DEFAULT) {
+        logprint(LOG_ERROR, "`--layout` needs a linker that can order functions. Use `--linker` or the `linker` setting to pick lld, mold or gold.");
+        return false;
+    }
+#endif
+
+    char exe_path[PATH_MAX];
+    snprintf(exe_path, sizeof(exe_path), "%s/release/%s", proj->out_dir, proj->exe_name);
+
+    StrBuf fingerprint = {0};
+    train_fingerprint(&fingerprint, proj, train_args);
+
+    char *old = read_file(LAYOUT_FINGERPRINT, NULL);
+    bool have_order = access(LAYOUT_SYMBOL_ORDER, F_OK) == 0;
+    bool fresh = old && have_order && train_profile_fresh(old, fingerprint.bytes);
+    free(old);
+
+    bool ok = true;
+    if (!fresh) {
+        logprint(LOG_INFO, "%s. Sampling a training run to order functions.",
+            have_order ? "Sources or training run changed too much since the last function order" : "No function order yet");
+
+        unlink(LAYOUT_FINGERPRINT);
+
+        // The order is recorded from an unordered build, so switching to
+        // the new one below relinks.
+        ok = make_dirs(LAYOUT_DIR) &&
+             build_release(proj, opts, linker, false) &&
+             sample_training_run(proj, train_args, exe_path) &&
+             write_order(exe_path) &&
+             write_file_if_changed(LAYOUT_FINGERPRINT, fingerprint.bytes, fingerprint.length);
+    }
+
+    ok = ok && build_release(proj, opts, linker, true);
+
+    strbuf_free(&fingerprint);
+    return ok;
+}
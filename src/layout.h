@@ -0,0 +1,18 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include "builder.h"
+#include "conf.h"
+#include "utils.h"
+
+#include <stdbool.h>
+
+#define LAYOUT_DIR BUILDX_DIR"/layout"
+
+// Builds the release configuration with its hottest functions packed
+// together. Which functions are hot is sampled from a run of the executable
+// with `train_args` (or the project's `pgo_train` setting), and sampled again
+// once the sources drift too far from the ones it was recorded with.
+bool layout_build(const ProjConf *proj, const BuildOptions *opts, const StrList *train_args);
+
+#endif // _LAYOUT_H_
@@ -0,0 +1,692 @@
+#include "locks.h"
+#include "inject.h"
+#include "symbols.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCKS_TOP_LOCKS 10
+#define LOCKS_TOP_SITES 15
+#define LOCKS_TOP_CONDS 5
+
+// Longer than the 4095 characters ISO C guarantees, which GCC and clang allow.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverlength-strings"
+static const char tracker_source[] =
+    "// Loaded into programs by `bx run --locks`. Wraps pthread mutexes, rwlocks\n"
+    "// and condition variables to measure how long threads wait for each lock\n"
+    "// and hold it, split by the call site in the executable that took it. When\n"
+    "// the program exits, writes the totals for bx to report.\n"
+    "#define _GNU_SOURCE\n"
+    "#include \"bx_inject.h\"\n"
+    "#include <dlfcn.h>\n"
+    "#include <pthread.h>\n"
+    "#include <stdio.h>\n"
+    "#include <time.h>\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "#define MAX_LOCKS 8192          // Power of two.\n"
+    "#define MAX_SITES 8192          // Power of two.\n"
+    "#define UNKNOWN_SITE UINTPTR_MAX\n"
+    "\n"
+    "enum { KIND_MUTEX, KIND_RWLOCK, KIND_COND };\n"
+    "\n"
+    "typedef struct Site {\n"
+    "    int ready;\n"
+    "    int kind;\n"
+    "    uintptr_t lock;\n"
+    "    uintptr_t pc;\n"
+    "    uint64_t count;\n"
+    "    uint64_t contended;\n"
+    "    uint64_t wait_ns;\n"
+    "    uint64_t max_wait_ns;\n"
+    "    uint64_t hold_ns;\n"
+    "    uint64_t max_hold_ns;\n"
+    "} Site;\n"
+    "\n"
+    "// Who holds a lock exclusively and since when. Only the holder writes it.\n"
+    "typedef struct Held {\n"
+    "    uintptr_t lock;\n"
+    "    uintptr_t owner;\n"
+    "    int depth;              // Recursive mutexes are held until the last unlock.\n"
+    "    uint64_t since;\n"
+    "    Site *site;\n"
+    "} Held;\n"
+    "\n"
+    "static int enabled;\n"
+    "static pid_t tracking_pid;\n"
+    "static Site sites[MAX_SITES];\n"
+    "static Held held[MAX_LOCKS];\n"
+    "static int inserting;\n"
+    "static uint64_t dropped;\n"
+    "static uint64_t untimed;    // Acquisitions of locks past the first MAX_LOCKS.\n"
+    "\n"
+    "#ifdef __APPLE__\n"
+    "// dyld swaps these in for every call to the originals outside this library.\n"
+    "#define HOOK(name) bx_##name\n"
+    "#define REAL(name) name\n"
+    "#define RESOLVE(name)\n"
+    "#else\n"
+    "#define HOOK(name) name\n"
+    "#define REAL(name) real_##name\n"
+    "#define RESOLVE(name) if (!real_##name) resolve()\n"
+    "\n"
+    "static int (*real_pthread_mutex_lock)(pthread_mutex_t *);\n"
+    "static int (*real_pthread_mutex_trylock)(pthread_mutex_t *);\n"
+    "static int (*real_pthread_mutex_unlock)(pthread_mutex_t *);\n"
+    "static int (*real_pthread_rwlock_rdlock)(pthread_rwlock_t *);\n"
+    "static int (*real_pthread_rwlock_wrlock)(pthread_rwlock_t *);\n"
+    "static int (*real_pthread_rwlock_tryrdlock)(pthread_rwlock_t *);\n"
+    "static int (*real_pthread_rwlock_trywrlock)(pthread_rwlock_t *);\n"
+    "static int (*real_pthread_rwlock_unlock)(pthread_rwlock_t *);\n"
+    "static int (*real_pthread_cond_wait)(pthread_cond_t *, pthread_mutex_t *);\n"
+    "static int (*real_pthread_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);\n"
+    "\n"
+    "static void *find_real(const char *name) {\n"
+    "#if defined(__GLIBC__) && defined(__x86_64__)\n"
+    "    // dlsym finds the old LinuxThreads condition variables otherwise.\n"
+    "    void *versioned = dlvsym(RTLD_NEXT, name, \"GLIBC_2.3.2\");\n"
+    "    if (versioned) {\n"
+    "        return versioned;\n"
+    "    }\n"
+    "#endif\n"
+    "    return dlsym(RTLD_NEXT, name);\n"
+    "}\n"
+    "\n"
+    "static void resolve(void) {\n"
+    "    real_pthread_mutex_lock = find_real(\"pthread_mutex_lock\");\n"
+    "    real_pthread_mutex_trylock = find_real(\"pthread_mutex_trylock\");\n"
+    "    real_pthread_mutex_unlock = find_real(\"pthread_mutex_unlock\");\n"
+    "    real_pthread_rwlock_rdlock = find_real(\"pthread_rwlock_rdlock\");\n"
+    "    real_pthread_rwlock_wrlock = find_real(\"pthread_rwlock_wrlock\");\n"
+    "    real_pthread_rwlock_tryrdlock = find_real(\"pthread_rwlock_tryrdlock\");\n"
+    "    real_pthread_rwlock_trywrlock = find_real(\"pthread_rwlock_trywrlock\");\n"
+    "    real_pthread_rwlock_unlock = find_real(\"pthread_rwlock_unlock\");\n"
+    "    real_pthread_cond_wait = find_real(\"pthread_cond_wait\");\n"
+    "    real_pthread_cond_timedwait = find_real(\"pthread_cond_timedwait\");\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "static uint64_t now_ns(void) {\n"
+    "    struct timespec ts;\n"
+    "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+    "    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;\n"
+    "}\n"
+    "\n"
+    "static void add_max(uint64_t *max, uint64_t value) {\n"
+    "    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);\n"
+    "    while (value > old && !__atomic_compare_exchange_n(max, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static size_t hash(uintptr_t a, uintptr_t b) {\n"
+    "    return (size_t)(((a >> 3) ^ (b * 31)) * 0x9e3779b97f4a7c15ull);\n"
+    "}\n"
+    "\n"
+    "static Site *find_site(int kind, uintptr_t lock, uintptr_t pc) {\n"
+    "    pc = pc ? pc - slide : UNKNOWN_SITE;\n"
+    "    size_t h = hash(lock, pc);\n"
+    "    for (size_t i = 0; i < MAX_SITES; i++) {\n"
+    "        Site *site = &sites[(h + i) & (MAX_SITES - 1)];\n"
+    "        if (!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE)) {\n"
+    "            // Claiming a slot takes two words, so claims are serialized.\n"
+    "            while (__atomic_test_and_set(&inserting, __ATOMIC_ACQUIRE)) {\n"
+    "            }\n"
+    "            if (!site->ready) {\n"
+    "                site->kind = kind;\n"
+    "                site->lock = lock;\n"
+    "                site->pc = pc;\n"
+    "                __atomic_store_n(&site->ready, 1, __ATOMIC_RELEASE);\n"
+    "            }\n"
+    "            __atomic_clear(&inserting, __ATOMIC_RELEASE);\n"
+    "        }\n"
+    "        if (site->lock == lock && site->pc == pc) {\n"
+    "            return site;\n"
+    "        }\n"
+    "    }\n"
+    "    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);\n"
+    "    return NULL;\n"
+    "}\n"
+    "\n"
+    "static Held *find_held(uintptr_t lock) {\n"
+    "    size_t h = hash(lock, 0);\n"
+    "    for (size_t i = 0; i < MAX_LOCKS; i++) {\n"
+    "        Held *entry = &held[(h + i) & (MAX_LOCKS - 1)];\n"
+    "        uintptr_t expected = 0;\n"
+    "        if (__atomic_load_n(&entry->lock, __ATOMIC_RELAXED) == lock ||\n"
+    "            __atomic_compare_exchange_n(&entry->lock, &expected, lock, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||\n"
+    "            expected == lock)\n"
+    "        {\n"
+    "            return entry;\n"
+    "        }\n"
+    "    }\n"
+    "    return NULL;\n"
+    "}\n"
+    "\n"
+    "// Called once the lock is taken. `start` is when the caller asked for it, or\n"
+    "// 0 if it was free.\n"
+    "static void acquired(int kind, void *lock, uintptr_t pc, uint64_t start, int exclusive) {\n"
+    "    if (!enabled) {\n"
+    "        return;\n"
+    "    }\n"
+    "    uint64_t now = now_ns();\n"
+    "\n"
+    "    Site *site = find_site(kind, (uintptr_t)lock, pc);\n"
+    "    if (site) {\n"
+    "        __atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);\n"
+    "        if (start) {\n"
+    "            __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);\n"
+    "            __atomic_fetch_add(&site->wait_ns, now - start, __ATOMIC_RELAXED);\n"
+    "            add_max(&site->max_wait_ns, now - start);\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    if (!exclusive) {\n"
+    "        return;\n"
+    "    }\n"
+    "    // Slots aren't given back when a lock is destroyed, so programs that\n"
+    "    // make many short-lived locks run out.\n"
+    "    Held *entry = find_held((uintptr_t)lock);\n"
+    "    if (!entry) {\n"
+    "        __atomic_fetch_add(&untimed, 1, __ATOMIC_RELAXED);\n"
+    "        return;\n"
+    "    }\n"
+    "    uintptr_t self = (uintptr_t)pthread_self();\n"
+    "    if (entry->depth > 0 && entry->owner == self) {\n"
+    "        entry->depth++;\n"
+    "        return;\n"
+    "    }\n"
+    "    entry->owner = self;\n"
+    "    entry->depth = 1;\n"
+    "    entry->since = now;\n"
+    "    entry->site = site;\n"
+    "}\n"
+    "\n"
+    "// Called just before the lock is let go.\n"
+    "static void releasing(void *lock) {\n"
+    "    if (!enabled) {\n"
+    "        return;\n"
+    "    }\n"
+    "    Held *entry = find_held((uintptr_t)lock);\n"
+    "    // Readers of rwlocks aren't tracked.\n"
+    "    if (!entry || entry->depth == 0 || entry->owner != (uintptr_t)pthread_self()) {\n"
+    "        return;\n"
+    "    }\n"
+    "    if (--entry->depth > 0) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    Site *site = entry->site;\n"
+    "    entry->owner = 0;\n"
+    "    if (site) {\n"
+    "        uint64_t hold = now_ns() - entry->since;\n"
+    "        __atomic_fetch_add(&site->hold_ns, hold, __ATOMIC_RELAXED);\n"
+    "        add_max(&site->max_hold_ns, hold);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_mutex_lock)(pthread_mutex_t *mutex) {\n"
+    "    RESOLVE(pthread_mutex_lock);\n"
+    "    uintptr_t pc = CALL_SITE();\n"
+    "    // Only locks that are already taken are waited for.\n"
+    "    if (REAL(pthread_mutex_trylock)(mutex) == 0) {\n"
+    "        acquired(KIND_MUTEX, mutex, pc, 0, 1);\n"
+    "        return 0;\n"
+    "    }\n"
+    "    uint64_t start = now_ns();\n"
+    "    int err = REAL(pthread_mutex_lock)(mutex);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_MUTEX, mutex, pc, start, 1);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_mutex_trylock)(pthread_mutex_t *mutex) {\n"
+    "    RESOLVE(pthread_mutex_trylock);\n"
+    "    int err = REAL(pthread_mutex_trylock)(mutex);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_MUTEX, mutex, CALL_SITE(), 0, 1);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_mutex_unlock)(pthread_mutex_t *mutex) {\n"
+    "    RESOLVE(pthread_mutex_unlock);\n"
+    "    releasing(mutex);\n"
+    "    return REAL(pthread_mutex_unlock)(mutex);\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_rwlock_rdlock)(pthread_rwlock_t *rwlock) {\n"
+    "    RESOLVE(pthread_rwlock_rdlock);\n"
+    "    uintptr_t pc = CALL_SITE();\n"
+    "    if (REAL(pthread_rwlock_tryrdlock)(rwlock) == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, pc, 0, 0);\n"
+    "        return 0;\n"
+    "    }\n"
+    "    uint64_t start = now_ns();\n"
+    "    int err = REAL(pthread_rwlock_rdlock)(rwlock);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, pc, start, 0);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_rwlock_wrlock)(pthread_rwlock_t *rwlock) {\n"
+    "    RESOLVE(pthread_rwlock_wrlock);\n"
+    "    uintptr_t pc = CALL_SITE();\n"
+    "    if (REAL(pthread_rwlock_trywrlock)(rwlock) == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, pc, 0, 1);\n"
+    "        return 0;\n"
+    "    }\n"
+    "    uint64_t start = now_ns();\n"
+    "    int err = REAL(pthread_rwlock_wrlock)(rwlock);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, pc, start, 1);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_rwlock_tryrdlock)(pthread_rwlock_t *rwlock) {\n"
+    "    RESOLVE(pthread_rwlock_tryrdlock);\n"
+    "    int err = REAL(pthread_rwlock_tryrdlock)(rwlock);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, CALL_SITE(), 0, 0);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_rwlock_trywrlock)(pthread_rwlock_t *rwlock) {\n"
+    "    RESOLVE(pthread_rwlock_trywrlock);\n"
+    "    int err = REAL(pthread_rwlock_trywrlock)(rwlock);\n"
+    "    if (err == 0) {\n"
+    "        acquired(KIND_RWLOCK, rwlock, CALL_SITE(), 0, 1);\n"
+    "    }\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_rwlock_unlock)(pthread_rwlock_t *rwlock) {\n"
+    "    RESOLVE(pthread_rwlock_unlock);\n"
+    "    releasing(rwlock);\n"
+    "    return REAL(pthread_rwlock_unlock)(rwlock);\n"
+    "}\n"
+    "\n"
+    "// Waiting on a condition lets go of the mutex and takes it again after.\n"
+    "// Time spent waiting is counted against the condition variable, not the\n"
+    "// mutex.\n"
+    "int HOOK(pthread_cond_wait)(pthread_cond_t *cond, pthread_mutex_t *mutex) {\n"
+    "    RESOLVE(pthread_cond_wait);\n"
+    "    uintptr_t pc = CALL_SITE();\n"
+    "    releasing(mutex);\n"
+    "    uint64_t start = now_ns();\n"
+    "    int err = REAL(pthread_cond_wait)(cond, mutex);\n"
+    "    acquired(KIND_COND, cond, pc, start, 0);\n"
+    "    acquired(KIND_MUTEX, mutex, pc, 0, 1);\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "int HOOK(pthread_cond_timedwait)(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {\n"
+    "    RESOLVE(pthread_cond_timedwait);\n"
+    "    uintptr_t pc = CALL_SITE();\n"
+    "    releasing(mutex);\n"
+    "    uint64_t start = now_ns();\n"
+    "    int err = REAL(pthread_cond_timedwait)(cond, mutex, abstime);\n"
+    "    acquired(KIND_COND, cond, pc, start, 0);\n"
+    "    acquired(KIND_MUTEX, mutex, pc, 0, 1);\n"
+    "    return err;\n"
+    "}\n"
+    "\n"
+    "#ifdef __APPLE__\n"
+    "static const struct {\n"
+    "    const void *replacement;\n"
+    "    const void *original;\n"
+    "} interposers[] __attribute__((used, section(\"__DATA,__interpose\"))) = {\n"
+    "    { (const void *)bx_pthread_mutex_lock, (const void *)pthread_mutex_lock },\n"
+    "    { (const void *)bx_pthread_mutex_trylock, (const void *)pthread_mutex_trylock },\n"
+    "    { (const void *)bx_pthread_mutex_unlock, (const void *)pthread_mutex_unlock },\n"
+    "    { (const void *)bx_pthread_rwlock_rdlock, (const void *)pthread_rwlock_rdlock },\n"
+    "    { (const void *)bx_pthread_rwlock_wrlock, (const void *)pthread_rwlock_wrlock },\n"
+    "    { (const void *)bx_pthread_rwlock_tryrdlock, (const void *)pthread_rwlock_tryrdlock },\n"
+    "    { (const void *)bx_pthread_rwlock_trywrlock, (const void *)pthread_rwlock_trywrlock },\n"
+    "    { (const void *)bx_pthread_rwlock_unlock, (const void *)pthread_rwlock_unlock },\n"
+    "    { (const void *)bx_pthread_cond_wait, (const void *)pthread_cond_wait },\n"
+    "    { (const void *)bx_pthread_cond_timedwait, (const void *)pthread_cond_timedwait },\n"
+    "};\n"
+    "#endif\n"
+    "\n"
+    "__attribute__((constructor))\n"
+    "static void start_tracking(void) {\n"
+    "#ifndef __APPLE__\n"
+    "    resolve();\n"
+    "#endif\n"
+    "    if (!is_target()) {\n"
+    "        return;\n"
+    "    }\n"
+    "    tracking_pid = getpid();\n"
+    "    enabled = 1;\n"
+    "}\n"
+    "\n"
+    "__attribute__((destructor))\n"
+    "static void write_totals(void) {\n"
+    "    // Forked children inherit the counts.\n"
+    "    if (!enabled || tracking_pid != getpid()) {\n"
+    "        return;\n"
+    "    }\n"
+    "    enabled = 0;\n"
+    "\n"
+    "    char path[PATH_MAX];\n"
+    "    results_path(path, sizeof(path), tracking_pid, \".locks\");\n"
+    "    FILE *f = fopen(path, \"w\");\n"
+    "    if (!f) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    static const char *kinds[] = { \"mutex\", \"rwlock\", \"cond\" };\n"
+    "    fprintf(f, \"dropped %llu\\n\", (unsigned long long)dropped);\n"
+    "    fprintf(f, \"untimed %llu\\n\", (unsigned long long)untimed);\n"
+    "    for (size_t i = 0; i < MAX_SITES; i++) {\n"
+    "        const Site *site = &sites[i];\n"
+    "        if (!site->ready || site->count == 0) {\n"
+    "            continue;\n"
+    "        }\n"
+    "        fprintf(f, \"%s 0x%lx \", kinds[site->kind], (unsigned long)site->lock);\n"
+    "        if (site->pc == UNKNOWN_SITE) {\n"
+    "            fprintf(f, \"?\");\n"
+    "        } else {\n"
+    "            fprintf(f, \"0x%lx\", (unsigned long)site->pc);\n"
+    "        }\n"
+    "        fprintf(f, \" %llu %llu %llu %llu %llu %llu\\n\",\n"
+    "            (unsigned long long)site->count,\n"
+    "            (unsigned long long)site->contended,\n"
+    "            (unsigned long long)site->wait_ns,\n"
+    "            (unsigned long long)site->max_wait_ns,\n"
+    "            (unsigned long long)site->hold_ns,\n"
+    "            (unsigned long long)site->max_hold_ns);\n"
+    "    }\n"
+    "    fclose(f);\n"
+    "}\n";
+#pragma GCC diagnostic pop
+
+static const InjectLib tracker = {
+    .name = "lock_tracker",
+    .source = tracker_source,
+    .dir = LOCKS_DIR,
+    .suffix = ".locks",
+    .records = "locks",
+};
+
+typedef struct LockStats {
+    char kind[8];           // mutex, rwlock or cond.
+    uint64_t lock;
+    uint64_t pc;
+    bool known;             // Unknown sites are in other libraries.
+    uint64_t count;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+    size_t rank;            // Of the lock, by time waited.
+} LockStats;
+
+typedef struct LockStatsList {
+    LockStats *items;
+    size_t length;
+    size_t capacity;
+} LockStatsList;
+
+static void push_stats(LockStatsList *list, const LockStats *stats) {
+    if (list->length == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(*list->items));
+    }
+    list->items[list->length++] = *stats;
+}
+
+// Adds `stats` to the entry for the same lock, and call site if `by_site`,
+// or starts a new one.
+static void merge_stats(LockStatsList *list, const LockStats *stats, bool by_site) {
+    for (size_t i = 0; i < list->length; i++) {
+        LockStats *other = &list->items[i];
+        if (other->lock != stats->lock || strcmp(other->kind, stats->kind) != 0 ||
+            (by_site && (other->known != stats->known || other->pc != stats->pc)))
+        {
+            continue;
+        }
+        other->count += stats->count;
+        other->contended += stats->contended;
+        other->wait_ns += stats->wait_ns;
+        other->hold_ns += stats->hold_ns;
+        other->max_wait_ns = stats->max_wait_ns > other->max_wait_ns ? stats->max_wait_ns : other->max_wait_ns;
+        other->max_hold_ns = stats->max_hold_ns > other->max_hold_ns ? stats->max_hold_ns : other->max_hold_ns;
+        return;
+    }
+    push_stats(list, stats);
+}
+
+// Condition variables are kept apart from locks: threads wait on them while
+// they have nothing to do, which would bury the waits for locks.
+typedef struct LockTotals {
+    LockStatsList locks;        // Mutexes and rwlocks.
+    LockStatsList sites;
+    LockStatsList conds;
+    LockStatsList cond_sites;
+    uint64_t dropped;           // Acquisitions whose call site wasn't recorded.
+    uint64_t untimed;           // Acquisitions whose hold time wasn't recorded.
+    size_t processes;
+} LockTotals;
+
+static void lock_totals_free(LockTotals *totals) {
+    free(totals->locks.items);
+    free(totals->sites.items);
+    free(totals->conds.items);
+    free(totals->cond_sites.items);
+}
+
+// Adds the file one process of the run wrote to the per lock and per call
+// site totals.
+static void read_process(void *ctx, FILE *f) {
+    LockTotals *totals = ctx;
+    totals->processes++;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        uint64_t n;
+        if (sscanf(line, "dropped %" SCNu64, &n) == 1) {
+            totals->dropped += n;
+            continue;
+        }
+        if (sscanf(line, "untimed %" SCNu64, &n) == 1) {
+            totals->untimed += n;
+            continue;
+        }
+
+        LockStats stats = {0};
+        char site[32];
+        if (sscanf(line, "%7s 0x%" SCNx64 " %31s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+                stats.kind, &stats.lock, site, &stats.count, &stats.contended,
+                &stats.wait_ns, &stats.max_wait_ns, &stats.hold_ns, &stats.max_hold_ns) != 9)
+        {
+            continue;
+        }
+        stats.known = sscanf(site, "0x%" SCNx64, &stats.pc) == 1;
+        // The same address in two processes is two different locks.
+        stats.lock ^= (uint64_t)totals->processes << 56;
+
+        bool cond = strcmp(stats.kind, "cond") == 0;
+        merge_stats(cond ? &totals->cond_sites : &totals->sites, &stats, true);
+        merge_stats(cond ? &totals->conds : &totals->locks, &stats, false);
+    }
+}
+
+// Longest waited for first, then longest held.
+static int compare_stats(const void *a, const void *b) {
+    const LockStats *x = a;
+    const LockStats *y = b;
+    if (x->wait_ns != y->wait_ns) {
+        return x->wait_ns < y->wait_ns ? 1 : -1;
+    }
+    if (x->hold_ns != y->hold_ns) {
+        return x->hold_ns < y->hold_ns ? 1 : -1;
+    }
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// Sorts `locks` and `sites`, and numbers the locks so call sites can refer
+// to them.
+static void rank_stats(LockStatsList *locks, LockStatsList *sites) {
+    qsort(locks->items, locks->length, sizeof(*locks->items), compare_stats);
+    qsort(sites->items, sites->length, sizeof(*sites->items), compare_stats);
+
+    for (size_t i = 0; i < sites->length; i++) {
+        for (size_t j = 0; j < locks->length; j++) {
+            if (sites->items[i].lock == locks->items[j].lock && strcmp(sites->items[i].kind, locks->items[j].kind) == 0) {
+                sites->items[i].rank = j + 1;
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < locks->length; i++) {
+        locks->items[i].rank = i + 1;
+    }
+}
+
+static void print_locks(const LockStatsList *locks) {
+    printf("==== Locks by time waited ====\n");
+    printf("    %5s  %-6s  %12s  %9s  %9s  %9s  %9s  %9s\n",
+        "lock", "kind", "acquisitions", "contended", "waited", "max wait", "held", "max held");
+    for (size_t i = 0; i < locks->length && i < LOCKS_TOP_LOCKS; i++) {
+        const LockStats *lock = &locks->items[i];
+        char count[32];
+        char wait[16];
+        char max_wait[16];
+        char hold[16];
+        char max_hold[16];
+        format_count(lock->count, count, sizeof(count));
+        format_duration((int64_t)lock->wait_ns, wait, sizeof(wait));
+        format_duration((int64_t)lock->max_wait_ns, max_wait, sizeof(max_wait));
+        format_duration((int64_t)lock->hold_ns, hold, sizeof(hold));
+        format_duration((int64_t)lock->max_hold_ns, max_hold, sizeof(max_hold));
+        printf("    %4s%zu  %-6s  %12s  %8.1f%%  %9s  %9s  %9s  %9s\n",
+            "#", lock->rank, lock->kind, count, 100.0 * (double)lock->contended / (double)lock->count,
+            wait, max_wait, hold, max_hold);
+    }
+}
+
+static void print_conds(const LockStatsList *conds) {
+    printf("==== Condition variables by time waited ====\n");
+    printf("    %5s  %12s  %9s  %9s\n", "cond", "waits", "waited", "max wait");
+    for (size_t i = 0; i < conds->length && i < LOCKS_TOP_CONDS; i++) {
+        const LockStats *cond = &conds->items[i];
+        char count[32];
+        char wait[16];
+        char max_wait[16];
+        format_count(cond->count, count, sizeof(count));
+        format_duration((int64_t)cond->wait_ns, wait, sizeof(wait));
+        format_duration((int64_t)cond->max_wait_ns, max_wait, sizeof(max_wait));
+        printf("    %4s%zu  %12s  %9s  %9s\n", "#", cond->rank, count, wait, max_wait);
+    }
+}
+
+// Prints the first `max` of `sites`. Condition variables are only waited
+// on, so their sites have no contention or hold times.
+static void print_sites(const char *exe, const LockStatsList *sites, size_t max, bool conds) {
+    size_t len = sites->length < max ? sites->length : max;
+
+    uint64_t addrs[LOCKS_TOP_SITES];
+    size_t addrs_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (sites->items[i].known) {
+            addrs[addrs_len++] = sites->items[i].pc;
+        }
+    }
+    StrList locations = {0};
+    symbols_locate(exe, addrs, addrs_len, &locations);
+
+    if (conds) {
+        printf("==== Condition variable waits by call site ====\n");
+        printf("    %5s  %12s  %9s  %s\n", "cond", "waits", "waited", "site");
+    } else {
+        printf("==== Call sites by time waited ====\n");
+        printf("    %5s  %12s  %9s  %9s  %9s  %s\n", "lock", "acquisitions", "contended", "waited", "held", "site");
+    }
+    for (size_t i = 0, known = 0; i < len; i++) {
+        const LockStats *site = &sites->items[i];
+        const char *location = site->known ? locations.items[known++] : "(in other libraries)";
+        char count[32];
+        char wait[16];
+        char hold[16];
+        format_count(site->count, count, sizeof(count));
+        format_duration((int64_t)site->wait_ns, wait, sizeof(wait));
+        format_duration((int64_t)site->hold_ns, hold, sizeof(hold));
+        if (conds) {
+            printf("    %4s%zu  %12s  %9s  %s\n", "#", site->rank, count, wait, location);
+        } else {
+            printf("    %4s%zu  %12s  %8.1f%%  %9s  %9s  %s\n", "#", site->rank, count,
+                100.0 * (double)site->contended / (double)site->count, wait, hold, location);
+        }
+    }
+
+    strlist_free(&locations);
+}
+
+static bool report(const char *exe) {
+    LockTotals totals = {0};
+    if (!inject_read(&tracker, read_process, &totals)) {
+        lock_totals_free(&totals);
+        return false;
+    }
+
+    size_t locks = totals.locks.length;
+    size_t conds = totals.conds.length;
+    if (locks == 0 && conds == 0) {
+        logprint(LOG_INFO, "The program didn't take any pthread locks.");
+        lock_totals_free(&totals);
+        return true;
+    }
+
+    rank_stats(&totals.locks, &totals.sites);
+    rank_stats(&totals.conds, &totals.cond_sites);
+
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    uint64_t wait_ns = 0;
+    for (size_t i = 0; i < locks; i++) {
+        acquisitions += totals.locks.items[i].count;
+        contended += totals.locks.items[i].contended;
+        wait_ns += totals.locks.items[i].wait_ns;
+    }
+
+    char count[32];
+    char wait[16];
+    format_count(acquisitions, count, sizeof(count));
+    format_duration((int64_t)wait_ns, wait, sizeof(wait));
+    printf("==== Locks ====\n");
+    printf("    %zu lock%s and %zu condition variable%s. %s acquisitions, %.1f%% contended, %s waited in total.\n",
+        locks, locks == 1 ? "" : "s", conds, conds == 1 ? "" : "s", count,
+        acquisitions ? 100.0 * (double)contended / (double)acquisitions : 0.0, wait);
+
+    if (locks > 0) {
+        print_locks(&totals.locks);
+        print_sites(exe, &totals.sites, LOCKS_TOP_SITES, false);
+    }
+    if (conds > 0) {
+        print_conds(&totals.conds);
+        print_sites(exe, &totals.cond_sites, LOCKS_TOP_CONDS, true);
+    }
+    if (totals.dropped > 0) {
+        printf("    %" PRIu64 " acquisitions came from more call sites than could be told apart.\n", totals.dropped);
+    }
+    if (totals.untimed > 0) {
+        printf("    %" PRIu64 " acquisitions weren't timed for holding, as there were more locks than could be tracked.\n", totals.untimed);
+    }
+
+    lock_totals_free(&totals);
+    return true;
+}
+
+bool locks_run(char *const *argv, int *exit_code) {
+    return inject_run(&tracker, argv, 0, exit_code) && report(argv[0]);
+}
@@ -0,0 +1,16 @@
+#ifndef _LOCKS_H_
+#define _LOCKS_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+
+#define LOCKS_DIR BUILDX_DIR"/locks"
+
+// Runs `argv` like `proc_run` with the pthread mutexes, rwlocks and condition
+// variables of `argv[0]` wrapped, then reports the locks and call sites that
+// threads waited longest for, with how often they were contended and how
+// long they were held. Waits on condition variables are ranked separately.
+bool locks_run(char *const *argv, int *exit_code);
+
+#endif // _LOCKS_H_
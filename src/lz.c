@@ -0,0 +1,164 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_BITS (14)
+#define MIN_MATCH (4)
+#define MAX_OFFSET (65535)
+#define LAST_LITERALS (5)  // The tail of the input is always stored as literals.
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static unsigned char *write_length(unsigned char *op, const unsigned char *end, size_t len) {
+    while (len >= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Writes one sequence: a run of literals optionally followed by a match.
+static unsigned char *write_sequence(
+    unsigned char *op, const unsigned char *end,
+    const unsigned char *literals, size_t literals_len,
+    size_t offset, size_t match_len
+) {
+    if (op >= end) return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((literals_len < 15 ? literals_len : 15) << 4);
+    if (literals_len >= 15) {
+        op = write_length(op, end, literals_len - 15);
+        if (!op) return NULL;
+    }
+
+    if ((size_t)(end - op) < literals_len) return NULL;
+    memcpy(op, literals, literals_len);
+    op += literals_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    if (end - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+
+    size_t ml = match_len - MIN_MATCH;
+    *token |= (unsigned char)(ml < 15 ? ml : 15);
+    if (ml >= 15) {
+        op = write_length(op, end, ml - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap) {
+    unsigned char *op = dst;
+    const unsigned char *end = dst + dst_cap;
+
+    size_t anchor = 0;
+    if (src_len > MIN_MATCH + LAST_LITERALS) {
+        uint32_t *table = calloc((size_t)1 << HASH_BITS, sizeof(*table));
+        if (!table) return 0;
+
+        size_t limit = src_len - LAST_LITERALS - MIN_MATCH;
+        size_t ip = 0;
+        while (ip < limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash32(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            size_t match_len = MIN_MATCH;
+            while (ip + match_len < src_len - LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            op = write_sequence(op, end, src + anchor, ip - anchor, ip - ref, match_len);
+            if (!op) {
+                free(table);
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+        }
+
+        free(table);
+    }
+
+    op = write_sequence(op, end, src + anchor, src_len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static bool read_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_len) {
+    const unsigned char *ip = src;
+    const unsigned char *ip_end = src + src_len;
+    size_t op = 0;
+
+    while (ip < ip_end) {
+        unsigned char token = *ip++;
+
+        size_t literals_len = token >> 4;
+        if (literals_len == 15 && !read_length(&ip, ip_end, &literals_len)) return false;
+
+        if ((size_t)(ip_end - ip) < literals_len || dst_len - op < literals_len) return false;
+        memcpy(dst + op, ip, literals_len);
+        ip += literals_len;
+        op += literals_len;
+
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) return false;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&ip, ip_end, &match_len)) return false;
+        match_len += MIN_MATCH;
+
+        if (dst_len - op < match_len) return false;
+
+        // Matches may overlap their own output, so copy forwards byte by byte.
+        for (size_t i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op == dst_len;
+}
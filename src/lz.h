@@ -0,0 +1,20 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Small LZ77 codec in the spirit of LZ4: byte oriented, no entropy coding,
+// built for speed rather than ratio. Used to compress cache entries.
+
+// Worst case size of compressing `len` bytes.
+size_t lz_compress_bound(size_t len);
+
+// Returns the compressed size, or 0 if `dst_cap` is too small.
+size_t lz_compress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_cap);
+
+// Returns false if `src` is malformed or doesn't decode to exactly `dst_len`
+// bytes.
+bool lz_decompress(const unsigned char *src, size_t src_len, unsigned char *dst, size_t dst_len);
+
+#endif // _LZ_H_
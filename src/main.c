@@ -4,17 +4,25 @@
 #include <stdio.h>
 
 void usage(void) {
-    printf("Usage: bx {new,build,run,project,help,version} ...\n");
+    printf("Usage: bx {new,build,watch,run,bench,project,install,cache,daemon,help,version} ...\n");
     printf("    new:     Initialize a new project.\n");
     printf("             Use `bx new --help` for more info.\n");
     printf("    build:   Build project.\n");
     printf("             Use `bx build --help` for more info.\n");
+    printf("    watch:   Rebuild (and optionally rerun) whenever a source file changes.\n");
+    printf("             Use `bx watch --help` for more info.\n");
     printf("    run:     Run your already built project.\n");
     printf("             Use `bx run --help` for more info.\n");
+    printf("    bench:   Build, then time repeated runs of your project.\n");
+    printf("             Use `bx bench --help` for more info.\n");
     printf("    project: Change configuration of project.\n");
     printf("             Use `bx project --help` for more info.\n");
     printf("    install: Install executable.\n");
     printf("             Use `bx install --help` for more info.\n");
+    printf("    cache:   Inspect or trim the shared object cache.\n");
+    printf("             Use `bx cache --help` for more info.\n");
+    printf("    daemon:  Keep the project's source tree in memory for faster builds.\n");
+    printf("             Use `bx daemon --help` for more info.\n");
     printf("    help:    Show this help message.\n");
     printf("    version: Show buildx version.\n");
 }
@@ -37,12 +45,20 @@ int main(int argc, const char **argv) {
         cmd_new(&args);
     } else if (iter_match(&args, "build")) {
         cmd_build(&args);
+    } else if (iter_match(&args, "watch")) {
+        cmd_watch(&args);
     } else if (iter_match(&args, "run")) {
         cmd_run(&args);
+    } else if (iter_match(&args, "bench")) {
+        cmd_bench(&args);
     } else if (iter_match(&args, "project")) {
         cmd_project(&args);
     } else if (iter_match(&args, "install")) {
         cmd_install(&args);
+    } else if (iter_match(&args, "cache")) {
+        cmd_cache(&args);
+    } else if (iter_match(&args, "daemon")) {
+        cmd_daemon(&args);
     } else if (iter_match(&args, "help")) {
         usage();
     } else if (iter_match(&args, "version")) {
@@ -0,0 +1,116 @@
+#include "modules.h"
+#include "json.h"
+#include "proc.h"
+#include "utils.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *skip_blanks(const char *c) {
+    while (*c == ' ' || *c == '\t') c++;
+    return c;
+}
+
+// Returns true if `c` starts with the keyword `word` rather than an
+// identifier that begins with it.
+static bool starts_with_word(const char *c, const char *word) {
+    size_t len = strlen(word);
+    return strncmp(c, word, len) == 0 && !isalnum((unsigned char)c[len]) && c[len] != '_';
+}
+
+bool module_scan_needed(const char *path) {
+    char *contents = read_file(path, NULL);
+    if (!contents) {
+        // Let the scanner report the problem.
+        return true;
+    }
+
+    bool found = false;
+    for (const char *line = contents; line && !found; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        const char *c = skip_blanks(line);
+        if (starts_with_word(c, "export")) {
+            c = skip_blanks(c + strlen("export"));
+        }
+        found = starts_with_word(c, "module") || starts_with_word(c, "import");
+    }
+
+    free(contents);
+    return found;
+}
+
+bool module_deps_read(const char *ddi_path, ModuleDeps *deps) {
+    *deps = (ModuleDeps){0};
+
+    size_t length;
+    char *text = read_file(ddi_path, &length);
+    if (!text) {
+        return false;
+    }
+
+    JsonValue doc;
+    bool ok = json_parse(text, length, &doc);
+    free(text);
+    if (!ok) {
+        logprint(LOG_ERROR, "'%s' is not valid JSON.", ddi_path);
+        return false;
+    }
+
+    const JsonValue *rules = json_get(&doc, "rules");
+    if (!rules || rules->type != JSON_ARRAY || rules->length == 0) {
+        logprint(LOG_ERROR, "'%s' has no dependency rules.", ddi_path);
+        json_free(&doc);
+        return false;
+    }
+
+    const JsonValue *provides = json_get(&rules->items[0], "provides");
+    if (provides && provides->type == JSON_ARRAY && provides->length > 0) {
+        const char *name = json_string(json_get(&provides->items[0], "logical-name"), NULL);
+        deps->provides = name ? strdup(name) : NULL;
+    }
+
+    const JsonValue *requires = json_get(&rules->items[0], "requires");
+    for (size_t i = 0; requires && requires->type == JSON_ARRAY && i < requires->length; i++) {
+        const char *name = json_string(json_get(&requires->items[i], "logical-name"), NULL);
+        if (name) {
+            strlist_push(&deps->requires, name);
+        }
+    }
+
+    json_free(&doc);
+    return true;
+}
+
+void module_deps_free(ModuleDeps *deps) {
+    free(deps->provides);
+    strlist_free(&deps->requires);
+    *deps = (ModuleDeps){0};
+}
+
+void module_bmi_name(const char *module, const char *ext, char *out, size_t size) {
+    snprintf(out, size, "%s%s", module, ext);
+    for (char *c = out; *c; c++) {
+        if (*c == ':') *c = '-';
+    }
+}
+
+static void collect_output(void *ctx, const void *data, size_t len) {
+    strbuf_append_len((StrBuf *)ctx, data, len);
+}
+
+int module_scan_to_file(void *ctx) {
+    ModuleScan *scan = ctx;
+
+    StrBuf out = {0};
+    int exit_code;
+    if (!proc_run_piped(scan->argv.items, collect_output, &out, &exit_code)) {
+        logprint(LOG_ERROR, "Failed to run '%s'.", scan->argv.items[0]);
+        exit_code = 1;
+    } else if (exit_code == 0 && !write_file_atomic(scan->ddi_path, out.bytes ? out.bytes : "", out.length)) {
+        exit_code = 1;
+    }
+
+    strbuf_free(&out);
+    return exit_code;
+}
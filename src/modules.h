@@ -0,0 +1,38 @@
+#ifndef _MODULES_H_
+#define _MODULES_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// What one translation unit provides and imports, as reported by the
+// compiler's dependency scanner in P1689 format.
+typedef struct ModuleDeps {
+	char *provides;         // Module or partition the unit exports. NULL if none.
+	StrList requires;       // Modules and partitions it imports.
+} ModuleDeps;
+
+// Returns true if `path` has a line starting with a module or import
+// declaration. Sources without one are assumed not to use modules, which
+// saves scanning them.
+bool module_scan_needed(const char *path);
+
+// Reads the first rule of the P1689 file at `ddi_path`.
+bool module_deps_read(const char *ddi_path, ModuleDeps *deps);
+void module_deps_free(ModuleDeps *deps);
+
+// File name of a module's BMI. Partitions are named like clang expects
+// them for -fprebuilt-module-path, so "a:b" becomes "a-b".
+void module_bmi_name(const char *module, const char *ext, char *out, size_t size);
+
+// Runs a scanner that prints P1689 to stdout (like clang-scan-deps) and
+// saves its output. Meant to be run as a job.
+typedef struct ModuleScan {
+	StrList argv;
+	char *ddi_path;
+} ModuleScan;
+
+int module_scan_to_file(void *ctx);
+
+#endif // _MODULES_H_
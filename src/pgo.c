@@ -0,0 +1,137 @@
+#include "pgo.h"
+#include "proc.h"
+#include "trace.h"
+#include "train.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+#define PGO_PROFILE_DIR PGO_DIR"/profile"       // Raw profiles from training runs.
+#define PGO_PROFDATA PGO_DIR"/merged.profdata"  // Merged for clang. GCC reads the raw ones.
+#define PGO_FINGERPRINT PGO_DIR"/fingerprint"   // What the profile was recorded from.
+
+static void remove_profiles(void) {
+    DIR *d = opendir(PGO_PROFILE_DIR);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), PGO_PROFILE_DIR"/%s", entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    unlink(PGO_PROFDATA);
+}
+
+// clang leaves one raw profile per binary, which has to be merged before
+// it can be used.
+static bool merge_profiles(void) {
+    const char *profdata = getenv("LLVM_PROFDATA");
+
+    StrList argv = {0};
+    strlist_push(&argv, profdata && *profdata ? profdata : "llvm-profdata");
+    strlist_push(&argv, "merge");
+    strlist_push(&argv, "-output="PGO_PROFDATA);
+
+    DIR *d = opendir(PGO_PROFILE_DIR);
+    size_t inputs = 0;
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (ends_with(entry->d_name, ".profraw")) {
+            strlist_pushf(&argv, PGO_PROFILE_DIR"/%s", entry->d_name);
+            inputs++;
+        }
+    }
+    if (d) closedir(d);
+
+    if (inputs == 0) {
+        logprint(LOG_ERROR, "Training run didn't write a profile to '%s'.", PGO_PROFILE_DIR);
+        strlist_free(&argv);
+        return false;
+    }
+
+    int64_t start = monotonic_ns();
+    int exit_code;
+    bool ok = proc_run(argv.items, &exit_code) && exit_code == 0;
+    trace_add("Merge profile", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+
+    if (!ok) {
+        logprint(LOG_ERROR, "Failed to merge profiles with '%s'. Set $LLVM_PROFDATA to use another.", argv.items[0]);
+    }
+    strlist_free(&argv);
+    return ok;
+}
+
+static bool build_release(const ProjConf *proj, const BuildOptions *opts, bool clang, bool generate) {
+    BuildConfig config;
+    if (!build_config_init(&config, proj, "release")) {
+        return false;
+    }
+
+    if (generate) {
+        strlist_push(&config.cflags, "-fprofile-generate="PGO_PROFILE_DIR);
+        strlist_push(&config.ldflags, "-fprofile-generate="PGO_PROFILE_DIR);
+        if (!clang) {
+            // Counters of multithreaded programs stay consistent.
+            strlist_push(&config.cflags, "-fprofile-update=prefer-atomic");
+        }
+    } else if (clang) {
+        strlist_push(&config.cflags, "-fprofile-use="PGO_PROFDATA);
+        strlist_push(&config.cflags, "-Wno-profile-instr-out-of-date");
+        strlist_push(&config.cflags, "-Wno-profile-instr-unprofiled");
+        strlist_push(&config.cflags, "-Wno-profile-instr-missing");
+    } else {
+        strlist_push(&config.cflags, "-fprofile-use="PGO_PROFILE_DIR);
+        strlist_push(&config.cflags, "-Wno-missing-profile");
+        strlist_push(&config.cflags, "-Wno-coverage-mismatch");
+    }
+
+    // The objects depend on the profile, which the cache can't see.
+    BuildOptions build_opts = *opts;
+    build_opts.use_cache = false;
+
+    bool ok = build_project(proj, &config, 1, &build_opts);
+    build_config_free(&config);
+    return ok;
+}
+
+bool pgo_build(const ProjConf *proj, const BuildOptions *opts, const StrList *train_args) {
+    bool clang = project_uses_clang(proj);
+
+    StrBuf fingerprint = {0};
+    train_fingerprint(&fingerprint, proj, train_args);
+
+    char *old = read_file(PGO_FINGERPRINT, NULL);
+    bool have_profile = access(clang ? PGO_PROFDATA : PGO_PROFILE_DIR, F_OK) == 0;
+    bool fresh = old && have_profile && train_profile_fresh(old, fingerprint.bytes);
+    free(old);
+
+    bool ok = true;
+    if (!fresh) {
+        logprint(LOG_INFO, "%s. Recording one with an instrumented build.",
+            have_profile ? "Sources or training run changed too much since the last profile" : "No profile yet");
+
+        remove_profiles();
+        unlink(PGO_FINGERPRINT);
+
+        ok = make_dirs(PGO_PROFILE_DIR) &&
+             build_release(proj, opts, clang, true) &&
+             train_run(proj, train_args) &&
+             (!clang || merge_profiles()) &&
+             write_file_if_changed(PGO_FINGERPRINT, fingerprint.bytes, fingerprint.length);
+    }
+
+    ok = ok && build_release(proj, opts, clang, false);
+
+    strbuf_free(&fingerprint);
+    return ok;
+}
@@ -0,0 +1,18 @@
+#ifndef _PGO_H_
+#define _PGO_H_
+
+#include "builder.h"
+#include "conf.h"
+#include "utils.h"
+
+#include <stdbool.h>
+
+#define PGO_DIR BUILDX_DIR"/pgo"
+
+// Builds the release configuration with profile-guided optimization. When
+// there is no profile yet, or the sources have drifted too far from the
+// ones it was recorded with, an instrumented build is trained first by
+// running it with `train_args` (or the project's `pgo_train` setting).
+bool pgo_build(const ProjConf *proj, const BuildOptions *opts, const StrList *train_args);
+
+#endif // _PGO_H_
@@ -0,0 +1,138 @@
+#include "proc.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static bool wait_for_usage(pid_t pid, const char *name, int *exit_code, struct rusage *usage) {
+    int status;
+    while (wait4(pid, &status, 0, usage) == -1) {
+        if (errno != EINTR) {
+            const char *err = strerror(errno);
+            logprint(LOG_FATAL, "Failed to wait for '%s': %s.", name, err);
+            return false;
+        }
+    }
+
+    if (WIFEXITED(status)) {
+        *exit_code = WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        *exit_code = 128 + WTERMSIG(status);
+    } else {
+        *exit_code = -1;
+    }
+
+    return true;
+}
+
+static bool wait_for(pid_t pid, const char *name, int *exit_code) {
+    struct rusage usage;
+    return wait_for_usage(pid, name, exit_code, &usage);
+}
+
+// Runs `argv` in a forked child. Never returns.
+static void exec_child(char *const *argv) {
+    // The daemon ignores SIGPIPE, which the program would inherit.
+    signal(SIGPIPE, SIG_DFL);
+    execvp(argv[0], argv);
+    const char *err = strerror(errno);
+    logprint(LOG_ERROR, "Failed to run '%s': %s.", argv[0], err);
+    _exit(127);
+}
+
+bool proc_run(char *const *argv, int *exit_code) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to fork: %s.", err);
+        return false;
+    }
+
+    if (pid == 0) {
+        exec_child(argv);
+    }
+
+    return wait_for(pid, argv[0], exit_code);
+}
+
+bool proc_run_piped(char *const *argv, ProcOutputFunc on_output, void *ctx, int *exit_code) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to create pipe: %s.", err);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to fork: %s.", err);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        exec_child(argv);
+    }
+
+    close(fds[1]);
+
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        on_output(ctx, buf, (size_t)n);
+    }
+    close(fds[0]);
+
+    return wait_for(pid, argv[0], exit_code);
+}
+
+bool proc_run_measured(char *const *argv, bool quiet, ProcUsage *usage, int *exit_code) {
+    int64_t start = monotonic_ns();
+    pid_t pid = fork();
+    if (pid == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_FATAL, "Failed to fork: %s.", err);
+        return false;
+    }
+
+    if (pid == 0) {
+        if (quiet) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null != -1) {
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+                close(null);
+            }
+        }
+        exec_child(argv);
+    }
+
+    struct rusage ru;
+    if (!wait_for_usage(pid, argv[0], exit_code, &ru)) {
+        return false;
+    }
+
+    usage->wall_ns = monotonic_ns() - start;
+    usage->user_ns = timeval_ns(ru.ru_utime);
+    usage->sys_ns = timeval_ns(ru.ru_stime);
+#ifdef __APPLE__
+    usage->peak_rss = (uint64_t)ru.ru_maxrss;
+#else
+    usage->peak_rss = (uint64_t)ru.ru_maxrss * 1024;
+#endif
+    return true;
+}
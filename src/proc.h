@@ -0,0 +1,30 @@
+#ifndef _PROC_H_
+#define _PROC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs `argv` to completion without going through a shell. `argv[0]` is
+// looked up in PATH. Returns false if the process could not be started,
+// otherwise stores its exit code (or 128 + signal) in `exit_code`.
+bool proc_run(char *const *argv, int *exit_code);
+
+typedef void (*ProcOutputFunc)(void *ctx, const void *data, size_t len);
+
+// Like `proc_run` but the process' stdout is streamed to `on_output` instead
+// of the terminal.
+bool proc_run_piped(char *const *argv, ProcOutputFunc on_output, void *ctx, int *exit_code);
+
+typedef struct ProcUsage {
+	int64_t wall_ns;
+	int64_t user_ns;
+	int64_t sys_ns;
+	uint64_t peak_rss;      // Bytes.
+} ProcUsage;
+
+// Like `proc_run` but measures the time and memory the process used. Its
+// stdout and stderr go to /dev/null if `quiet` is set.
+bool proc_run_measured(char *const *argv, bool quiet, ProcUsage *usage, int *exit_code);
+
+#endif // _PROC_H_
@@ -0,0 +1,526 @@
+#include "sampler.h"
+#include "flamegraph.h"
+#include "inject.h"
+#include "strmap.h"
+#include "symbols.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <time.h>
+
+#define SAMPLER_STACKS SAMPLER_DIR"/stacks"   // One file per process of the run.
+#define SAMPLER_TOP 15                          // Hottest functions to print.
+#define SAMPLER_MAX_FRAMES 256
+
+// Longer than the 4095 characters ISO C guarantees, which GCC and clang allow.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverlength-strings"
+static const char sampler_source[] =
+    "// Loaded into programs by `bx run --sample` and into the training runs of\n"
+    "// `bx build --layout`. Records the call stack on a CPU\n"
+    "// time timer by following frame pointers and, when the program exits, writes\n"
+    "// every distinct stack with how often it was seen. Addresses in the\n"
+    "// executable are written as offsets for bx to symbolize; others are named\n"
+    "// after the nearest exported symbol or their library.\n"
+    "#define _GNU_SOURCE\n"
+    "#include \"bx_inject.h\"\n"
+    "#include <dlfcn.h>\n"
+    "#include <signal.h>\n"
+    "#include <stdio.h>\n"
+    "#include <sys/time.h>\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "#define MAX_SAMPLES (1 << 16)\n"
+    "#define MAX_DEPTH 48\n"
+    "#define MAX_FRAME_SIZE (1 << 20)\n"
+    "#define MAX_FUNCTION_SIZE (1 << 16)\n"
+    "\n"
+    "typedef struct Stack {\n"
+    "    uintptr_t depth;\n"
+    "    uintptr_t pcs[MAX_DEPTH];\n"
+    "} Stack;\n"
+    "\n"
+    "static Stack stacks[MAX_SAMPLES];\n"
+    "static size_t sample_count;\n"
+    "static pid_t sampling_pid;\n"
+    "\n"
+    "static void context_regs(void *ctx, uintptr_t *pc, uintptr_t *sp, uintptr_t *fp) {\n"
+    "    ucontext_t *uc = ctx;\n"
+    "#if defined(__APPLE__) && defined(__x86_64__)\n"
+    "    *pc = uc->uc_mcontext->__ss.__rip;\n"
+    "    *sp = uc->uc_mcontext->__ss.__rsp;\n"
+    "    *fp = uc->uc_mcontext->__ss.__rbp;\n"
+    "#elif defined(__APPLE__) && defined(__aarch64__)\n"
+    "    *pc = uc->uc_mcontext->__ss.__pc;\n"
+    "    *sp = uc->uc_mcontext->__ss.__sp;\n"
+    "    *fp = uc->uc_mcontext->__ss.__fp;\n"
+    "#elif defined(__x86_64__)\n"
+    "    *pc = uc->uc_mcontext.gregs[REG_RIP];\n"
+    "    *sp = uc->uc_mcontext.gregs[REG_RSP];\n"
+    "    *fp = uc->uc_mcontext.gregs[REG_RBP];\n"
+    "#elif defined(__aarch64__)\n"
+    "    *pc = uc->uc_mcontext.pc;\n"
+    "    *sp = uc->uc_mcontext.sp;\n"
+    "    *fp = uc->uc_mcontext.regs[29];\n"
+    "#else\n"
+    "    (void)uc;\n"
+    "    *pc = *sp = *fp = 0;\n"
+    "#endif\n"
+    "}\n"
+    "\n"
+    "#ifdef __x86_64__\n"
+    "// Leaf functions often don't set up a frame, which would hide their caller.\n"
+    "// If the top of the stack is the return address of a call to the function\n"
+    "// being run, that's the caller.\n"
+    "static uintptr_t leaf_caller(uintptr_t pc, uintptr_t sp) {\n"
+    "    if (!in_text(pc) || sp % sizeof(uintptr_t) != 0) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "    uintptr_t ret = *(const uintptr_t *)sp;\n"
+    "    if (ret < text_start + 5 || ret >= text_end || *(const uint8_t *)(ret - 5) != 0xe8) {\n"
+    "        return 0;\n"
+    "    }\n"
+    "    int32_t offset;\n"
+    "    memcpy(&offset, (const void *)(ret - 4), sizeof(offset));\n"
+    "    uintptr_t target = ret + (intptr_t)offset;\n"
+    "    return target <= pc && pc - target < MAX_FUNCTION_SIZE ? ret : 0;\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "static void on_sample(int sig, siginfo_t *info, void *ctx) {\n"
+    "    (void)sig;\n"
+    "    (void)info;\n"
+    "    size_t i = __atomic_fetch_add(&sample_count, 1, __ATOMIC_RELAXED);\n"
+    "    if (i >= MAX_SAMPLES) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    uintptr_t pc, sp, fp;\n"
+    "    context_regs(ctx, &pc, &sp, &fp);\n"
+    "\n"
+    "    Stack *stack = &stacks[i];\n"
+    "    size_t depth = 0;\n"
+    "    stack->pcs[depth++] = pc;\n"
+    "#ifdef __x86_64__\n"
+    "    uintptr_t caller = leaf_caller(pc, sp);\n"
+    "    if (caller) {\n"
+    "        stack->pcs[depth++] = caller - 1;\n"
+    "    }\n"
+    "#endif\n"
+    "\n"
+    "    // Each frame starts with the caller's frame pointer followed by the\n"
+    "    // return address. Frames only get further up the stack, so anything else\n"
+    "    // means code built without frame pointers and the walk stops there.\n"
+    "    uintptr_t lowest = sp;\n"
+    "    while (depth < MAX_DEPTH && fp >= lowest && fp - lowest < MAX_FRAME_SIZE && fp % sizeof(uintptr_t) == 0) {\n"
+    "        const uintptr_t *frame = (const uintptr_t *)fp;\n"
+    "        if (frame[1] == 0) {\n"
+    "            break;\n"
+    "        }\n"
+    "        // Inside the call instruction rather than after it.\n"
+    "        stack->pcs[depth++] = frame[1] - 1;\n"
+    "        lowest = fp + 2 * sizeof(uintptr_t);\n"
+    "        fp = frame[0];\n"
+    "    }\n"
+    "    stack->depth = depth;\n"
+    "}\n"
+    "\n"
+    "static int compare_stacks(const void *a, const void *b) {\n"
+    "    const Stack *x = *(const Stack *const *)a;\n"
+    "    const Stack *y = *(const Stack *const *)b;\n"
+    "    if (x->depth != y->depth) {\n"
+    "        return x->depth < y->depth ? -1 : 1;\n"
+    "    }\n"
+    "    return memcmp(x->pcs, y->pcs, x->depth * sizeof(*x->pcs));\n"
+    "}\n"
+    "\n"
+    "static void write_frame(FILE *f, uintptr_t pc) {\n"
+    "    if (in_text(pc)) {\n"
+    "        fprintf(f, \" 0x%lx\", (unsigned long)(pc - slide));\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    Dl_info info;\n"
+    "    if (!dladdr((void *)pc, &info) || !info.dli_fname) {\n"
+    "        fprintf(f, \" [unknown]\");\n"
+    "    } else if (info.dli_sname) {\n"
+    "        fprintf(f, \" %s\", info.dli_sname);\n"
+    "    } else {\n"
+    "        const char *base = strrchr(info.dli_fname, '/');\n"
+    "        fprintf(f, \" [%s]\", base ? base + 1 : info.dli_fname);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "__attribute__((constructor))\n"
+    "static void start_sampling(void) {\n"
+    "    const char *hz = getenv(\"BX_INJECT_HZ\");\n"
+    "    if (!is_target()) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    struct sigaction sa;\n"
+    "    memset(&sa, 0, sizeof(sa));\n"
+    "    sa.sa_sigaction = on_sample;\n"
+    "    sa.sa_flags = SA_SIGINFO | SA_RESTART;\n"
+    "    sigemptyset(&sa.sa_mask);\n"
+    "    sigaction(SIGPROF, &sa, NULL);\n"
+    "\n"
+    "    long rate = hz ? atol(hz) : 0;\n"
+    "    if (rate <= 0 || rate > 100000) {\n"
+    "        rate = 997;\n"
+    "    }\n"
+    "\n"
+    "    struct itimerval timer;\n"
+    "    memset(&timer, 0, sizeof(timer));\n"
+    "    timer.it_interval.tv_sec = 1 / rate;\n"
+    "    timer.it_interval.tv_usec = (1000000 / rate) % 1000000;\n"
+    "    timer.it_value = timer.it_interval;\n"
+    "    sampling_pid = getpid();\n"
+    "    setitimer(ITIMER_PROF, &timer, NULL);\n"
+    "}\n"
+    "\n"
+    "__attribute__((destructor))\n"
+    "static void write_stacks(void) {\n"
+    "    // Forked children inherit the samples but not the timer.\n"
+    "    if (sampling_pid == 0 || sampling_pid != getpid()) {\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    struct itimerval off;\n"
+    "    memset(&off, 0, sizeof(off));\n"
+    "    setitimer(ITIMER_PROF, &off, NULL);\n"
+    "    signal(SIGPROF, SIG_IGN);\n"
+    "\n"
+    "    size_t n = sample_count < MAX_SAMPLES ? sample_count : MAX_SAMPLES;\n"
+    "    Stack **sorted = malloc(n * sizeof(*sorted));\n"
+    "    if (!sorted) {\n"
+    "        return;\n"
+    "    }\n"
+    "    for (size_t i = 0; i < n; i++) {\n"
+    "        sorted[i] = &stacks[i];\n"
+    "    }\n"
+    "    qsort(sorted, n, sizeof(*sorted), compare_stacks);\n"
+    "\n"
+    "    char path[PATH_MAX];\n"
+    "    results_path(path, sizeof(path), sampling_pid, \".stacks\");\n"
+    "    FILE *f = fopen(path, \"w\");\n"
+    "    if (!f) {\n"
+    "        free(sorted);\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    if (sample_count > n) {\n"
+    "        fprintf(f, \"# dropped %zu\\n\", sample_count - n);\n"
+    "    }\n"
+    "    for (size_t i = 0; i < n;) {\n"
+    "        size_t j = i;\n"
+    "        while (j < n && compare_stacks(&sorted[j], &sorted[i]) == 0) j++;\n"
+    "        fprintf(f, \"%zu\", j - i);\n"
+    "        for (size_t k = 0; k < sorted[i]->depth; k++) {\n"
+    "            write_frame(f, sorted[i]->pcs[k]);\n"
+    "        }\n"
+    "        fprintf(f, \"\\n\");\n"
+    "        i = j;\n"
+    "    }\n"
+    "    fclose(f);\n"
+    "    free(sorted);\n"
+    "}\n";
+#pragma GCC diagnostic pop
+
+static const InjectLib sampler = {
+    .name = "stack_sampler",
+    .source = sampler_source,
+    .dir = SAMPLER_STACKS,
+    .suffix = ".stacks",
+    .records = "samples",
+};
+
+typedef struct FunctionStats {
+    const char *name;
+    size_t self;            // Samples in the function itself.
+    size_t total;           // Samples in it or anything it called.
+} FunctionStats;
+
+// Turns a "<count> <innermost frame> ... <outermost frame>" line from the
+// sampler into a collapsed stack, naming the executable's addresses.
+static bool fold_line(char *line, SymbolTable *table, StrBuf *folded, size_t *count) {
+    char *save;
+    char *token = strtok_r(line, " ", &save);
+    if (!token || sscanf(token, "%zu", count) != 1) {
+        return false;
+    }
+
+    char *frames[SAMPLER_MAX_FRAMES];
+    size_t depth = 0;
+    while (depth < SAMPLER_MAX_FRAMES && (token = strtok_r(NULL, " ", &save)) != NULL) {
+        frames[depth++] = token;
+    }
+    if (depth == 0) {
+        return false;
+    }
+
+    folded->length = 0;
+    for (size_t i = depth; i-- > 0;) {
+        const char *name = frames[i];
+        uint64_t addr;
+        if (strncmp(name, "0x", 2) == 0 && sscanf(name, "%" SCNx64, &addr) == 1) {
+            Symbol *sym = symbols_find(table, addr);
+            if (sym) {
+                name = sym->name;
+            }
+        }
+        strbuf_appendf(folded, i + 1 < depth ? ";%s" : "%s", name);
+    }
+    return true;
+}
+
+typedef struct StackReader {
+    SymbolTable *table;
+    StrMap *stacks;
+    StrBuf folded;
+    size_t total;
+    size_t dropped;
+} StackReader;
+
+// Merges the stacks one process of the run wrote with identical ones.
+static void read_process(void *ctx, FILE *f) {
+    StackReader *reader = ctx;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, f)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+
+        size_t n;
+        if (sscanf(line, "# dropped %zu", &n) == 1) {
+            reader->dropped += n;
+            continue;
+        }
+
+        size_t count;
+        if (!fold_line(line, reader->table, &reader->folded, &count)) {
+            continue;
+        }
+
+        FoldedStack *stack = strmap_get(reader->stacks, reader->folded.bytes);
+        if (!stack) {
+            stack = calloc(1, sizeof(*stack));
+            stack->frames = strdup(reader->folded.bytes);
+            strmap_put(reader->stacks, reader->folded.bytes, stack);
+        }
+        stack->count += count;
+        reader->total += count;
+    }
+    free(line);
+}
+
+// Reads every file the sampler wrote into `stacks`, with the number of
+// samples in `total`. Returns false if there were none.
+static bool read_stacks(SymbolTable *table, StrMap *stacks, size_t *total) {
+    StackReader reader = { .table = table, .stacks = stacks };
+    bool ok = inject_read(&sampler, read_process, &reader);
+    strbuf_free(&reader.folded);
+
+    if (reader.dropped > 0) {
+        logprint(LOG_WARN, "The sample buffer filled up and %zu samples were dropped. Lower the rate with `--sample=HZ`.", reader.dropped);
+    }
+    *total = reader.total;
+    return ok;
+}
+
+static int compare_stacks(const void *a, const void *b) {
+    return strcmp(((const FoldedStack *)a)->frames, ((const FoldedStack *)b)->frames);
+}
+
+static int compare_self(const void *a, const void *b) {
+    const FunctionStats *x = *(const FunctionStats *const *)a;
+    const FunctionStats *y = *(const FunctionStats *const *)b;
+    if (x->self != y->self) {
+        return x->self < y->self ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static void print_hottest(const FoldedStack *stacks, size_t len, size_t total) {
+    StrMap functions = {0};
+    for (size_t i = 0; i < len; i++) {
+        char *frames = strdup(stacks[i].frames);
+        const char *seen[SAMPLER_MAX_FRAMES];
+        size_t seen_len = 0;
+        FunctionStats *fn = NULL;
+
+        char *save;
+        for (char *name = strtok_r(frames, ";", &save); name; name = strtok_r(NULL, ";", &save)) {
+            fn = strmap_get(&functions, name);
+            if (!fn) {
+                fn = calloc(1, sizeof(*fn));
+                strmap_put(&functions, name, fn);
+            }
+
+            // Recursive functions count once per stack towards their total.
+            bool counted = false;
+            for (size_t j = 0; j < seen_len && !counted; j++) {
+                counted = strcmp(seen[j], name) == 0;
+            }
+            if (!counted) {
+                fn->total += stacks[i].count;
+                if (seen_len < SAMPLER_MAX_FRAMES) {
+                    seen[seen_len++] = name;
+                }
+            }
+        }
+        if (fn) {
+            fn->self += stacks[i].count;
+        }
+        free(frames);
+    }
+
+    FunctionStats **sorted = malloc(functions.length * sizeof(*sorted));
+    size_t sorted_len = 0;
+    for (size_t i = 0; i < functions.capacity; i++) {
+        if (functions.entries[i].key) {
+            FunctionStats *fn = functions.entries[i].value;
+            fn->name = functions.entries[i].key;
+            sorted[sorted_len++] = fn;
+        }
+    }
+    qsort(sorted, sorted_len, sizeof(*sorted), compare_self);
+
+    printf("==== Hottest functions (%zu samples) ====\n", total);
+    printf("      self    total  function\n");
+    for (size_t i = 0; i < sorted_len && i < SAMPLER_TOP && sorted[i]->self > 0; i++) {
+        printf("    %5.1f%%   %5.1f%%  %s\n",
+            100.0 * (double)sorted[i]->self / (double)total,
+            100.0 * (double)sorted[i]->total / (double)total,
+            sorted[i]->name);
+    }
+
+    free(sorted);
+    for (size_t i = 0; i < functions.capacity; i++) {
+        if (functions.entries[i].key) {
+            free(functions.entries[i].value);
+        }
+    }
+    strmap_free(&functions);
+}
+
+static bool write_profile(const char *exe, const char *name) {
+    SymbolTable table = {0};
+    if (!symbols_read(exe, true, &table)) {
+        return false;
+    }
+
+    StrMap map = {0};
+    size_t total;
+    bool ok = read_stacks(&table, &map, &total);
+    symbols_free(&table);
+
+    FoldedStack *stacks = malloc((map.length ? map.length : 1) * sizeof(*stacks));
+    size_t len = 0;
+    for (size_t i = 0; i < map.capacity; i++) {
+        if (map.entries[i].key) {
+            FoldedStack *stack = map.entries[i].value;
+            stacks[len++] = *stack;
+            free(stack);
+        }
+    }
+    strmap_free(&map);
+
+    if (ok && total == 0) {
+        logprint(LOG_ERROR, "No samples were recorded. The program has to run for a while.");
+        ok = false;
+    }
+
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+
+    char folded_path[PATH_MAX];
+    char svg_path[PATH_MAX];
+    snprintf(folded_path, sizeof(folded_path), SAMPLER_DIR"/%s-%s.folded", name, stamp);
+    snprintf(svg_path, sizeof(svg_path), SAMPLER_DIR"/%s-%s.svg", name, stamp);
+
+    if (ok) {
+        // Sorted, so runs of the same program diff well.
+        qsort(stacks, len, sizeof(*stacks), compare_stacks);
+
+        StrBuf folded = {0};
+        for (size_t i = 0; i < len; i++) {
+            strbuf_appendf(&folded, "%s %zu\n", stacks[i].frames, stacks[i].count);
+        }
+        ok = write_file_if_changed(folded_path, folded.bytes, folded.length);
+        strbuf_free(&folded);
+    }
+
+    if (ok) {
+        char title[PATH_MAX + 64];
+        snprintf(title, sizeof(title), "%s (%zu samples)", name, total);
+        ok = flamegraph_write(svg_path, title, stacks, len);
+    }
+
+    if (ok) {
+        print_hottest(stacks, len, total);
+        logprint(LOG_INFO, "Wrote collapsed stacks to '%s' and a flame graph to '%s'.", folded_path, svg_path);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        free(stacks[i].frames);
+    }
+    free(stacks);
+    return ok;
+}
+
+bool sampler_run(char *const *argv, int hz, const char *name, int *exit_code) {
+    return inject_run(&sampler, argv, hz, exit_code) && write_profile(argv[0], name);
+}
+
+bool sampler_begin(const char *exe, int hz) {
+    return inject_begin(&sampler, exe, hz);
+}
+
+void sampler_end(void) {
+    inject_end();
+}
+
+typedef struct SelfCounter {
+    SymbolTable *table;
+    size_t total;
+} SelfCounter;
+
+// Adds each stack one process of the run wrote to the symbol its innermost
+// frame is in.
+static void count_process(void *ctx, FILE *f) {
+    SelfCounter *counter = ctx;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, f) > 0) {
+        size_t count;
+        uint64_t addr;
+        if (sscanf(line, "%zu 0x%" SCNx64, &count, &addr) != 2) {
+            continue;
+        }
+
+        Symbol *sym = symbols_find(counter->table, addr);
+        if (sym) {
+            sym->samples += count;
+            counter->total += count;
+        }
+    }
+    free(line);
+}
+
+bool sampler_count_self(SymbolTable *table, size_t *total) {
+    SelfCounter counter = { .table = table };
+    bool ok = inject_read(&sampler, count_process, &counter);
+    *total = counter.total;
+    return ok;
+}
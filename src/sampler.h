@@ -0,0 +1,31 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "symbols.h"
+#include "utils.h"
+
+#include <stdbool.h>
+
+#define SAMPLER_DIR BUILDX_DIR"/profiles"
+
+// Samples per second of CPU time. Off the round numbers so sampling doesn't
+// fall in step with the program's own periodic work.
+#define SAMPLER_DEFAULT_HZ (997)
+
+// Runs `argv` like `proc_run` with a sampler loaded that records the call
+// stacks of `argv[0]` `hz` times a second of CPU time, following frame
+// pointers. When it exits, writes the stacks as collapsed stacks and an SVG
+// flame graph to `SAMPLER_DIR/<name>-<time>` and prints the hottest functions.
+bool sampler_run(char *const *argv, int hz, const char *name, int *exit_code);
+
+// Makes programs started from now on sample `exe` like `sampler_run` does,
+// until `sampler_end`. For runs bx doesn't start itself.
+bool sampler_begin(const char *exe, int hz);
+void sampler_end(void);
+
+// Adds the samples of the last run to the symbols of `table` their innermost
+// frame is in, and stores how many were added in `total`. Returns false,
+// after saying so, if nothing was recorded.
+bool sampler_count_self(SymbolTable *table, size_t *total);
+
+#endif // _SAMPLER_H_
@@ -0,0 +1,60 @@
+#include "strmap.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static StrMapEntry *find_slot(StrMapEntry *entries, size_t capacity, const char *key) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash_str(HASH_SEED, key) & mask;
+    while (entries[i].key && strcmp(entries[i].key, key) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &entries[i];
+}
+
+static void grow(StrMap *map) {
+    size_t capacity = map->capacity ? map->capacity * 2 : 64;
+    StrMapEntry *entries = calloc(capacity, sizeof(*entries));
+
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map->entries[i].key) {
+            *find_slot(entries, capacity, map->entries[i].key) = map->entries[i];
+        }
+    }
+
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+void *strmap_get(const StrMap *map, const char *key) {
+    if (map->capacity == 0) {
+        return NULL;
+    }
+    return find_slot(map->entries, map->capacity, key)->value;
+}
+
+void *strmap_put(StrMap *map, const char *key, void *value) {
+    // Keep the load factor under 3/4 so probes stay short.
+    if ((map->length + 1) * 4 > map->capacity * 3) {
+        grow(map);
+    }
+
+    StrMapEntry *slot = find_slot(map->entries, map->capacity, key);
+    void *old = slot->value;
+    if (!slot->key) {
+        slot->key = strdup(key);
+        map->length++;
+    }
+    slot->value = value;
+    return old;
+}
+
+void strmap_free(StrMap *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->entries[i].key);
+    }
+    free(map->entries);
+    *map = (StrMap){0};
+}
@@ -0,0 +1,28 @@
+#ifndef _STRMAP_H_
+#define _STRMAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Hash map from owned strings to caller-owned pointers.
+typedef struct StrMapEntry {
+	char *key;
+	void *value;
+} StrMapEntry;
+
+typedef struct StrMap {
+	StrMapEntry *entries;
+	size_t length;
+	size_t capacity;        // Always zero or a power of two.
+} StrMap;
+
+void *strmap_get(const StrMap *map, const char *key);
+
+// Inserts or replaces the value for `key` and returns the old value, if any.
+void *strmap_put(StrMap *map, const char *key, void *value);
+
+// Frees the keys only. Free the values first by going through `entries` and
+// skipping the slots without a key.
+void strmap_free(StrMap *map);
+
+#endif // _STRMAP_H_
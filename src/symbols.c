@@ -0,0 +1,150 @@
+#include "symbols.h"
+#include "proc.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syslimits.h>
+#include <unistd.h>
+
+static void collect_output(void *ctx, const void *data, size_t len) {
+    strbuf_append_len((StrBuf *)ctx, data, len);
+}
+
+int symbols_compare_addrs(const void *a, const void *b) {
+    const Symbol *x = a;
+    const Symbol *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+bool symbols_read(const char *exe, bool demangle, SymbolTable *table) {
+    const char *nm = getenv("NM");
+    char *argv[] = { (char *)(nm && *nm ? nm : "nm"), "-n", (char *)exe, NULL, NULL };
+    if (demangle) {
+        argv[3] = argv[2];
+        argv[2] = "-C";
+    }
+
+    StrBuf out = {0};
+    int exit_code;
+    if (!proc_run_piped(argv, collect_output, &out, &exit_code) || exit_code != 0) {
+        logprint(LOG_ERROR, "Failed to list the symbols of '%s' with '%s'. Set $NM to use another.", exe, argv[0]);
+        strbuf_free(&out);
+        return false;
+    }
+
+    for (char *line = strtok(out.bytes, "\n"); line; line = strtok(NULL, "\n")) {
+        uint64_t addr;
+        char type;
+        int name_offset;
+        if (sscanf(line, "%" SCNx64 " %c %n", &addr, &type, &name_offset) != 2 ||
+            (type != 't' && type != 'T' && type != 'W'))
+        {
+            continue;
+        }
+
+        if (table->length == table->capacity) {
+            table->capacity = table->capacity ? table->capacity * 2 : 256;
+            table->items = realloc(table->items, table->capacity * sizeof(*table->items));
+        }
+        table->items[table->length++] = (Symbol){
+            .addr = addr,
+            .name = strdup(line + name_offset),
+        };
+    }
+    strbuf_free(&out);
+
+    if (table->length > 0) {
+        qsort(table->items, table->length, sizeof(*table->items), symbols_compare_addrs);
+    }
+    return true;
+}
+
+void symbols_free(SymbolTable *table) {
+    for (size_t i = 0; i < table->length; i++) {
+        free(table->items[i].name);
+    }
+    free(table->items);
+    *table = (SymbolTable){0};
+}
+
+Symbol *symbols_find(SymbolTable *table, uint64_t addr) {
+    size_t lo = 0;
+    size_t hi = table->length;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->items[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? &table->items[lo - 1] : NULL;
+}
+
+// Names `addr` after the function it's in, for when there is no line info.
+static void push_symbol_name(StrList *out, SymbolTable *table, uint64_t addr) {
+    Symbol *sym = symbols_find(table, addr);
+    if (sym) {
+        strlist_pushf(out, "%s+0x%" PRIx64, sym->name, addr - sym->addr);
+    } else {
+        strlist_pushf(out, "0x%" PRIx64, addr);
+    }
+}
+
+void symbols_locate(const char *exe, const uint64_t *addrs, size_t len, StrList *out) {
+    SymbolTable table = {0};
+    symbols_read(exe, true, &table);
+
+    const char *addr2line = getenv("ADDR2LINE");
+    StrList argv = {0};
+    strlist_push(&argv, addr2line && *addr2line ? addr2line : "addr2line");
+    strlist_push(&argv, "-C");
+    strlist_push(&argv, "-f");
+    strlist_push(&argv, "-e");
+    strlist_push(&argv, exe);
+    for (size_t i = 0; i < len; i++) {
+        strlist_pushf(&argv, "0x%" PRIx64, addrs[i]);
+    }
+
+    StrBuf output = {0};
+    int exit_code;
+    bool ok = len > 0 && proc_run_piped(argv.items, collect_output, &output, &exit_code) && exit_code == 0;
+    if (len > 0 && !ok) {
+        logprint(LOG_WARN, "Couldn't find source lines with '%s'. Set $ADDR2LINE to use another.", argv.items[0]);
+    }
+
+    // Paths under the project read better relative to it.
+    char cwd[PATH_MAX];
+    size_t cwd_len = getcwd(cwd, sizeof(cwd)) ? strlen(cwd) : 0;
+
+    // addr2line prints the function and then "file:line" for every address.
+    char *save;
+    char *function = ok ? strtok_r(output.bytes, "\n", &save) : NULL;
+    char *location = function ? strtok_r(NULL, "\n", &save) : NULL;
+    for (size_t i = 0; i < len; i++) {
+        if (!function || !location || strcmp(function, "??") == 0) {
+            push_symbol_name(out, &table, addrs[i]);
+        } else if (strncmp(location, "??", 2) == 0 || ends_with(location, ":?")) {
+            strlist_push(out, function);
+        } else {
+            char *discriminator = strstr(location, " (discriminator");
+            if (discriminator) {
+                *discriminator = '\0';
+            }
+            if (cwd_len > 0 && strncmp(location, cwd, cwd_len) == 0 && location[cwd_len] == '/') {
+                location += cwd_len + 1;
+            }
+            strlist_pushf(out, "%s at %s", function, location);
+        }
+
+        function = function ? strtok_r(NULL, "\n", &save) : NULL;
+        location = function ? strtok_r(NULL, "\n", &save) : NULL;
+    }
+
+    strbuf_free(&output);
+    strlist_free(&argv);
+    symbols_free(&table);
+}
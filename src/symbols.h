@@ -0,0 +1,39 @@
+#ifndef _SYMBOLS_H_
+#define _SYMBOLS_H_
+
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Symbol {
+	uint64_t addr;
+	char *name;
+	size_t samples;         // For callers to count hits in.
+} Symbol;
+
+typedef struct SymbolTable {
+	Symbol *items;
+	size_t length;
+	size_t capacity;
+} SymbolTable;
+
+// Reads the code symbols of `exe` with nm ($NM), sorted by address. C++
+// names are demangled if `demangle` is set.
+bool symbols_read(const char *exe, bool demangle, SymbolTable *table);
+void symbols_free(SymbolTable *table);
+
+// Returns the symbol whose code contains `addr`, assuming it runs until the
+// next one.
+Symbol *symbols_find(SymbolTable *table, uint64_t addr);
+
+// Names the function, source file and line of each of `addrs` in `exe`
+// with addr2line ($ADDR2LINE), pushing one line per address to `out`. Falls
+// back to function names from nm for code without debug info.
+void symbols_locate(const char *exe, const uint64_t *addrs, size_t len, StrList *out);
+
+// Sorts by address, which is how `symbols_read` leaves the table.
+int symbols_compare_addrs(const void *a, const void *b);
+
+#endif // _SYMBOLS_H_
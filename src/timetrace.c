@@ -0,0 +1,209 @@
+#include "timetrace.h"
+#include "json.h"
+#include "strmap.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PRINT_TOP_N (10)
+#define JSON_TOP_N (100)
+
+typedef struct Cost {
+    const char *name;       // Points into the map's key.
+    int64_t total_us;
+    size_t count;
+} Cost;
+
+typedef struct CostTable {
+    const char *title;
+    const char *json_key;
+    StrMap costs;           // Name -> Cost.
+} CostTable;
+
+static void add_cost(CostTable *table, const char *name, int64_t us) {
+    Cost *cost = strmap_get(&table->costs, name);
+    if (!cost) {
+        cost = calloc(1, sizeof(*cost));
+        strmap_put(&table->costs, name, cost);
+    }
+    cost->total_us += us;
+    cost->count++;
+}
+
+static int compare_costs(const void *a, const void *b) {
+    int64_t x = (*(const Cost *const *)a)->total_us;
+    int64_t y = (*(const Cost *const *)b)->total_us;
+    return (x < y) - (x > y);
+}
+
+// Returns the table's costs, most expensive first. Fixes up the names to
+// point at the map's keys.
+static Cost **sorted_costs(CostTable *table, size_t *length) {
+    Cost **sorted = malloc((table->costs.length + 1) * sizeof(*sorted));
+    *length = 0;
+    for (size_t i = 0; i < table->costs.capacity; i++) {
+        StrMapEntry *entry = &table->costs.entries[i];
+        if (entry->key) {
+            Cost *cost = entry->value;
+            cost->name = entry->key;
+            sorted[(*length)++] = cost;
+        }
+    }
+
+    if (*length > 0) {
+        qsort(sorted, *length, sizeof(*sorted), compare_costs);
+    }
+    return sorted;
+}
+
+static void cost_table_free(CostTable *table) {
+    for (size_t i = 0; i < table->costs.capacity; i++) {
+        free(table->costs.entries[i].value);
+    }
+    strmap_free(&table->costs);
+}
+
+// Optimization passes show up as "RunPass" with the pass in `detail` under
+// the legacy pass manager, and as events named after the pass under the
+// new one.
+static const char *pass_name(const char *name, const char *detail) {
+    if (strcmp(name, "RunPass") == 0) {
+        return detail;
+    }
+    if (ends_with(name, "Pass") && !starts_with(name, "Total ")) {
+        return name;
+    }
+    return NULL;
+}
+
+enum {
+    TABLE_UNITS,
+    TABLE_HEADERS,
+    TABLE_TEMPLATES,
+    TABLE_PASSES,
+    TABLE_COUNT
+};
+
+static bool add_trace(CostTable *tables, const char *path) {
+    size_t length;
+    char *text = read_file(path, &length);
+    if (!text) {
+        return false;
+    }
+
+    JsonValue doc;
+    bool ok = json_parse(text, length, &doc);
+    free(text);
+    if (!ok) {
+        logprint(LOG_WARN, "Couldn't parse time trace '%s'.", path);
+        return false;
+    }
+
+    const JsonValue *events = json_get(&doc, "traceEvents");
+    int64_t unit_us = 0;
+
+    for (size_t i = 0; events && events->type == JSON_ARRAY && i < events->length; i++) {
+        const JsonValue *ev = &events->items[i];
+        if (strcmp(json_string(json_get(ev, "ph"), ""), "X") != 0) {
+            continue;
+        }
+
+        const char *name = json_string(json_get(ev, "name"), "");
+        const char *detail = json_string(json_get(json_get(ev, "args"), "detail"), NULL);
+        int64_t dur = (int64_t)json_number(json_get(ev, "dur"), 0);
+
+        if (strcmp(name, "ExecuteCompiler") == 0) {
+            unit_us = dur;
+        } else if (strcmp(name, "Source") == 0 && detail) {
+            add_cost(&tables[TABLE_HEADERS], detail, dur);
+        } else if ((strcmp(name, "InstantiateClass") == 0 || strcmp(name, "InstantiateFunction") == 0) && detail) {
+            add_cost(&tables[TABLE_TEMPLATES], detail, dur);
+        } else {
+            const char *pass = pass_name(name, detail);
+            if (pass) {
+                add_cost(&tables[TABLE_PASSES], pass, dur);
+            }
+        }
+    }
+
+    // The trace sits next to the object file, named after it.
+    char unit[4096];
+    snprintf(unit, sizeof(unit), "%s", path);
+    if (ends_with(unit, ".json")) {
+        unit[strlen(unit) - strlen(".json")] = '\0';
+    }
+    add_cost(&tables[TABLE_UNITS], unit, unit_us);
+
+    json_free(&doc);
+    return true;
+}
+
+static void format_us(int64_t us, char *out, size_t size) {
+    format_duration(us * 1000, out, size);
+}
+
+bool time_trace_report(char *const *trace_paths, size_t trace_paths_len, const char *out_path) {
+    CostTable tables[TABLE_COUNT] = {
+        [TABLE_UNITS]     = { .title = "Slowest translation units", .json_key = "translation_units" },
+        [TABLE_HEADERS]   = { .title = "Most expensive headers (parse time including nested includes)", .json_key = "headers" },
+        [TABLE_TEMPLATES] = { .title = "Most expensive template instantiations", .json_key = "templates" },
+        [TABLE_PASSES]    = { .title = "Slowest optimization passes", .json_key = "passes" },
+    };
+
+    size_t traced = 0;
+    for (size_t i = 0; i < trace_paths_len; i++) {
+        if (add_trace(tables, trace_paths[i])) {
+            traced++;
+        }
+    }
+
+    printf("==== Time trace of %zu translation units ====\n", traced);
+
+    StrBuf json = {0};
+    strbuf_append(&json, "{");
+
+    for (int t = 0; t < TABLE_COUNT; t++) {
+        size_t length;
+        Cost **sorted = sorted_costs(&tables[t], &length);
+
+        if (length > 0) {
+            printf("%s:\n", tables[t].title);
+        }
+        for (size_t i = 0; i < length && i < PRINT_TOP_N; i++) {
+            char total[32];
+            format_us(sorted[i]->total_us, total, sizeof(total));
+            if (t == TABLE_UNITS) {
+                printf("%10s  %s\n", total, sorted[i]->name);
+            } else {
+                printf("%10s  %6zux  %s\n", total, sorted[i]->count, sorted[i]->name);
+            }
+        }
+
+        strbuf_append(&json, t == 0 ? "\n  " : ",\n  ");
+        strbuf_append_json(&json, tables[t].json_key);
+        strbuf_append(&json, ": [");
+        for (size_t i = 0; i < length && i < JSON_TOP_N; i++) {
+            strbuf_append(&json, i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ");
+            strbuf_append_json(&json, sorted[i]->name);
+            strbuf_appendf(&json, ", \"total_us\": %lld, \"count\": %zu}", (long long)sorted[i]->total_us, sorted[i]->count);
+        }
+        strbuf_append(&json, length > 0 ? "\n  ]" : "]");
+
+        free(sorted);
+        cost_table_free(&tables[t]);
+    }
+    strbuf_append(&json, "\n}\n");
+
+    bool ok = write_file_atomic(out_path, json.bytes, json.length);
+    if (ok) {
+        printf("Wrote the full report to '%s'.\n", out_path);
+    } else {
+        logprint(LOG_ERROR, "Failed to write '%s'.", out_path);
+    }
+
+    strbuf_free(&json);
+    return ok;
+}
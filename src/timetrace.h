@@ -0,0 +1,14 @@
+#ifndef _TIMETRACE_H_
+#define _TIMETRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Merges the traces clang writes for each translation unit with -ftime-trace
+// into one report of where the project's compile time goes: headers by total
+// parse time, template instantiations, optimization passes and the slowest
+// translation units. Prints the top entries of each and writes the longer
+// lists to `out_path` as JSON.
+bool time_trace_report(char *const *trace_paths, size_t trace_paths_len, const char *out_path);
+
+#endif // _TIMETRACE_H_
@@ -0,0 +1,89 @@
+#include "trace.h"
+#include "utils.h"
+
+typedef struct Tracer {
+    bool enabled;
+    int64_t origin_ns;
+    int max_lane;
+    StrBuf events;
+} Tracer;
+
+static Tracer tracer;
+
+void trace_start(void) {
+    strbuf_free(&tracer.events);
+    tracer = (Tracer){
+        .enabled = true,
+        .origin_ns = monotonic_ns(),
+    };
+}
+
+bool trace_enabled(void) {
+    return tracer.enabled;
+}
+
+void trace_add(const char *name, const char *category, int lane, int64_t start_ns, int64_t end_ns) {
+    if (!tracer.enabled) {
+        return;
+    }
+
+    if (lane > tracer.max_lane) {
+        tracer.max_lane = lane;
+    }
+
+    // Timestamps are in microseconds from the start of the trace.
+    double ts = (double)(start_ns - tracer.origin_ns) / 1000.0;
+    double dur = (double)(end_ns - start_ns) / 1000.0;
+
+    strbuf_append(&tracer.events, ",\n{\"name\":");
+    strbuf_append_json(&tracer.events, name ? name : "");
+    strbuf_append(&tracer.events, ",\"cat\":");
+    strbuf_append_json(&tracer.events, category);
+    strbuf_appendf(&tracer.events, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", lane, ts, dur);
+}
+
+void trace_jobs(const JobGraph *graph, const char *category) {
+    if (!tracer.enabled) {
+        return;
+    }
+
+    for (size_t i = 0; i < graph->length; i++) {
+        const Job *job = &graph->jobs[i];
+        if (job->done || job->failed) {
+            const char *name = job->label ? job->label : job->argv.items ? job->argv.items[0] : "job";
+            trace_add(name, category, job->lane + 1, job->start_ns, job->start_ns + job->duration_ns);
+        }
+    }
+}
+
+bool trace_finish(const char *path) {
+    if (!tracer.enabled) {
+        return true;
+    }
+
+    StrBuf out = {0};
+    strbuf_append(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    strbuf_append(&out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"bx\"}}");
+    for (int lane = 0; lane <= tracer.max_lane; lane++) {
+        strbuf_appendf(&out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", lane);
+        if (lane == TRACE_MAIN_LANE) {
+            strbuf_append(&out, "\"bx\"}}");
+        } else {
+            strbuf_appendf(&out, "\"worker %d\"}}", lane);
+        }
+    }
+    if (tracer.events.length > 0) {
+        strbuf_append_len(&out, tracer.events.bytes, tracer.events.length);
+    }
+    strbuf_append(&out, "\n]}\n");
+
+    bool ok = write_file_atomic(path, out.bytes, out.length);
+    if (!ok) {
+        logprint(LOG_ERROR, "Failed to write trace to '%s'.", path);
+    }
+
+    strbuf_free(&out);
+    strbuf_free(&tracer.events);
+    tracer = (Tracer){0};
+    return ok;
+}
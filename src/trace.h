@@ -0,0 +1,28 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "jobs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records a timeline of the build in Chrome's trace event format, for
+// chrome://tracing or ui.perfetto.dev. Everything is a no-op until
+// `trace_start` is called.
+
+// Lane 0 is bx itself. Jobs run on lanes 1 and up, one per worker.
+#define TRACE_MAIN_LANE (0)
+
+void trace_start(void);
+bool trace_enabled(void);
+
+// Adds an event spanning `start_ns` to `end_ns`, in `monotonic_ns` time.
+void trace_add(const char *name, const char *category, int lane, int64_t start_ns, int64_t end_ns);
+
+// Adds an event for every job in `graph` that has run, on its worker's lane.
+void trace_jobs(const JobGraph *graph, const char *category);
+
+// Writes everything recorded so far to `path` and stops tracing.
+bool trace_finish(const char *path);
+
+#endif // _TRACE_H_
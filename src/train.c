@@ -0,0 +1,167 @@
+#include "train.h"
+#include "builder.h"
+#include "hash.h"
+#include "proc.h"
+#include "strmap.h"
+#include "trace.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Appends a "<hash> <path>" line for every file under `dir`.
+static void fingerprint_tree(StrBuf *out, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    StrList names = {0};
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            strlist_push(&names, entry->d_name);
+        }
+    }
+    closedir(d);
+
+    if (names.length > 0) {
+        qsort(names.items, names.length, sizeof(*names.items), compare_names);
+    }
+
+    for (size_t i = 0; i < names.length; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, names.items[i]);
+
+        struct stat s;
+        if (stat(path, &s) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(s.st_mode)) {
+            fingerprint_tree(out, path);
+        } else {
+            uint64_t h = HASH_SEED;
+            if (hash_file(&h, path)) {
+                strbuf_appendf(out, "%016" PRIx64 " %s\n", h, path);
+            }
+        }
+    }
+
+    strlist_free(&names);
+}
+
+void train_fingerprint(StrBuf *out, const ProjConf *proj, const StrList *train_args) {
+    strbuf_appendf(out, "%s %s:", project_compiler(proj), project_uses_clang(proj) ? "clang" : "gcc");
+    if (train_args->length > 0) {
+        for (size_t i = 0; i < train_args->length; i++) {
+            strbuf_appendf(out, " %s", train_args->items[i]);
+        }
+    } else if (proj->pgo_train) {
+        strbuf_appendf(out, " %s", proj->pgo_train);
+    }
+    strbuf_append(out, "\n");
+    fingerprint_tree(out, proj->src_dir);
+}
+
+bool train_profile_fresh(const char *old, const char *current) {
+    const char *old_files = strchr(old, '\n');
+    const char *current_files = strchr(current, '\n');
+    if (!old_files || !current_files ||
+        old_files - old != current_files - current ||
+        strncmp(old, current, (size_t)(old_files - old)) != 0)
+    {
+        return false;
+    }
+
+    // Path -> hash line from the old fingerprint.
+    StrMap hashes = {0};
+    char *copy = strdup(old_files + 1);
+    size_t old_count = 0;
+    for (char *line = strtok(copy, "\n"); line; line = strtok(NULL, "\n")) {
+        char *path = strchr(line, ' ');
+        if (path) {
+            *path = '\0';
+            strmap_put(&hashes, path + 1, line);
+            old_count++;
+        }
+    }
+
+    size_t new_count = 0;
+    size_t kept = 0;
+    size_t changed = 0;
+    char *lines = strdup(current_files + 1);
+    for (char *line = strtok(lines, "\n"); line; line = strtok(NULL, "\n")) {
+        char *path = strchr(line, ' ');
+        if (!path) {
+            continue;
+        }
+        *path = '\0';
+        new_count++;
+
+        const char *old_hash = strmap_get(&hashes, path + 1);
+        if (old_hash) {
+            kept++;
+        }
+        if (!old_hash || strcmp(old_hash, line) != 0) {
+            changed++;
+        }
+    }
+
+    // Files that were removed count as changed too.
+    changed += old_count - kept;
+    size_t total = new_count > old_count ? new_count : old_count;
+
+    free(lines);
+    free(copy);
+    strmap_free(&hashes);
+
+    return total > 0 && (double)changed / (double)total <= TRAIN_MAX_DRIFT;
+}
+
+bool train_run(const ProjConf *proj, const StrList *train_args) {
+    char exe_path[PATH_MAX];
+    snprintf(exe_path, sizeof(exe_path), "%s/release/%s", proj->out_dir, proj->exe_name);
+
+    // The setting is a command line, so it may redirect input or output.
+    StrList argv = {0};
+    if (train_args->length == 0 && proj->pgo_train) {
+        strlist_push(&argv, "/bin/sh");
+        strlist_push(&argv, "-c");
+        strlist_pushf(&argv, "'%s' %s", exe_path, proj->pgo_train);
+    } else {
+        strlist_push(&argv, exe_path);
+        strlist_extend(&argv, train_args);
+        if (train_args->length == 0) {
+            logprint(LOG_INFO, "No training arguments. Set `pgo_train` in conf.ini or pass them after `--`.");
+        }
+    }
+
+    printf("==== Training %s ====\n", proj->exe_name);
+    fflush(stdout);
+
+    int64_t start = monotonic_ns();
+    int exit_code;
+    bool ran = proc_run(argv.items, &exit_code);
+    trace_add("Train profile", "phase", TRACE_MAIN_LANE, start, monotonic_ns());
+    strlist_free(&argv);
+
+    if (!ran) {
+        logprint(LOG_ERROR, "Failed to run '%s'.", exe_path);
+        return false;
+    }
+    if (exit_code != 0) {
+        logprint(LOG_ERROR, "Training run exited with code %d.", exit_code);
+        return false;
+    }
+
+    return true;
+}
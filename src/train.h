@@ -0,0 +1,25 @@
+#ifndef _TRAIN_H_
+#define _TRAIN_H_
+
+#include "conf.h"
+#include "utils.h"
+
+#include <stdbool.h>
+
+// Share of the source files that may change, appear or disappear before a
+// profile from a training run is recorded again.
+#define TRAIN_MAX_DRIFT (0.2)
+
+// Describes what a profile is recorded from. The first line names the
+// compiler and training run, and the rest hash every source file.
+void train_fingerprint(StrBuf *out, const ProjConf *proj, const StrList *train_args);
+
+// Returns true if a profile recorded with the `old` fingerprint is still
+// good for the `current` one. The first lines have to match exactly.
+bool train_profile_fresh(const char *old, const char *current);
+
+// Runs the release executable with `train_args`, or with the project's
+// `pgo_train` setting if there are none.
+bool train_run(const ProjConf *proj, const StrList *train_args);
+
+#endif // _TRAIN_H_
@@ -2,8 +2,16 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <time.h>
+#include <unistd.h>
 
 #define TWINE_IMPLEMENTATION
 #include "twine.h"
@@ -38,8 +46,18 @@ bool process_options(ArgIter *args, void *cmd_data, const CmdFlagInfo *flags, si
             const CmdFlagInfo *flag = &flags[i];
             if (iter_check_flags(args, flag->names)) {
                 flag_found = true;
-                iter_next(args);
+                const char *arg = iter_next(args);
+
+                // The handler reads the value of `--name=value` like it
+                // would read `--name value`.
+                const char *value = is_long(arg) ? strchr(arg, '=') : NULL;
+                args->value = value ? value + 1 : NULL;
+
                 bool ok = flag->cmd(args, cmd_data);
+                if (ok && iter_value(args)) {
+                    logprint(LOG_ERROR, "`--%s` doesn't take a value.", flag->long_name);
+                    ok = false;
+                }
                 if (!ok) {
                     return false;
                 }
@@ -68,6 +86,423 @@ bool starts_with(const char *s, const char *prefix) {
     return strncmp(s, prefix, strlen(prefix)) == 0;
 }
 
+bool ends_with(const char *s, const char *suffix) {
+    size_t slen = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return slen >= suffix_len && strcmp(s + slen - suffix_len, suffix) == 0;
+}
+
+static void strlist_reserve(StrList *list, size_t n) {
+    if (list->length + n + 1 <= list->capacity) {
+        return;
+    }
+
+    size_t capacity = list->capacity ? list->capacity * 2 : 16;
+    while (capacity < list->length + n + 1) {
+        capacity *= 2;
+    }
+
+    list->items = realloc(list->items, capacity * sizeof(*list->items));
+    list->capacity = capacity;
+}
+
+void strlist_push(StrList *list, const char *s) {
+    strlist_reserve(list, 1);
+    list->items[list->length++] = strdup(s);
+    list->items[list->length] = NULL;
+}
+
+void strlist_pushf(StrList *list, const char *__restrict fmt, ...) {
+    char *s = NULL;
+
+    va_list args;
+    va_start(args, fmt);
+        int len = vasprintf(&s, fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        logprint(LOG_FATAL, "Out of memory.");
+        exit(1);
+    }
+
+    strlist_reserve(list, 1);
+    list->items[list->length++] = s;
+    list->items[list->length] = NULL;
+}
+
+void strlist_extend(StrList *list, const StrList *other) {
+    strlist_reserve(list, other->length);
+    for (size_t i = 0; i < other->length; i++) {
+        list->items[list->length++] = strdup(other->items[i]);
+    }
+    list->items[list->length] = NULL;
+}
+
+void strlist_free(StrList *list) {
+    for (size_t i = 0; i < list->length; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    *list = (StrList){0};
+}
+
+void strbuf_append_len(StrBuf *buf, const char *s, size_t len) {
+    if (buf->length + len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 256;
+        while (capacity < buf->length + len + 1) {
+            capacity *= 2;
+        }
+        buf->bytes = realloc(buf->bytes, capacity);
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->bytes + buf->length, s, len);
+    buf->length += len;
+    buf->bytes[buf->length] = '\0';
+}
+
+void strbuf_append(StrBuf *buf, const char *s) {
+    strbuf_append_len(buf, s, strlen(s));
+}
+
+void strbuf_appendf(StrBuf *buf, const char *__restrict fmt, ...) {
+    char *s = NULL;
+
+    va_list args;
+    va_start(args, fmt);
+        int len = vasprintf(&s, fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        logprint(LOG_FATAL, "Out of memory.");
+        exit(1);
+    }
+
+    strbuf_append_len(buf, s, len);
+    free(s);
+}
+
+void strbuf_append_json(StrBuf *buf, const char *s) {
+    strbuf_append(buf, "\"");
+    for (const char *c = s; *c != '\0'; c++) {
+        switch (*c) {
+            case '"':  strbuf_append(buf, "\\\""); break;
+            case '\\': strbuf_append(buf, "\\\\"); break;
+            case '\n': strbuf_append(buf, "\\n"); break;
+            case '\t': strbuf_append(buf, "\\t"); break;
+            default:
+                if ((unsigned char)*c < 0x20) {
+                    strbuf_appendf(buf, "\\u%04x", *c);
+                } else {
+                    strbuf_append_len(buf, c, 1);
+                }
+        }
+    }
+    strbuf_append(buf, "\"");
+}
+
+void strbuf_free(StrBuf *buf) {
+    free(buf->bytes);
+    *buf = (StrBuf){0};
+}
+
+bool make_dirs(const char *path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    for (char *c = buf + 1; ; c++) {
+        if (*c != '/' && *c != '\0') {
+            continue;
+        }
+
+        char saved = *c;
+        *c = '\0';
+        if (mkdir(buf, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1 && errno != EEXIST) {
+            const char *err = strerror(errno);
+            logprint(LOG_ERROR, "Failed to create directory '%s': %s.", buf, err);
+            return false;
+        }
+        *c = saved;
+
+        if (saved == '\0') {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool make_parent_dirs(const char *path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    char *slash = strrchr(buf, '/');
+    if (!slash || slash == buf) {
+        return true;
+    }
+
+    *slash = '\0';
+    return make_dirs(buf);
+}
+
+bool file_mtime(const char *path, int64_t *mtime_ns) {
+    struct stat s;
+    if (stat(path, &s) != 0) {
+        return false;
+    }
+
+#ifdef __APPLE__
+    *mtime_ns = (int64_t)s.st_mtimespec.tv_sec * 1000000000 + s.st_mtimespec.tv_nsec;
+#else
+    *mtime_ns = (int64_t)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t timeval_ns(struct timeval tv) {
+    return (int64_t)tv.tv_sec * 1000000000 + (int64_t)tv.tv_usec * 1000;
+}
+
+char *read_file(const char *path, size_t *length) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    size_t len = 0;
+    char *contents = malloc(capacity);
+
+    size_t n;
+    while ((n = fread(contents + len, 1, capacity - len - 1, f)) > 0) {
+        len += n;
+        if (capacity - len - 1 == 0) {
+            capacity *= 2;
+            contents = realloc(contents, capacity);
+        }
+    }
+
+    fclose(f);
+
+    contents[len] = '\0';
+    if (length) *length = len;
+    return contents;
+}
+
+// Copies `src` to `dst` through a temporary file so readers never observe a
+// partially written `dst`.
+bool copy_file(const char *src, const char *dst) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", dst, (int)getpid());
+
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        return false;
+    }
+
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+
+    bool ok = true;
+    char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            ok = false;
+            break;
+        }
+    }
+
+    ok = ok && !ferror(in);
+    fclose(in);
+    ok = fclose(out) == 0 && ok;
+
+    if (ok && rename(tmp, dst) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+// Writes `contents` to a temporary file and renames it over `path`.
+bool write_file_atomic(const char *path, const char *contents, size_t length) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        return false;
+    }
+
+    bool ok = fwrite(contents, 1, length, f) == length;
+    ok = fclose(f) == 0 && ok;
+
+    if (ok && rename(tmp, path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp);
+    }
+    return ok;
+}
+
+bool write_file_if_changed(const char *path, const char *contents, size_t length) {
+    size_t old_length;
+    char *old = read_file(path, &old_length);
+    if (old) {
+        bool same = old_length == length && memcmp(old, contents, length) == 0;
+        free(old);
+        if (same) {
+            return true;
+        }
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to open '%s': %s.", path, err);
+        return false;
+    }
+
+    bool ok = fwrite(contents, 1, length, f) == length;
+    fclose(f);
+
+    if (!ok) {
+        logprint(LOG_ERROR, "Failed to write '%s'.", path);
+    }
+    return ok;
+}
+
+bool parse_toggle(const char *s, Toggle *out) {
+    if (strcasecmp(s, "on") == 0 || strcasecmp(s, "true") == 0 || strcasecmp(s, "yes") == 0) {
+        *out = TOGGLE_ON;
+        return true;
+    }
+
+    if (strcasecmp(s, "off") == 0 || strcasecmp(s, "false") == 0 || strcasecmp(s, "no") == 0) {
+        *out = TOGGLE_OFF;
+        return true;
+    }
+
+    return false;
+}
+
+static const char *linker_names[] = {
+    [LINKER_DEFAULT] = "default",
+    [LINKER_LLD] = "lld",
+    [LINKER_MOLD] = "mold",
+    [LINKER_GOLD] = "gold",
+};
+
+bool parse_linker(const char *s, Linker *out) {
+    for (Linker l = LINKER_DEFAULT; l <= LINKER_GOLD; l++) {
+        if (strcasecmp(s, linker_names[l]) == 0) {
+            *out = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *linker_name(Linker linker) {
+    return linker_names[linker == LINKER_UNSET ? LINKER_DEFAULT : linker];
+}
+
+bool parse_lto(const char *s, Lto *out) {
+    if (strcasecmp(s, "off") == 0) {
+        *out = LTO_OFF;
+    } else if (strcasecmp(s, "full") == 0) {
+        *out = LTO_FULL;
+    } else if (strcasecmp(s, "thin") == 0) {
+        *out = LTO_THIN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses sizes like `512M`, `5G` or `1048576` (bytes).
+bool parse_size(const char *s, uint64_t *out) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s) {
+        return false;
+    }
+
+    uint64_t scale = 1;
+    switch (toupper(*end)) {
+        case '\0': break;
+        case 'K': scale = 1ull << 10; end++; break;
+        case 'M': scale = 1ull << 20; end++; break;
+        case 'G': scale = 1ull << 30; end++; break;
+        case 'T': scale = 1ull << 40; end++; break;
+        default: return false;
+    }
+
+    if (toupper(*end) == 'B') end++;
+    if (toupper(*end) == 'I' && toupper(end[1]) == 'B') end += 2;
+    if (*end != '\0') {
+        return false;
+    }
+
+    *out = (uint64_t)n * scale;
+    return true;
+}
+
+void format_size(uint64_t size, char *out, size_t out_size) {
+    static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+
+    double value = (double)size;
+    size_t unit = 0;
+    while (value >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+        value /= 1024.0;
+        unit++;
+    }
+
+    if (unit == 0) {
+        snprintf(out, out_size, "%llu B", (unsigned long long)size);
+    } else {
+        snprintf(out, out_size, "%.1f %s", value, units[unit]);
+    }
+}
+
+void format_duration(int64_t ns, char *out, size_t out_size) {
+    if (ns < 1000000) {
+        snprintf(out, out_size, "%.0fus", (double)ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(out, out_size, "%.1fms", (double)ns / 1e6);
+    } else {
+        snprintf(out, out_size, "%.2fs", (double)ns / 1e9);
+    }
+}
+
+// Adds thousands separators, like 1,234,567.
+void format_count(uint64_t n, char *out, size_t out_size) {
+    char digits[32];
+    snprintf(digits, sizeof(digits), "%" PRIu64, n);
+
+    size_t len = strlen(digits);
+    size_t j = 0;
+    for (size_t i = 0; i < len && j + 2 < out_size; i++) {
+        if (i > 0 && (len - i) % 3 == 0) {
+            out[j++] = ',';
+        }
+        out[j++] = digits[i];
+    }
+    out[j] = '\0';
+}
+
 #define COLOR_RESET "\033[m"
 #define COLOR_DEBUG "\033[32m"
 #define COLOR_INFO  "\033[36m"
@@ -2,6 +2,9 @@
 #define _UTILS_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 #include "argiter.h"
 #include "commands/cmd.h"
@@ -35,6 +38,78 @@ bool process_options(ArgIter *args, void *cmd_data, const CmdFlagInfo *flags, si
 
 char *strupper(char *s);
 bool starts_with(const char *s, const char *prefix);
+bool ends_with(const char *s, const char *suffix);
+
+// Growable list of owned strings. `items` is always NULL terminated so it
+// can be handed straight to `execvp`.
+typedef struct StrList {
+    char **items;
+    size_t length;
+    size_t capacity;
+} StrList;
+
+void strlist_push(StrList *list, const char *s);
+void strlist_pushf(StrList *list, const char *__restrict fmt, ...);
+void strlist_extend(StrList *list, const StrList *other);
+void strlist_free(StrList *list);
+
+// Growable, always NUL terminated byte buffer.
+typedef struct StrBuf {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+} StrBuf;
+
+void strbuf_append(StrBuf *buf, const char *s);
+void strbuf_append_len(StrBuf *buf, const char *s, size_t len);
+void strbuf_appendf(StrBuf *buf, const char *__restrict fmt, ...);
+void strbuf_append_json(StrBuf *buf, const char *s);
+void strbuf_free(StrBuf *buf);
+
+bool make_dirs(const char *path);
+bool make_parent_dirs(const char *path);
+bool file_mtime(const char *path, int64_t *mtime_ns);
+
+// Nanoseconds on the monotonic clock. Job timings, trace events and timeouts
+// all use it, so they can be compared with each other.
+int64_t monotonic_ns(void);
+int64_t timeval_ns(struct timeval tv);
+char *read_file(const char *path, size_t *length);
+bool copy_file(const char *src, const char *dst);
+bool write_file_atomic(const char *path, const char *contents, size_t length);
+bool write_file_if_changed(const char *path, const char *contents, size_t length);
+
+typedef enum Toggle {
+    TOGGLE_UNSET = 0,
+    TOGGLE_OFF,
+    TOGGLE_ON
+} Toggle;
+
+bool parse_toggle(const char *s, Toggle *out);
+
+typedef enum Linker {
+    LINKER_UNSET = 0,
+    LINKER_DEFAULT,
+    LINKER_LLD,
+    LINKER_MOLD,
+    LINKER_GOLD
+} Linker;
+
+bool parse_linker(const char *s, Linker *out);
+const char *linker_name(Linker linker);
+
+typedef enum Lto {
+    LTO_UNSET = 0,
+    LTO_OFF,
+    LTO_FULL,
+    LTO_THIN
+} Lto;
+
+bool parse_lto(const char *s, Lto *out);
+bool parse_size(const char *s, uint64_t *out);
+void format_size(uint64_t size, char *out, size_t out_size);
+void format_duration(int64_t ns, char *out, size_t out_size);
+void format_count(uint64_t n, char *out, size_t out_size);
 
 typedef enum LogLevel {
     LOG_NONE,
@@ -52,9 +127,12 @@ typedef enum Dialect {
     C99 = 0,
     C11,
     C17,
+    C23,
     CPP11,
     CPP14,
     CPP17,
+    CPP20,
+    CPP23,
     DIALECT_COUNT
 } Dialect;
 
@@ -62,9 +140,12 @@ static const char *dialect_names[DIALECT_COUNT] = {
     "c99",
     "c11",
     "c17",
+    "c23",
     "c++11",
     "c++14",
-    "c++17"
+    "c++17",
+    "c++20",
+    "c++23"
 };
 
 Dialect dialect_from_str(const char *s);
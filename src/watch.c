@@ -0,0 +1,248 @@
+#include "watch.h"
+#include "hash.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Editors write swap and backup files next to the ones being edited. Those
+// shouldn't trigger builds.
+static bool is_ignored(const char *name) {
+    return name[0] == '.' || ends_with(name, "~");
+}
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+struct Watcher {
+    int fd;
+    char **paths;           // Indexed by watch descriptor.
+    size_t paths_len;
+};
+
+static void watch_tree(Watcher *w, const char *dir) {
+    int wd = inotify_add_watch(w->fd, dir, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        return;
+    }
+
+    if ((size_t)wd >= w->paths_len) {
+        size_t len = (size_t)wd * 2 + 1;
+        w->paths = realloc(w->paths, len * sizeof(*w->paths));
+        memset(w->paths + w->paths_len, 0, (len - w->paths_len) * sizeof(*w->paths));
+        w->paths_len = len;
+    }
+    free(w->paths[wd]);
+    w->paths[wd] = strdup(dir);
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        struct stat s;
+        if (stat(path, &s) == 0 && S_ISDIR(s.st_mode)) {
+            watch_tree(w, path);
+        }
+    }
+
+    closedir(d);
+}
+
+Watcher *watcher_new(const char *dir) {
+    Watcher *w = calloc(1, sizeof(*w));
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd == -1) {
+        const char *err = strerror(errno);
+        logprint(LOG_ERROR, "Failed to initialize inotify: %s.", err);
+        free(w);
+        return NULL;
+    }
+
+    watch_tree(w, dir);
+    return w;
+}
+
+void watcher_free(Watcher *w) {
+    if (!w) {
+        return;
+    }
+
+    for (size_t i = 0; i < w->paths_len; i++) {
+        free(w->paths[i]);
+    }
+    free(w->paths);
+    close(w->fd);
+    free(w);
+}
+
+// Reads pending events. Returns true if any of them matter.
+static bool read_events(Watcher *w) {
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if (len <= 0) {
+        return false;
+    }
+
+    bool changed = false;
+    for (char *p = buf; p < buf + len; ) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        p += sizeof(*ev) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            changed = true;
+            continue;
+        }
+
+        if (ev->len > 0 && is_ignored(ev->name)) {
+            continue;
+        }
+        changed = true;
+
+        // New directories need watches of their own.
+        bool new_dir = (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+        if (new_dir && ev->wd >= 0 && (size_t)ev->wd < w->paths_len && w->paths[ev->wd]) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", w->paths[ev->wd], ev->name);
+            watch_tree(w, path);
+        }
+    }
+
+    return changed;
+}
+
+bool watcher_wait(Watcher *w, int settle_ms) {
+    bool changed = false;
+    for (;;) {
+        struct pollfd p = { .fd = w->fd, .events = POLLIN };
+        int ready = poll(&p, 1, changed ? settle_ms : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            const char *err = strerror(errno);
+            logprint(LOG_ERROR, "Failed to wait for changes: %s.", err);
+            return false;
+        }
+
+        if (ready == 0) {
+            return true;
+        }
+
+        changed |= read_events(w);
+    }
+}
+
+#else
+
+// Without inotify the tree is fingerprinted a few times a second.
+#define POLL_INTERVAL_MS (250)
+
+struct Watcher {
+    char *dir;
+    uint64_t fingerprint;
+};
+
+static void fingerprint_tree(uint64_t *h, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (is_ignored(entry->d_name)) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        struct stat s;
+        if (stat(path, &s) != 0) {
+            continue;
+        }
+
+        int64_t mtime = 0;
+        file_mtime(path, &mtime);
+
+        *h = hash_str(*h, path);
+        *h = hash_bytes(*h, &mtime, sizeof(mtime));
+        *h = hash_bytes(*h, &s.st_size, sizeof(s.st_size));
+
+        if (S_ISDIR(s.st_mode)) {
+            fingerprint_tree(h, path);
+        }
+    }
+
+    closedir(d);
+}
+
+static uint64_t fingerprint(const Watcher *w) {
+    uint64_t h = HASH_SEED;
+    fingerprint_tree(&h, w->dir);
+    return h;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+Watcher *watcher_new(const char *dir) {
+    Watcher *w = calloc(1, sizeof(*w));
+    w->dir = strdup(dir);
+    w->fingerprint = fingerprint(w);
+    return w;
+}
+
+void watcher_free(Watcher *w) {
+    if (!w) {
+        return;
+    }
+
+    free(w->dir);
+    free(w);
+}
+
+bool watcher_wait(Watcher *w, int settle_ms) {
+    uint64_t h;
+    while ((h = fingerprint(w)) == w->fingerprint) {
+        sleep_ms(POLL_INTERVAL_MS);
+    }
+
+    int quiet_ms = 0;
+    while (quiet_ms < settle_ms) {
+        sleep_ms(POLL_INTERVAL_MS);
+        uint64_t next = fingerprint(w);
+        quiet_ms = next == h ? quiet_ms + POLL_INTERVAL_MS : 0;
+        h = next;
+    }
+
+    w->fingerprint = h;
+    return true;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include <stdbool.h>
+
+// Notices changes to any file under a directory tree. Uses inotify on Linux
+// and polls modification times elsewhere.
+typedef struct Watcher Watcher;
+
+Watcher *watcher_new(const char *dir);
+void watcher_free(Watcher *w);
+
+// Blocks until something under the directory changes, then keeps waiting
+// until nothing has changed for `settle_ms` so a burst of saves only counts
+// once. Returns false if watching failed.
+bool watcher_wait(Watcher *w, int settle_ms);
+
+#endif // _WATCH_H_